@@ -0,0 +1,992 @@
+// 微基准，直接把db.c编进来调用存储引擎的函数
+// 编译: cc -O2 -o bench bench.c -lpthread -lm
+// 运行: ./bench [search|parse|concurrent|scan|snapshot|commit]
+//       ./bench ycsb [--rows N] [--ops N] [--cache-pages N] [--mmap] [--workloads a,b,...]
+// ycsb输出一个JSON对象，方便不同版本之间对比
+#define DB_NO_MAIN
+#include "db.c"
+#include <math.h>
+#include <sys/resource.h>
+
+#define BENCH_SEARCHES 4000000
+#define BENCH_PROBES 4096
+//并发测试预先装入的行数和每轮时长
+#define BENCH_CONCURRENT_ROWS 200000
+#define BENCH_CONCURRENT_SECONDS 1
+#define BENCH_SCAN_ROWS 16
+//成组提交测试里flusher的窗口
+#define BENCH_COMMIT_WINDOW_MS 2
+//聚合扫描的表大小
+#define BENCH_AGGREGATE_ROWS 2000000
+//ycsb默认的表大小和每个负载的操作数
+#define YCSB_DEFAULT_ROWS 1000000
+#define YCSB_DEFAULT_OPS 200000
+//短扫描长度在1到100之间均匀取，和YCSB的workload E一样
+#define YCSB_MAX_SCAN_LENGTH 100
+//短扫描的操作数是点查的1/10，整表扫描固定做几遍
+#define YCSB_SCAN_OPS_DIVISOR 10
+#define YCSB_FULL_SCANS 5
+#define YCSB_ZIPF_THETA 0.99
+
+//微基准用进程CPU时间，机器上别的负载不会算进来
+double bench_now(){
+  struct timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//多线程的吞吐量要看墙上时间
+double bench_wall(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//旧格式：child和key交错存放，二分时每次跳8字节
+uint32_t key_search_interleaved(const uint32_t* cells, uint32_t num_keys, uint32_t key){
+  uint32_t min_index = 0;
+  uint32_t max_index = num_keys;
+  while(min_index != max_index){
+    uint32_t index = (min_index + max_index)/2;
+    if(cells[2 * index + 1] >= key){
+      max_index = index;
+    }else{
+      min_index = index + 1;
+    }
+  }
+  return min_index;
+}
+
+//单个中间节点里找孩子的耗时，旧的交错格式对比连续key数组上的各个实现
+void bench_node_search(){
+  uint32_t sizes[] = {8, 32, 128, INTERNAL_NODE_MAX_CELLS};
+  uint32_t keys[INTERNAL_NODE_MAX_CELLS];
+  uint32_t cells[2 * INTERNAL_NODE_MAX_CELLS];
+  uint32_t probes[BENCH_PROBES];
+
+  struct {
+    const char* name;
+    KeySearchFunction search;
+  } kernels[4];
+  uint32_t num_kernels = 0;
+  kernels[num_kernels].name = "scalar";
+  kernels[num_kernels++].search = key_search_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("sse4.2")){
+    kernels[num_kernels].name = "sse4.2";
+    kernels[num_kernels++].search = key_search_sse42;
+  }
+  if(__builtin_cpu_supports("avx2")){
+    kernels[num_kernels].name = "avx2";
+    kernels[num_kernels++].search = key_search_avx2;
+  }
+#endif
+
+  srand(1);
+  printf("node search, ns per search\n");
+  printf("%6s %12s", "keys", "interleaved");
+  for(uint32_t k = 0; k < num_kernels; k++){
+    printf(" %12s", kernels[k].name);
+  }
+  printf("\n");
+
+  for(uint32_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++){
+    uint32_t num_keys = sizes[s];
+    //key间隔随机，跨过2^31以覆盖无符号比较
+    uint32_t key = 0x7FFFF000u - num_keys * 8;
+    for(uint32_t i = 0; i < num_keys; i++){
+      key += 1 + rand() % 16;
+      keys[i] = key;
+      cells[2 * i] = i;
+      cells[2 * i + 1] = key;
+    }
+    for(uint32_t i = 0; i < BENCH_PROBES; i++){
+      probes[i] = keys[0] - 4 + rand() % (key - keys[0] + 8);
+    }
+
+    for(uint32_t i = 0; i < BENCH_PROBES; i++){
+      uint32_t expected = key_search_interleaved(cells, num_keys, probes[i]);
+      for(uint32_t k = 0; k < num_kernels; k++){
+        if(kernels[k].search(keys, num_keys, probes[i]) != expected){
+          printf("%s disagrees on key %u\n", kernels[k].name, probes[i]);
+          exit(EXIT_FAILURE);
+        }
+      }
+    }
+
+    volatile uint32_t sink = 0;
+    double start = bench_now();
+    for(uint32_t i = 0; i < BENCH_SEARCHES; i++){
+      sink += key_search_interleaved(cells, num_keys, probes[i % BENCH_PROBES]);
+    }
+    printf("%6d %12.2f", num_keys, (bench_now() - start) * 1e9 / BENCH_SEARCHES);
+
+    for(uint32_t k = 0; k < num_kernels; k++){
+      start = bench_now();
+      for(uint32_t i = 0; i < BENCH_SEARCHES; i++){
+        sink += kernels[k].search(keys, num_keys, probes[i % BENCH_PROBES]);
+      }
+      printf(" %12.2f", (bench_now() - start) * 1e9 / BENCH_SEARCHES);
+    }
+    printf("\n");
+  }
+}
+
+//--batch的解析开销：把一块输入逐行切开并解析成Statement，不执行
+void bench_parse(){
+  uint32_t num_lines = 100000;
+  size_t capacity = (size_t)num_lines * 64;
+  char * input = malloc(capacity);
+  size_t length = 0;
+  srand(1);
+  for(uint32_t i = 0; i < num_lines; i++){
+    if(i % 4 == 3){
+      length += sprintf(input + length, "select where id between %d and %d limit 10\n", i, i + 100);
+    }else{
+      uint32_t id = rand();
+      length += sprintf(input + length, "insert %u user%u user%u@example.com\n", id, id, id);
+    }
+  }
+
+  uint32_t rounds = 20;
+  uint32_t parsed = 0;
+  Statement statement;
+  double start = bench_now();
+  for(uint32_t r = 0; r < rounds; r++){
+    char * p = input;
+    char * end = input + length;
+    while(p < end){
+      char * newline = memchr(p, '\n', end - p);
+      if(parse_statement(p, newline - p, &statement) == PREPARE_SUCCESS){
+        parsed++;
+      }
+      p = newline + 1;
+    }
+  }
+  double elapsed = bench_now() - start;
+  if(parsed != num_lines * rounds){
+    printf("parse failed on %d lines\n", num_lines * rounds - parsed);
+    exit(EXIT_FAILURE);
+  }
+  printf("statement parse, ns per statement\n%12.2f\n", elapsed * 1e9 / parsed);
+  free(input);
+}
+
+typedef struct {
+  Table* table;
+  uint32_t seed;
+  uint64_t operations;
+  bool* stop;
+} BenchWorker;
+
+void bench_check_row(Row* row){
+  char username[COLUMN_USERNAME_SIZE + 1];
+  snprintf(username, sizeof(username), "user%u", row->id);
+  if(strcmp(row->username, username) != 0){
+    printf("row %u has username %s\n", row->id, row->username);
+    exit(EXIT_FAILURE);
+  }
+}
+
+//读线程：八成点查预先装入的偶数id，两成从随机位置往后扫几行，读到的行都要对得上
+void* bench_reader(void* arg){
+  BenchWorker* worker = arg;
+  Row row;
+  while(!__atomic_load_n(worker->stop, __ATOMIC_RELAXED)){
+    uint32_t r = rand_r(&worker->seed);
+    uint32_t id = 2 * (1 + r % BENCH_CONCURRENT_ROWS);
+    if(r % 10 < 8){
+      if(!table_get(worker->table, id, &row)){
+        printf("id %u not found\n", id);
+        exit(EXIT_FAILURE);
+      }
+      bench_check_row(&row);
+    }else{
+      Cursor* cursor = table_seek(worker->table, id);
+      uint32_t previous = 0;
+      for(uint32_t i = 0; i < BENCH_SCAN_ROWS && !cursor->end_of_table; i++){
+        cursor_row(cursor, &row);
+        if(row.id <= previous){
+          printf("scan out of order at %u\n", row.id);
+          exit(EXIT_FAILURE);
+        }
+        bench_check_row(&row);
+        previous = row.id;
+        cursor_advance(cursor);
+      }
+      cursor_close(cursor);
+    }
+    worker->operations++;
+  }
+  arena_free(&thread_arena);
+  return NULL;
+}
+
+//写线程：插入随机的奇数id，每条提交一次
+void* bench_writer(void* arg){
+  BenchWorker* worker = arg;
+  Statement statement;
+  statement.type = STATEMENT_INSERT;
+  while(!__atomic_load_n(worker->stop, __ATOMIC_RELAXED)){
+    uint32_t id = 2 * (rand_r(&worker->seed) % BENCH_CONCURRENT_ROWS) + 1;
+    statement.row_to_insert.id = id;
+    sprintf(statement.row_to_insert.username, "user%u", id);
+    sprintf(statement.row_to_insert.email, "user%u@example.com", id);
+    execute_statement(&statement, worker->table);
+    worker->operations++;
+  }
+  arena_free(&thread_arena);
+  return NULL;
+}
+
+//多个读线程和一个写线程同时跑，读线程数从1翻倍到核数的两倍
+void bench_concurrent(PagerMode mode){
+  char filename[] = "/tmp/bench-XXXXXX";
+  int fd = mkstemp(filename);
+  if(fd == -1){
+    printf("mkstemp error\n");
+    exit(EXIT_FAILURE);
+  }
+  close(fd);
+  DbConfig config;
+  db_config_init(&config);
+  config.mode = mode;
+  config.cache_pages = PAGER_MIN_CACHE_PAGES;
+  Table* table = db_open(filename, &config);
+
+  Row* rows = malloc(sizeof(Row) * BENCH_CONCURRENT_ROWS);
+  for(uint32_t i = 0; i < BENCH_CONCURRENT_ROWS; i++){
+    rows[i].id = 2 * (i + 1);
+    sprintf(rows[i].username, "user%u", rows[i].id);
+    sprintf(rows[i].email, "user%u@example.com", rows[i].id);
+  }
+  uint32_t num_duplicates;
+  table_insert_batch(table, rows, BENCH_CONCURRENT_ROWS, &num_duplicates);
+  pager_commit(table->pager);
+  free(rows);
+
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  printf("concurrent %s, %ld cores, ops per second\n",
+         mode == PAGER_MMAP ? "mmap" : "buffered", cores);
+  printf("%8s %12s %12s\n", "readers", "reads", "writes");
+  for(uint32_t num_readers = 1; num_readers <= 2 * cores || num_readers <= 2; num_readers *= 2){
+    bool stop = false;
+    BenchWorker workers[num_readers + 1];
+    pthread_t threads[num_readers + 1];
+    for(uint32_t i = 0; i <= num_readers; i++){
+      workers[i].table = table;
+      workers[i].seed = i + 1;
+      workers[i].operations = 0;
+      workers[i].stop = &stop;
+    }
+    double start = bench_wall();
+    pthread_create(&threads[0], NULL, bench_writer, &workers[0]);
+    for(uint32_t i = 1; i <= num_readers; i++){
+      pthread_create(&threads[i], NULL, bench_reader, &workers[i]);
+    }
+    struct timespec duration = {BENCH_CONCURRENT_SECONDS, 0};
+    nanosleep(&duration, NULL);
+    __atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+    uint64_t reads = 0;
+    for(uint32_t i = 0; i <= num_readers; i++){
+      pthread_join(threads[i], NULL);
+      if(i > 0){
+        reads += workers[i].operations;
+      }
+    }
+    double elapsed = bench_wall() - start;
+    printf("%8d %12.0f %12.0f\n", num_readers, reads / elapsed, workers[0].operations / elapsed);
+  }
+
+  db_close(table);
+  char wal_filename[sizeof(filename) + 4];
+  snprintf(wal_filename, sizeof(wal_filename), "%s-wal", filename);
+  unlink(filename);
+  unlink(wal_filename);
+}
+
+//写线程：随机插入或者删掉一个奇数id，树一直在分裂和合并
+void* bench_snapshot_writer(void* arg){
+  BenchWorker* worker = arg;
+  Statement statement;
+  statement.filter.active = false;
+  while(!__atomic_load_n(worker->stop, __ATOMIC_RELAXED)){
+    uint32_t r = rand_r(&worker->seed);
+    uint32_t id = 2 * (r % BENCH_CONCURRENT_ROWS) + 1;
+    if(r % 2 == 0){
+      statement.type = STATEMENT_INSERT;
+      statement.row_to_insert.id = id;
+      sprintf(statement.row_to_insert.username, "user%u", id);
+      sprintf(statement.row_to_insert.email, "user%u@example.com", id);
+    }else{
+      statement.type = STATEMENT_DELETE;
+      statement.id_min = id;
+      statement.id_max = id;
+    }
+    execute_statement(&statement, worker->table);
+    worker->operations++;
+  }
+  arena_free(&thread_arena);
+  return NULL;
+}
+
+//扫描线程：每次开一个快照从头扫到尾，行要有序、内容对得上，行数要等于快照开始时的行数
+void* bench_snapshot_reader(void* arg){
+  BenchWorker* worker = arg;
+  Row row;
+  while(!__atomic_load_n(worker->stop, __ATOMIC_RELAXED)){
+    Snapshot* snapshot = snapshot_begin(worker->table);
+    Cursor* cursor = table_seek_at(worker->table, snapshot, 0);
+    uint64_t count = 0;
+    uint32_t previous = 0;
+    while(!cursor->end_of_table){
+      cursor_row(cursor, &row);
+      if(count > 0 && row.id <= previous){
+        printf("snapshot scan out of order at %u\n", row.id);
+        exit(EXIT_FAILURE);
+      }
+      bench_check_row(&row);
+      previous = row.id;
+      count++;
+      cursor_advance(cursor);
+    }
+    cursor_close(cursor);
+    if(count != snapshot->row_count){
+      printf("snapshot scan saw %lu rows, expected %lu\n", (unsigned long)count,
+             (unsigned long)snapshot->row_count);
+      exit(EXIT_FAILURE);
+    }
+    snapshot_end(worker->table, snapshot);
+    worker->operations++;
+  }
+  arena_free(&thread_arena);
+  return NULL;
+}
+
+//所有线程加起来的计数器当前值
+uint64_t bench_counter(StatCounter counter){
+  StatsBlock* total = malloc(sizeof(StatsBlock));
+  stats_collect(total);
+  uint64_t value = total->counters[counter];
+  free(total);
+  return value;
+}
+
+//整表的快照扫描和一个不停插入删除的写线程同时跑，扫描线程数从1翻倍到核数
+void bench_snapshot(PagerMode mode){
+  char filename[] = "/tmp/bench-XXXXXX";
+  int fd = mkstemp(filename);
+  if(fd == -1){
+    printf("mkstemp error\n");
+    exit(EXIT_FAILURE);
+  }
+  close(fd);
+  DbConfig config;
+  db_config_init(&config);
+  config.mode = mode;
+  config.cache_pages = PAGER_MIN_CACHE_PAGES;
+  Table* table = db_open(filename, &config);
+
+  Row* rows = malloc(sizeof(Row) * BENCH_CONCURRENT_ROWS);
+  for(uint32_t i = 0; i < BENCH_CONCURRENT_ROWS; i++){
+    rows[i].id = 2 * (i + 1);
+    sprintf(rows[i].username, "user%u", rows[i].id);
+    sprintf(rows[i].email, "user%u@example.com", rows[i].id);
+  }
+  uint32_t num_duplicates;
+  table_insert_batch(table, rows, BENCH_CONCURRENT_ROWS, &num_duplicates);
+  pager_commit(table->pager);
+  free(rows);
+
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  printf("snapshot scans %s, %ld cores, ops per second\n",
+         mode == PAGER_MMAP ? "mmap" : "buffered", cores);
+  printf("%8s %12s %12s %12s\n", "scanners", "scans", "writes", "versions");
+  for(uint32_t num_readers = 1; num_readers <= cores || num_readers <= 2; num_readers *= 2){
+    bool stop = false;
+    BenchWorker workers[num_readers + 1];
+    pthread_t threads[num_readers + 1];
+    for(uint32_t i = 0; i <= num_readers; i++){
+      workers[i].table = table;
+      workers[i].seed = i + 1;
+      workers[i].operations = 0;
+      workers[i].stop = &stop;
+    }
+    uint64_t versions_before = bench_counter(STAT_PAGE_VERSIONS);
+    double start = bench_wall();
+    pthread_create(&threads[0], NULL, bench_snapshot_writer, &workers[0]);
+    for(uint32_t i = 1; i <= num_readers; i++){
+      pthread_create(&threads[i], NULL, bench_snapshot_reader, &workers[i]);
+    }
+    struct timespec duration = {BENCH_CONCURRENT_SECONDS, 0};
+    nanosleep(&duration, NULL);
+    __atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+    uint64_t scans = 0;
+    for(uint32_t i = 0; i <= num_readers; i++){
+      pthread_join(threads[i], NULL);
+      if(i > 0){
+        scans += workers[i].operations;
+      }
+    }
+    double elapsed = bench_wall() - start;
+    printf("%8d %12.1f %12.0f %12lu\n", num_readers, scans / elapsed, workers[0].operations / elapsed,
+           (unsigned long)(bench_counter(STAT_PAGE_VERSIONS) - versions_before));
+  }
+
+  db_close(table);
+  char wal_filename[sizeof(filename) + 4];
+  snprintf(wal_filename, sizeof(wal_filename), "%s-wal", filename);
+  unlink(filename);
+  unlink(wal_filename);
+}
+
+//成组提交测试的写线程从这里领id，各线程插入的行不重复
+uint32_t bench_commit_next_id;
+
+//提交测试的写线程：每条insert单独提交
+void* bench_commit_writer(void* arg){
+  BenchWorker* worker = arg;
+  Statement statement;
+  statement.type = STATEMENT_INSERT;
+  while(!__atomic_load_n(worker->stop, __ATOMIC_RELAXED)){
+    uint32_t id = __atomic_add_fetch(&bench_commit_next_id, 1, __ATOMIC_RELAXED);
+    statement.row_to_insert.id = id;
+    sprintf(statement.row_to_insert.username, "user%u", id);
+    sprintf(statement.row_to_insert.email, "user%u@example.com", id);
+    execute_statement(&statement, worker->table);
+    worker->operations++;
+  }
+  arena_free(&thread_arena);
+  return NULL;
+}
+
+//多个写线程同时提交，写线程数从1翻倍到核数的两倍
+//窗口为0时每次fdatasync只带走已经写进WAL的提交，窗口大于0时flusher把窗口内的提交合成一次
+void bench_commit(uint32_t window_ms){
+  char filename[] = "/tmp/bench-XXXXXX";
+  int fd = mkstemp(filename);
+  if(fd == -1){
+    printf("mkstemp error\n");
+    exit(EXIT_FAILURE);
+  }
+  close(fd);
+  DbConfig config;
+  db_config_init(&config);
+  config.wal_sync_window_ms = window_ms;
+  Table* table = db_open(filename, &config);
+  bench_commit_next_id = 0;
+
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  printf("commit, sync window %ums, %ld cores\n", window_ms, cores);
+  printf("%8s %12s %12s\n", "writers", "commits/s", "syncs/commit");
+  for(uint32_t num_writers = 1; num_writers <= 2 * cores || num_writers <= 2; num_writers *= 2){
+    bool stop = false;
+    BenchWorker workers[num_writers];
+    pthread_t threads[num_writers];
+    for(uint32_t i = 0; i < num_writers; i++){
+      workers[i].table = table;
+      workers[i].seed = i + 1;
+      workers[i].operations = 0;
+      workers[i].stop = &stop;
+    }
+    uint64_t syncs_before = bench_counter(STAT_WAL_SYNCS);
+    double start = bench_wall();
+    for(uint32_t i = 0; i < num_writers; i++){
+      pthread_create(&threads[i], NULL, bench_commit_writer, &workers[i]);
+    }
+    struct timespec duration = {BENCH_CONCURRENT_SECONDS, 0};
+    nanosleep(&duration, NULL);
+    __atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+    uint64_t commits = 0;
+    for(uint32_t i = 0; i < num_writers; i++){
+      pthread_join(threads[i], NULL);
+      commits += workers[i].operations;
+    }
+    double elapsed = bench_wall() - start;
+    uint64_t syncs = bench_counter(STAT_WAL_SYNCS) - syncs_before;
+    printf("%8d %12.0f %12.3f\n", num_writers, commits / elapsed, commits == 0 ? 0.0 : (double)syncs / commits);
+  }
+
+  db_close(table);
+  char wal_filename[sizeof(filename) + 4];
+  snprintf(wal_filename, sizeof(wal_filename), "%s-wal", filename);
+  unlink(filename);
+  unlink(wal_filename);
+}
+
+//select count(*), sum(id), avg(len(email))，扫描线程数从1翻倍到核数的两倍
+void bench_scan(){
+  char filename[] = "/tmp/bench-XXXXXX";
+  int fd = mkstemp(filename);
+  if(fd == -1){
+    printf("mkstemp error\n");
+    exit(EXIT_FAILURE);
+  }
+  close(fd);
+  DbConfig config;
+  db_config_init(&config);
+  config.cache_pages = 65536;
+  Table* table = db_open(filename, &config);
+
+  Row* rows = malloc(sizeof(Row) * BENCH_AGGREGATE_ROWS);
+  uint64_t expected_sum = 0;
+  for(uint32_t i = 0; i < BENCH_AGGREGATE_ROWS; i++){
+    rows[i].id = i + 1;
+    sprintf(rows[i].username, "user%u", rows[i].id);
+    sprintf(rows[i].email, "user%u@example.com", rows[i].id);
+    expected_sum += rows[i].id;
+  }
+  uint32_t num_duplicates;
+  table_insert_batch(table, rows, BENCH_AGGREGATE_ROWS, &num_duplicates);
+  pager_commit(table->pager);
+  free(rows);
+
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  printf("aggregate scan of %d rows, %ld cores\n", BENCH_AGGREGATE_ROWS, cores);
+  printf("%8s %12s %12s\n", "threads", "ms", "rows/s");
+  for(uint32_t threads = 1; threads <= 2 * cores || threads <= 2; threads *= 2){
+    if(threads > SCAN_MAX_THREADS){
+      break;
+    }
+    table->scan_threads = threads;
+    AggregateState state;
+    double start = bench_wall();
+    table_aggregate(table, 0, UINT32_MAX, NULL, &state);
+    double elapsed = bench_wall() - start;
+    if(state.count != BENCH_AGGREGATE_ROWS || state.sum[AGGREGATE_ID] != expected_sum){
+      printf("aggregate mismatch with %d threads\n", threads);
+      exit(EXIT_FAILURE);
+    }
+    printf("%8d %12.1f %12.0f\n", threads, elapsed * 1e3, state.count / elapsed);
+  }
+
+  db_close(table);
+  char wal_filename[sizeof(filename) + 4];
+  snprintf(wal_filename, sizeof(wal_filename), "%s-wal", filename);
+  unlink(filename);
+  unlink(wal_filename);
+}
+
+//xorshift64*，比rand_r周期长，取值覆盖整个uint32
+uint64_t ycsb_random(uint64_t* state){
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 2685821657736338717ULL;
+}
+
+//YCSB的Zipfian生成器（Gray等人的算法），返回[0, n)里的排名，0最热
+//排名再哈希打散成id，热点不会都挤在表头几个叶子里
+typedef struct {
+  uint64_t n;
+  double theta;
+  double alpha;
+  double zetan;
+  double eta;
+} Zipfian;
+
+void zipfian_init(Zipfian* z, uint64_t n, double theta){
+  double zeta2 = 1 + pow(0.5, theta);
+  z->n = n;
+  z->theta = theta;
+  z->alpha = 1 / (1 - theta);
+  z->zetan = 0;
+  for(uint64_t i = 1; i <= n; i++){
+    z->zetan += 1 / pow(i, theta);
+  }
+  z->eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / z->zetan);
+}
+
+uint64_t zipfian_next(Zipfian* z, uint64_t* state){
+  double u = (ycsb_random(state) >> 11) * (1.0 / 9007199254740992.0);
+  double uz = u * z->zetan;
+  if(uz < 1){
+    return 0;
+  }
+  if(uz < 1 + pow(0.5, z->theta)){
+    return 1;
+  }
+  uint64_t rank = z->n * pow(z->eta * u - z->eta + 1, z->alpha);
+  return rank < z->n ? rank : z->n - 1;
+}
+
+uint32_t ycsb_scramble(uint64_t rank, uint32_t rows){
+  uint64_t h = rank * 0x9E3779B97F4A7C15ULL;
+  h ^= h >> 32;
+  return 1 + h % rows;
+}
+
+typedef struct {
+  uint32_t rows;
+  uint32_t ops;
+  uint32_t cache_pages;
+  PagerMode mode;
+  const char* workloads;
+} YcsbConfig;
+
+//一个负载的统计：每个操作的延迟（纳秒），以及期间读写的页数和缺页数
+//seconds是各个操作耗时的和，两次操作之间重新打开表之类的准备工作不算
+typedef struct {
+  const char* name;
+  uint32_t* latencies;
+  uint32_t ops;
+  double seconds;
+  uint64_t pages_read;
+  uint64_t pages_written;
+  long major_faults;
+} YcsbRun;
+
+long ycsb_major_faults(){
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_majflt;
+}
+
+void ycsb_init(YcsbRun* run, const char* name, uint32_t ops){
+  run->name = name;
+  run->latencies = malloc(sizeof(uint32_t) * ops);
+  run->ops = 0;
+  run->seconds = 0;
+  run->pages_read = 0;
+  run->pages_written = 0;
+  run->major_faults = 0;
+}
+
+//begin和end之间读写的页数累加进run，先减后加
+void ycsb_counters_begin(YcsbRun* run, Table* table){
+  run->pages_read -= table->pager->pages_read;
+  run->pages_written -= table->pager->pages_written;
+  run->major_faults -= ycsb_major_faults();
+}
+
+void ycsb_counters_end(YcsbRun* run, Table* table){
+  run->pages_read += table->pager->pages_read;
+  run->pages_written += table->pager->pages_written;
+  run->major_faults += ycsb_major_faults();
+}
+
+void ycsb_record(YcsbRun* run, double op_start){
+  double elapsed = bench_wall() - op_start;
+  double ns = elapsed * 1e9;
+  run->seconds += elapsed;
+  run->latencies[run->ops++] = ns > UINT32_MAX ? UINT32_MAX : ns;
+}
+
+int compare_latency(const void* a, const void* b){
+  uint32_t x = *(const uint32_t*)a;
+  uint32_t y = *(const uint32_t*)b;
+  return (x > y) - (x < y);
+}
+
+double ycsb_percentile(YcsbRun* run, double p){
+  uint32_t index = p * run->ops;
+  if(index >= run->ops){
+    index = run->ops - 1;
+  }
+  return run->latencies[index] / 1e3;
+}
+
+void ycsb_print(YcsbRun* run, bool first){
+  qsort(run->latencies, run->ops, sizeof(uint32_t), compare_latency);
+  printf("%s\n    {\"name\": \"%s\", \"ops\": %u, \"seconds\": %.3f, \"ops_per_sec\": %.0f,\n",
+         first ? "" : ",", run->name, run->ops, run->seconds, run->ops / run->seconds);
+  printf("     \"latency_us\": {\"p50\": %.2f, \"p99\": %.2f, \"p999\": %.2f, \"max\": %.2f},\n",
+         ycsb_percentile(run, 0.5), ycsb_percentile(run, 0.99), ycsb_percentile(run, 0.999),
+         run->latencies[run->ops - 1] / 1e3);
+  printf("     \"pages_read_per_op\": %.4f, \"pages_written_per_op\": %.4f, \"major_faults_per_op\": %.4f}",
+         (double)run->pages_read / run->ops, (double)run->pages_written / run->ops,
+         (double)run->major_faults / run->ops);
+  free(run->latencies);
+}
+
+bool ycsb_selected(YcsbConfig* config, const char* name){
+  if(config->workloads == NULL){
+    return true;
+  }
+  size_t length = strlen(name);
+  const char* p = config->workloads;
+  while((p = strstr(p, name)) != NULL){
+    bool starts = p == config->workloads || p[-1] == ',';
+    bool ends = p[length] == '\0' || p[length] == ',';
+    if(starts && ends){
+      return true;
+    }
+    p += length;
+  }
+  return false;
+}
+
+void ycsb_unlink(const char* filename){
+  char path[PATH_MAX];
+  unlink(filename);
+  snprintf(path, sizeof(path), "%s-wal", filename);
+  unlink(path);
+  snprintf(path, sizeof(path), "%s-sum", filename);
+  unlink(path);
+}
+
+Table* ycsb_open(const char* filename, YcsbConfig* config){
+  DbConfig db_config;
+  db_config_init(&db_config);
+  db_config.mode = config->mode;
+  db_config.cache_pages = config->cache_pages;
+  return db_open(filename, &db_config);
+}
+
+//关掉再打开，并让内核丢掉这个文件的页缓存，读负载从冷缓存开始
+Table* ycsb_reopen(Table* table, const char* filename, YcsbConfig* config){
+  db_close(table);
+  int fd = open(filename, O_RDONLY);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+  return ycsb_open(filename, config);
+}
+
+void ycsb_fill_row(Row* row, uint32_t id){
+  row->id = id;
+  sprintf(row->username, "user%u", id);
+  sprintf(row->email, "user%u@example.com", id);
+}
+
+//逐行插入，每行一条语句一次提交；结束时的checkpoint算进写页数，不算进延迟
+void ycsb_insert(YcsbConfig* config, const char* filename, const char* name, bool random, bool* first){
+  ycsb_unlink(filename);
+  Table* table = ycsb_open(filename, config);
+  uint32_t* ids = malloc(sizeof(uint32_t) * config->rows);
+  for(uint32_t i = 0; i < config->rows; i++){
+    ids[i] = i + 1;
+  }
+  if(random){
+    uint64_t state = 1;
+    for(uint32_t i = config->rows - 1; i > 0; i--){
+      uint32_t j = ycsb_random(&state) % (i + 1);
+      uint32_t t = ids[i];
+      ids[i] = ids[j];
+      ids[j] = t;
+    }
+  }
+
+  Statement statement;
+  statement.type = STATEMENT_INSERT;
+  YcsbRun run;
+  ycsb_init(&run, name, config->rows);
+  ycsb_counters_begin(&run, table);
+  for(uint32_t i = 0; i < config->rows; i++){
+    ycsb_fill_row(&statement.row_to_insert, ids[i]);
+    double start = bench_wall();
+    if(execute_statement(&statement, table) != EXECUTE_SUCCESS){
+      printf("insert %u failed\n", ids[i]);
+      exit(EXIT_FAILURE);
+    }
+    ycsb_record(&run, start);
+  }
+  pager_checkpoint(table->pager);
+  ycsb_counters_end(&run, table);
+  ycsb_print(&run, *first);
+  *first = false;
+
+  free(ids);
+  db_close(table);
+}
+
+void ycsb_lookup(YcsbConfig* config, Table* table, const char* name, bool zipfian, bool* first){
+  Zipfian z;
+  if(zipfian){
+    zipfian_init(&z, config->rows, YCSB_ZIPF_THETA);
+  }
+  uint64_t state = 2;
+  Row row;
+  YcsbRun run;
+  ycsb_init(&run, name, config->ops);
+  ycsb_counters_begin(&run, table);
+  for(uint32_t i = 0; i < config->ops; i++){
+    uint32_t id = zipfian ? ycsb_scramble(zipfian_next(&z, &state), config->rows)
+                          : 1 + ycsb_random(&state) % config->rows;
+    double start = bench_wall();
+    bool found = table_get(table, id, &row);
+    ycsb_record(&run, start);
+    if(!found){
+      printf("id %u not found\n", id);
+      exit(EXIT_FAILURE);
+    }
+  }
+  ycsb_counters_end(&run, table);
+  ycsb_print(&run, *first);
+  *first = false;
+  arena_reset(&thread_arena);
+}
+
+//从随机位置往后读1到100行
+void ycsb_scan_short(YcsbConfig* config, Table* table, bool* first){
+  uint32_t ops = config->ops / YCSB_SCAN_OPS_DIVISOR;
+  uint64_t state = 3;
+  Row row;
+  YcsbRun run;
+  ycsb_init(&run, "scan_short", ops);
+  ycsb_counters_begin(&run, table);
+  for(uint32_t i = 0; i < ops; i++){
+    uint32_t id = 1 + ycsb_random(&state) % config->rows;
+    uint32_t length = 1 + ycsb_random(&state) % YCSB_MAX_SCAN_LENGTH;
+    double start = bench_wall();
+    Cursor* cursor = table_seek(table, id);
+    for(uint32_t n = 0; n < length && !cursor->end_of_table; n++){
+      cursor_row(cursor, &row);
+      cursor_advance(cursor);
+    }
+    cursor_close(cursor);
+    ycsb_record(&run, start);
+  }
+  ycsb_counters_end(&run, table);
+  ycsb_print(&run, *first);
+  *first = false;
+  arena_reset(&thread_arena);
+}
+
+//单个cursor从头扫到尾，每遍之前重新打开，都是冷扫描
+Table* ycsb_scan_full(YcsbConfig* config, Table* table, const char* filename, bool* first){
+  Row row;
+  YcsbRun run;
+  ycsb_init(&run, "scan_full", YCSB_FULL_SCANS);
+  for(uint32_t i = 0; i < YCSB_FULL_SCANS; i++){
+    table = ycsb_reopen(table, filename, config);
+    ycsb_counters_begin(&run, table);
+    uint32_t count = 0;
+    double start = bench_wall();
+    Cursor* cursor = table_start(table);
+    while(!cursor->end_of_table){
+      cursor_row(cursor, &row);
+      count++;
+      cursor_advance(cursor);
+    }
+    cursor_close(cursor);
+    ycsb_record(&run, start);
+    ycsb_counters_end(&run, table);
+    if(count != config->rows){
+      printf("full scan saw %u of %u rows\n", count, config->rows);
+      exit(EXIT_FAILURE);
+    }
+  }
+  ycsb_print(&run, *first);
+  *first = false;
+  arena_reset(&thread_arena);
+  return table;
+}
+
+//先测两种插入，再把1..rows批量装进一张表，冷缓存依次测点查和扫描
+void bench_ycsb(YcsbConfig* config){
+  char filename[] = "/tmp/bench-XXXXXX";
+  int fd = mkstemp(filename);
+  if(fd == -1){
+    printf("mkstemp error\n");
+    exit(EXIT_FAILURE);
+  }
+  close(fd);
+
+  printf("{\"bench\": \"ycsb\", \"format_version\": %d, \"rows\": %u, \"ops\": %u, "
+         "\"cache_pages\": %u, \"mode\": \"%s\",\n \"workloads\": [",
+         HEADER_FORMAT_VERSION, config->rows, config->ops, config->cache_pages,
+         config->mode == PAGER_MMAP ? "mmap" : "buffered");
+  bool first = true;
+  if(ycsb_selected(config, "insert_seq")){
+    ycsb_insert(config, filename, "insert_seq", false, &first);
+  }
+  if(ycsb_selected(config, "insert_random")){
+    ycsb_insert(config, filename, "insert_random", true, &first);
+  }
+
+  bool reads = ycsb_selected(config, "lookup_uniform") || ycsb_selected(config, "lookup_zipfian") ||
+               ycsb_selected(config, "scan_short") || ycsb_selected(config, "scan_full");
+  if(reads){
+    ycsb_unlink(filename);
+    Table* table = ycsb_open(filename, config);
+    Row* rows = malloc(sizeof(Row) * config->rows);
+    for(uint32_t i = 0; i < config->rows; i++){
+      ycsb_fill_row(&rows[i], i + 1);
+    }
+    uint32_t num_duplicates;
+    table_insert_batch(table, rows, config->rows, &num_duplicates);
+    pager_commit(table->pager);
+    free(rows);
+
+    if(ycsb_selected(config, "lookup_uniform")){
+      table = ycsb_reopen(table, filename, config);
+      ycsb_lookup(config, table, "lookup_uniform", false, &first);
+    }
+    if(ycsb_selected(config, "lookup_zipfian")){
+      table = ycsb_reopen(table, filename, config);
+      ycsb_lookup(config, table, "lookup_zipfian", true, &first);
+    }
+    if(ycsb_selected(config, "scan_short")){
+      table = ycsb_reopen(table, filename, config);
+      ycsb_scan_short(config, table, &first);
+    }
+    if(ycsb_selected(config, "scan_full")){
+      table = ycsb_scan_full(config, table, filename, &first);
+    }
+    db_close(table);
+  }
+  printf("\n ]}\n");
+  ycsb_unlink(filename);
+}
+
+int ycsb_main(int argc, char * argv[]){
+  YcsbConfig config;
+  config.rows = YCSB_DEFAULT_ROWS;
+  config.ops = YCSB_DEFAULT_OPS;
+  config.cache_pages = PAGER_DEFAULT_CACHE_PAGES;
+  config.mode = PAGER_BUFFERED;
+  config.workloads = NULL;
+  for(int i = 2; i < argc; i++){
+    if(strcmp(argv[i], "--rows") == 0 && i + 1 < argc){
+      config.rows = atoi(argv[++i]);
+    }else if(strcmp(argv[i], "--ops") == 0 && i + 1 < argc){
+      config.ops = atoi(argv[++i]);
+    }else if(strcmp(argv[i], "--cache-pages") == 0 && i + 1 < argc){
+      config.cache_pages = atoi(argv[++i]);
+    }else if(strcmp(argv[i], "--mmap") == 0){
+      config.mode = PAGER_MMAP;
+    }else if(strcmp(argv[i], "--workloads") == 0 && i + 1 < argc){
+      config.workloads = argv[++i];
+    }else{
+      printf("unknown option '%s'\n", argv[i]);
+      exit(EXIT_FAILURE);
+    }
+  }
+  if(config.rows < 2 || config.ops < YCSB_SCAN_OPS_DIVISOR){
+    printf("--rows must be at least 2 and --ops at least %d\n", YCSB_SCAN_OPS_DIVISOR);
+    exit(EXIT_FAILURE);
+  }
+  bench_ycsb(&config);
+  return 0;
+}
+
+int main(int argc, char * argv[]){
+  //ycsb输出JSON，不和其它表格混在一起，只在单独指定时运行
+  if(argc >= 2 && strcmp(argv[1], "ycsb") == 0){
+    return ycsb_main(argc, argv);
+  }
+  bool all = argc < 2;
+  if(all || strcmp(argv[1], "search") == 0){
+    bench_node_search();
+  }
+  if(all || strcmp(argv[1], "parse") == 0){
+    bench_parse();
+  }
+  if(all || strcmp(argv[1], "concurrent") == 0){
+    bench_concurrent(PAGER_BUFFERED);
+    bench_concurrent(PAGER_MMAP);
+  }
+  if(all || strcmp(argv[1], "scan") == 0){
+    bench_scan();
+  }
+  if(all || strcmp(argv[1], "snapshot") == 0){
+    bench_snapshot(PAGER_BUFFERED);
+    bench_snapshot(PAGER_MMAP);
+  }
+  if(all || strcmp(argv[1], "commit") == 0){
+    bench_commit(0);
+    bench_commit(BENCH_COMMIT_WINDOW_MS);
+  }
+  return 0;
+}
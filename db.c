@@ -1,11 +1,21 @@
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/io_uring.h>
+#include <math.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 
 typedef struct {
@@ -14,9 +24,21 @@ typedef struct {
     size_t input_length;
 } InputBuffer;
 
+//零拷贝的词：指向输入缓冲区里的一段字节，不复制也不写'\0'
+typedef struct {
+  const char * start;
+  uint32_t length;
+} Token;
+
+//普通语句最多这么多个词，insert values另外扫描
+#define STATEMENT_MAX_TOKENS 16
+//--batch每次从输入读这么多字节
+#define BATCH_READ_SIZE (1U << 20)
+
 typedef enum {
   EXECUTE_SUCCESS,
   EXECUTE_DUPLICATE_KEY,
+  EXECUTE_INDEX_EXISTS,
 } ExecuteResult;
 
 typedef enum {
@@ -24,29 +46,315 @@ typedef enum {
   META_COMMAND_UNRECOGNIZED_COMMAND,
 } MetaCommandResult;
 
-typedef enum {NODE_INTERNAL, NODE_LEAF}  NodeType;
+//NODE_CATALOG是旧文件的目录页，NODE_FREE是free list上的空闲页，NODE_HEADER是第0页的文件头
+//这几种都不是B+树的节点
+typedef enum {NODE_INTERNAL, NODE_LEAF, NODE_CATALOG, NODE_FREE, NODE_HEADER}  NodeType;
+
+//缓冲池默认4096帧(16MB)
+//中间节点分裂要改所有搬走的孩子的父指针，这些页在语句提交前都不能换出
+//最少2048帧保证一串分裂一直传到根也放得下
+#define PAGER_DEFAULT_CACHE_PAGES 4096
+#define PAGER_MIN_CACHE_PAGES 2048
+#define INVALID_PAGE_NUM UINT32_MAX
+#define INVALID_FRAME UINT32_MAX
+//mmap模式预留64GB地址空间，文件增长时映射不会搬家，已经拿到的页地址一直有效
+#define PAGER_MMAP_RESERVE_BYTES (64ULL << 30)
+//mmap模式每次至少扩展256页，减少ftruncate次数
+#define PAGER_MMAP_GROW_PAGES 256
+//合并写回时一次pwritev最多写256页
+#define PAGER_FLUSH_MAX_RUN 256
+//帧的slab按透明大页对齐，开了--huge-pages时整段建议内核用2MB的页
+#define PAGER_HUGE_PAGE_BYTES (2ULL << 20)
+//扫描默认提前读后面32个叶子，同时在路上的预读最多64页
+//内核不让用io_uring时退回到4个线程pread
+#define PAGER_DEFAULT_READAHEAD_PAGES 32
+#define PAGER_READAHEAD_MAX_INFLIGHT 64
+#define IO_POOL_THREADS 4
+//io_uring_enter遇到EINTR、EAGAIN、EBUSY时重试的次数，还不行就同步读
+#define IO_URING_SUBMIT_RETRIES 16
+
+typedef enum {
+  PAGER_BUFFERED,
+  PAGER_MMAP,
+} PagerMode;
+
+//select结果的输出格式：(id, username, email)文本、CSV、带长度前缀的二进制
+typedef enum {
+  OUTPUT_TEXT,
+  OUTPUT_CSV,
+  OUTPUT_BINARY,
+} OutputFormat;
+
+//WAL默认每次提交都fdatasync，超过64MB做一次checkpoint
+//窗口大于0时提交要等flusher把窗口内的提交一起落盘，多个线程同时提交时才划算
+#define WAL_DEFAULT_SYNC_WINDOW_MS 0
+#define WAL_DEFAULT_CHECKPOINT_BYTES (64ULL << 20)
+#define WAL_BUFFER_SIZE (1U << 20)
+
+typedef struct {
+  uint32_t cache_pages;
+  PagerMode mode;
+  //聚合查询的扫描线程数，默认取CPU核数
+  uint32_t scan_threads;
+  //0表示每条语句提交时都fdatasync
+  uint32_t wal_sync_window_ms;
+  uint64_t wal_checkpoint_bytes;
+  //给每页记校验和，只在新建文件或者第一次打开时生效，之后以文件头为准
+  bool checksums;
+  //缓冲池的slab用透明大页
+  bool huge_pages;
+  //顺着next_leaf扫描时提前读的叶子数，0表示不预读
+  uint32_t readahead_pages;
+  OutputFormat output_format;
+} DbConfig;
+
+typedef enum {
+  WAL_PAGE_RECORD = 1,
+  WAL_COMMIT_RECORD = 2,
+} WalRecordType;
+
+//WAL记录头，页记录后面紧跟一整页的镜像
+//提交记录的page_num存提交时数据库的页数
+typedef struct {
+  uint32_t type;
+  uint32_t page_num;
+  uint32_t checksum;
+} WalRecordHeader;
+
+//lsn是WAL文件里的字节偏移
+//write_lsn之前的已经write，sync_lsn之前的已经fdatasync
+//后台flusher线程每个窗口做一次fdatasync，把窗口内的提交合成一次
+//提交在synced上等sync_lsn越过自己的提交记录才返回；checkpoint清空WAL时generation加一，等着的提交也可以返回
+typedef struct {
+  int file_descriptor;
+  uint64_t write_lsn;
+  uint64_t sync_lsn;
+  uint32_t sync_window_ms;
+  uint64_t checkpoint_bytes;
+  //当前语句修改过的页
+  uint32_t * txn_pages;
+  uint32_t txn_count;
+  uint32_t txn_capacity;
+  //待写的记录先攒在buffer里，满了或者提交时一次pwrite
+  void * buffer;
+  size_t buffer_length;
+  size_t buffer_capacity;
+  pthread_mutex_t lock;
+  pthread_mutex_t sync_lock;
+  pthread_cond_t cond;
+  pthread_cond_t synced;
+  uint64_t generation;
+  pthread_t flusher;
+  bool stop;
+} Wal;
+
+//异步读：优先用io_uring，一个线程收完成事件；不行就用线程池pread
+//读完在I/O线程里调用done(context, tag, 读到的字节数或者-errno)
+//同时提交的请求数由调用方限制在PAGER_READAHEAD_MAX_INFLIGHT以内，队列不会满
+typedef struct {
+  off_t offset;
+  void * buffer;
+  uint32_t tag;
+} IoRequest;
+
+typedef struct {
+  int file_descriptor;
+  void (*done)(void * context, uint32_t tag, ssize_t result);
+  void * context;
+  bool uring;
+  int ring_fd;
+  uint32_t * sq_head;
+  uint32_t * sq_tail;
+  uint32_t * sq_mask;
+  uint32_t * sq_array;
+  struct io_uring_sqe * sqes;
+  uint32_t * cq_head;
+  uint32_t * cq_tail;
+  uint32_t * cq_mask;
+  struct io_uring_cqe * cqes;
+  void * sq_ring;
+  void * cq_ring;
+  size_t sq_ring_bytes;
+  size_t cq_ring_bytes;
+  size_t sqes_bytes;
+  //线程池模式下待读的请求，环形队列
+  IoRequest queue[PAGER_READAHEAD_MAX_INFLIGHT];
+  uint32_t queue_head;
+  uint32_t queue_count;
+  uint32_t num_threads;
+  pthread_t threads[IO_POOL_THREADS];
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  bool stop;
+} IoQueue;
+
+//缓冲池中的一帧
+//pin_count>0时不能被换出，dirty表示换出前需要写回
+//referenced是CLOCK算法的访问位
+//in_txn表示当前语句改过还没提交，提交前不能换出
+//lsn是该页最近一次写进WAL的记录末尾，写回前WAL要先落盘到这里
+//latch保护页的内容：读的线程加共享latch，改页的线程加排他latch
+//page_num、pin_count和referenced会被命中路径无锁读写，一律用__atomic访问
+typedef struct {
+  uint32_t page_num;
+  uint32_t pin_count;
+  bool dirty;
+  bool referenced;
+  bool in_txn;
+  uint64_t lsn;
+  void * data;
+  pthread_rwlock_t latch;
+} Frame;
+
+//pin_count的最高位：帧被换出线程占着在换页，命中路径不能pin
+#define FRAME_LOADING 0x80000000U
+//mmap模式没有帧，latch按页号分块懒分配，块分配出来后地址不再变
+#define PAGER_LATCH_CHUNK_PAGES 4096
+#define PAGER_LATCH_CHUNKS (PAGER_MMAP_RESERVE_BYTES / PAGE_SIZE / PAGER_LATCH_CHUNK_PAGES)
+//页版本按页号散列的桶数
+#define PAGER_VERSION_BUCKETS 1024
 
-#define TABLE_MAX_PAGES 100
+typedef enum {
+  LATCH_SHARED,
+  LATCH_EXCLUSIVE,
+} LatchMode;
 
 typedef struct {
   int file_descriptor;
-  uint32_t file_length;
+  off_t file_length;
   uint32_t num_pages;
-  void * pages[TABLE_MAX_PAGES];
+  PagerMode mode;
+  //mmap模式下的映射基址和已经映射的页数
+  //映射是私有的，脏页记在位图里由checkpoint写回
+  void * map_base;
+  uint32_t map_pages;
+  uint64_t * map_dirty;
+  uint32_t num_frames;
+  Frame * frames;
+  //所有帧的数据页在一整段匿名映射里，第i帧是第i页，没碰过的部分不占物理内存
+  void * frame_slab;
+  size_t frame_slab_bytes;
+  //预读：在路上的页的帧挂着FRAME_LOADING，读完放开并广播io_done
+  IoQueue * io;
+  uint32_t readahead_pages;
+  uint32_t io_pending;
+  pthread_cond_t io_done;
+  //从数据库文件读进来和写回去的页数，mmap模式的缺页不算在内
+  uint64_t pages_read;
+  uint64_t pages_written;
+  uint32_t clock_hand;
+  //page_num到帧下标的开放寻址哈希表
+  uint32_t * page_table;
+  uint32_t page_table_mask;
+  Wal * wal;
+  //批量导入期间为false，脏页不进WAL，由导入结束时直接写回并fsync
+  bool logging;
+  //缓存命中只用原子操作；换页、标脏、提交和写回要拿这把锁
+  //拿着它的时候不能再去等页的latch
+  pthread_mutex_t lock;
+  pthread_rwlock_t ** map_latches;
+  //主表的行数，和页数一样提交时才写进文件头
+  uint64_t row_count;
+  //每页校验和的文件，没打开校验和时为-1
+  int checksum_file_descriptor;
+  //写语句执行时拿着write_lock，开快照也要拿它，快照总是落在两条写语句之间
+  pthread_mutex_t write_lock;
+  //保护快照链表和页版本；拿着lock的时候可以再拿它，反过来不行
+  pthread_mutex_t version_lock;
+  struct Snapshot * snapshots;
+  //活着的快照数和留着的版本数，标脏和读页时先不加锁看一眼是不是0
+  uint32_t num_snapshots;
+  uint64_t num_versions;
+  //每开一个快照加一；snapshot_num_pages是最新的快照开始时的页数，之后新分配的页哪个快照都看不到
+  uint64_t snapshot_epoch;
+  uint32_t snapshot_num_pages;
+  struct PageVersion ** versions;
 }Pager;
 
-typedef struct {
+//可以建二级索引的列
+typedef enum {
+  INDEX_USERNAME,
+  INDEX_EMAIL,
+  INDEX_COLUMNS,
+} IndexColumn;
+
+//多个线程可以同时查找和扫描，写（insert、.load、提交）同一时刻只能有一个线程在做
+//二级索引也用Table表示：和主表共用pager，只是根页不同，自己没有索引
+typedef struct Table {
   Pager* pager;
+  uint32_t scan_threads;
+  OutputFormat output_format;
+  //这棵树在文件头里的下标
+  uint32_t tree;
   uint32_t root_page_num;
+  //最右叶子的页号，id递增插入时直接定位，INVALID_PAGE_NUM表示还不知道
+  uint32_t rightmost_leaf_page_num;
+  //每列一棵索引树，没有索引时为NULL；建好之后才发布，读线程用__atomic读
+  struct Table* indexes[INDEX_COLUMNS];
 } Table;
 
-typedef struct {
+//导出CSV或二进制时标准输出上只有查询结果，状态行和错误信息改写到stderr
+FILE * table_diagnostics(Table * table){
+  return table->output_format == OUTPUT_TEXT ? stdout : stderr;
+}
+
+//快照开始之后某页第一次被改时留下的旧内容，同一个桶里新的在前
+//epoch是留下它时最新的快照：epoch不大于它的快照里，这一页的内容就是它，除非还有epoch更小的版本
+typedef struct PageVersion {
+  uint32_t page_num;
+  uint64_t epoch;
+  struct PageVersion * next;
+  uint8_t data[];
+} PageVersion;
+
+//读线程固定下来的一致视图，看到的是开快照那一刻的整棵树
+//文件头里的根、树高和free list也记一份，.backup生成新文件头时用
+typedef struct Snapshot {
+  uint64_t epoch;
+  uint32_t num_pages;
+  uint64_t row_count;
+  uint32_t roots[1 + INDEX_COLUMNS];
+  uint32_t heights[1 + INDEX_COLUMNS];
+  uint32_t free_head;
+  struct Snapshot * next;
+} Snapshot;
+
+//cursor持有当前叶子的pin和latch，node是该叶子的地址
+//cursor从线程的arena里分配，关掉后挂到next_free上留给下一次查找
+typedef struct Cursor {
   Table * table;
   uint32_t page_num;
+  void * node;
+  LatchMode latch_mode;
   uint32_t cell_num;
   bool end_of_table;
+  //上次预读到父节点的第几个孩子，换了父节点就从头算
+  uint32_t readahead_parent;
+  uint32_t readahead_next;
+  //按快照读时不为NULL，node可能是快照里的版本，换叶子时也按快照读
+  Snapshot * snapshot;
+  struct Cursor * next_free;
 } Cursor;
 
+//每个线程一个bump arena，放cursor和语句执行中的临时数组
+//一条语句执行完整体reset，只留第一块；块用完了再接一块两倍大的
+#define ARENA_BLOCK_BYTES (64U << 10)
+
+typedef struct ArenaBlock {
+  struct ArenaBlock * next;
+  size_t capacity;
+  size_t used;
+  //按16字节对齐，放什么类型都行
+  _Alignas(16) char data[];
+} ArenaBlock;
+
+typedef struct {
+  ArenaBlock * blocks;
+  //最近一次分配的起点，只有它能原地变长
+  void * last;
+  Cursor * free_cursors;
+} Arena;
+
 #define COLUMN_USERNAME_SIZE 32
 #define COLUMN_EMAIL_SIZE 255
 
@@ -56,11 +364,59 @@ typedef struct {
   char email[COLUMN_EMAIL_SIZE+1];
 }Row;
 
-typedef enum {STATEMENT_INSERT, STATEMENT_SELECT} StatementType;
+typedef enum {STATEMENT_INSERT, STATEMENT_INSERT_BATCH, STATEMENT_SELECT, STATEMENT_CREATE_INDEX,
+              STATEMENT_DELETE} StatementType;
+
+//select count(*), min(id), avg(len(email)) ...
+//len(x)是username或email的字节长度
+typedef enum {
+  AGGREGATE_COUNT,
+  AGGREGATE_MIN,
+  AGGREGATE_MAX,
+  AGGREGATE_SUM,
+  AGGREGATE_AVG,
+} AggregateFunction;
+
+typedef enum {
+  AGGREGATE_ID,
+  AGGREGATE_USERNAME_LENGTH,
+  AGGREGATE_EMAIL_LENGTH,
+  AGGREGATE_COLUMNS,
+} AggregateColumn;
+
+typedef struct {
+  AggregateFunction function;
+  AggregateColumn column;
+} Aggregate;
+
+#define STATEMENT_MAX_AGGREGATES (STATEMENT_MAX_TOKENS - 1)
+
+//where username = x或者where email = x，value指向输入里的词
+typedef struct {
+  bool active;
+  IndexColumn column;
+  Token value;
+} ColumnFilter;
 
+//select的id范围是闭区间[id_min, id_max]，id_min > id_max表示空
 typedef struct {
   StatementType type;
   Row row_to_insert;
+  //insert values (...),(...)的多行，分配在thread_arena里，arena_reset时一起回收，不能free
+  Row* rows;
+  uint32_t num_rows;
+  uint32_t id_min;
+  uint32_t id_max;
+  uint32_t limit;
+  //跳过前offset行再开始输出，按行数定位，不用一行行数过去
+  uint32_t offset;
+  //select后面跟聚合时num_aggregates>0，结果只有一行
+  Aggregate aggregates[STATEMENT_MAX_AGGREGATES];
+  uint32_t num_aggregates;
+  //有filter时不再按id范围过滤，有索引就走索引，否则全表扫描
+  ColumnFilter filter;
+  //create index on的列
+  IndexColumn index_column;
 }Statement;
 
 typedef enum {
@@ -71,6 +427,48 @@ typedef enum {
   PREPARE_UNRECOGNIZE_STATEMENT
 } PrepareResult;
 
+//.stats的计数器，每个线程一份，只有自己写，不用原子加
+typedef enum {
+  STAT_CACHE_HITS,
+  STAT_CACHE_MISSES,
+  STAT_EVICTIONS,
+  STAT_READAHEAD_PAGES,
+  STAT_LEAF_SPLITS,
+  STAT_INTERNAL_SPLITS,
+  STAT_MERGES,
+  STAT_WAL_BYTES,
+  STAT_WAL_SYNCS,
+  STAT_PAGE_VERSIONS,
+  STAT_COUNTERS,
+} StatCounter;
+
+//延迟直方图的种类，前五个和StatementType一一对应，最后一个是提交
+typedef enum {
+  LATENCY_INSERT,
+  LATENCY_INSERT_BATCH,
+  LATENCY_SELECT,
+  LATENCY_CREATE_INDEX,
+  LATENCY_DELETE,
+  LATENCY_COMMIT,
+  LATENCY_KINDS,
+} LatencyKind;
+
+//HDR式的桶：按纳秒计，每个2的幂区间再均分成8个桶，相对误差不超过12.5%
+//320个桶覆盖到2^41纳秒（半个多小时），更慢的都算进最后一个桶
+#define LATENCY_SUB_BUCKET_BITS 3
+#define LATENCY_SUB_BUCKETS (1U << LATENCY_SUB_BUCKET_BITS)
+#define LATENCY_BUCKETS 320
+
+//线程第一次计数时从全局链表里认领一块，线程退出时放回去，计数留着给下一个线程接着加
+//.stats把链表上所有块加起来，块不释放，只读到稍旧的值
+typedef struct StatsBlock {
+  uint64_t counters[STAT_COUNTERS];
+  uint64_t latency[LATENCY_KINDS][LATENCY_BUCKETS];
+  uint64_t latency_total_ns[LATENCY_KINDS];
+  bool in_use;
+  struct StatsBlock * next;
+} StatsBlock;
+
 #define size_of_attribute(Struct, Attribute) sizeof(((Struct *)0) ->Attribute);
 
 const uint32_t ID_SIZE = size_of_attribute(Row, id);
@@ -82,7 +480,7 @@ const uint32_t EMAIL_OFFSET = USERNAME_OFFSET + USERNAME_SIZE;
 const uint32_t ROW_SIZE = ID_SIZE + USERNAME_SIZE + EMAIL_SIZE;
 
 
-const uint32_t PAGE_SIZE = 4094U;
+const uint32_t PAGE_SIZE = 4096U;
 /*
  * Common Node Header Layout
  */
@@ -95,6 +493,16 @@ const uint32_t PARENT_POINTER_SIZE = sizeof(uint32_t);
 const uint32_t PARENT_POINTER_OFFSET = IS_ROOT_OFFSET + IS_ROOT_SIZE;
 const uint8_t COMMON_NODE_HEADER_SIZE =
     NODE_TYPE_SIZE + IS_ROOT_SIZE + PARENT_POINTER_SIZE;
+//类型字节低4位是节点类型，高4位是页格式版本
+//旧文件的节点是版本0（key和孩子/行交错存放），读入时升级
+#define NODE_TYPE_MASK 0x0F
+#define NODE_LAYOUT_SHIFT 4
+//中间节点：0是child,key交错，1是key数组加孩子数组，2在1的基础上给每个孩子记子树的行数
+//版本0读入时升级成1，版本1只出现在文件头版本1的文件里，打开时整棵树重建中间层
+const uint8_t INTERNAL_NODE_UNCOUNTED_LAYOUT = 1;
+const uint8_t INTERNAL_NODE_LAYOUT = 2;
+//叶子：0是key,row交错，1是key数组加页尾定长行，2是slotted page
+const uint8_t LEAF_NODE_LAYOUT = 2;
 
 /*
  * Internal Node Header Layout
@@ -115,10 +523,31 @@ const uint32_t INTERNAL_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE +
 //
 const uint32_t INTERNAL_NODE_KEY_SIZE = sizeof(uint32_t);
 const uint32_t INTERNAL_NODE_CHILD_SIZE = sizeof(uint32_t);
+//每个孩子（包括右孩子）下面的行数，count(*)、按名次定位和offset只要从根走到叶子
+const uint32_t INTERNAL_NODE_COUNT_SIZE = sizeof(uint32_t);
 const uint32_t INTERNAL_NODE_CELL_SIZE =
-    INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEY_SIZE;
-/* Keep this small for testing */
-const uint32_t INTERNAL_NODE_MAX_CELLS = 3;
+    INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEY_SIZE + INTERNAL_NODE_COUNT_SIZE;
+const uint32_t INTERNAL_NODE_SPACE_FOR_CELLS = PAGE_SIZE - INTERNAL_NODE_HEADER_SIZE;
+//扇出由页大小决定，4096字节的页可以放339个key，右孩子的行数多占一格
+const uint32_t INTERNAL_NODE_MAX_CELLS =
+    (INTERNAL_NODE_SPACE_FOR_CELLS - INTERNAL_NODE_COUNT_SIZE) / INTERNAL_NODE_CELL_SIZE;
+//版本1的中间节点没有行数，一页放510个key
+const uint32_t INTERNAL_NODE_UNCOUNTED_MAX_CELLS =
+    INTERNAL_NODE_SPACE_FOR_CELLS / (INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEY_SIZE);
+//分裂时一共MAX+1个key，左边留一半，中间一个提到父节点，剩下的给右边
+const uint32_t INTERNAL_NODE_LEFT_SPLIT_COUNT = (INTERNAL_NODE_MAX_CELLS + 1) / 2;
+//删除后非根的中间节点少于这么多key就和兄弟合并或者重新分配
+//欠一个key的节点加上分隔key和一个刚好够数的兄弟，合起来正好放得下
+const uint32_t INTERNAL_NODE_MIN_KEYS = INTERNAL_NODE_MAX_CELLS / 2;
+//key连续存成一个数组，后面跟孩子数组，查找时可以一次比较多个key
+const uint32_t INTERNAL_NODE_KEYS_OFFSET = INTERNAL_NODE_HEADER_SIZE;
+const uint32_t INTERNAL_NODE_CHILDREN_OFFSET =
+    INTERNAL_NODE_KEYS_OFFSET + INTERNAL_NODE_MAX_CELLS * INTERNAL_NODE_KEY_SIZE;
+//行数数组按孩子下标存，第num_keys个是右孩子的
+const uint32_t INTERNAL_NODE_COUNTS_OFFSET =
+    INTERNAL_NODE_CHILDREN_OFFSET + INTERNAL_NODE_MAX_CELLS * INTERNAL_NODE_CHILD_SIZE;
+//key数不超过这个值时不再二分，直接向量化地数比目标小的key
+#define NODE_SEARCH_LINEAR_WINDOW 32
 
 /*
  * Leaf Node Header Layout
@@ -127,664 +556,6138 @@ const uint32_t LEAF_NODE_NUM_CELLS_SIZE = sizeof(uint32_t);
 const uint32_t LEAF_NODE_NUM_CELLS_OFFSET = COMMON_NODE_HEADER_SIZE;
 const uint32_t LEAF_NODE_NEXT_LEAF_SIZE = sizeof(uint32_t);
 const uint32_t LEAF_NODE_NEXT_LEAF_OFFSET = LEAF_NODE_NUM_CELLS_OFFSET + LEAF_NODE_NUM_CELLS_SIZE;
+//记录区的起点（往前长）和删除留下的空洞字节数
+const uint32_t LEAF_NODE_HEAP_START_SIZE = sizeof(uint16_t);
+const uint32_t LEAF_NODE_HEAP_START_OFFSET = LEAF_NODE_NEXT_LEAF_OFFSET + LEAF_NODE_NEXT_LEAF_SIZE;
+const uint32_t LEAF_NODE_FRAGMENTED_SIZE = sizeof(uint16_t);
+const uint32_t LEAF_NODE_FRAGMENTED_OFFSET = LEAF_NODE_HEAP_START_OFFSET + LEAF_NODE_HEAP_START_SIZE;
 const uint32_t LEAF_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE +
                                        LEAF_NODE_NUM_CELLS_SIZE +
-                                       LEAF_NODE_NEXT_LEAF_SIZE;
+                                       LEAF_NODE_NEXT_LEAF_SIZE +
+                                       LEAF_NODE_HEAP_START_SIZE +
+                                       LEAF_NODE_FRAGMENTED_SIZE;
+//版本0/1的叶子没有后两个字段，行是定长的ROW_SIZE
+const uint32_t LEGACY_LEAF_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE +
+                                              LEAF_NODE_NUM_CELLS_SIZE +
+                                              LEAF_NODE_NEXT_LEAF_SIZE;
+const uint32_t LEGACY_LEAF_NODE_CELL_SIZE = sizeof(uint32_t) + ROW_SIZE;
+const uint32_t LEGACY_LEAF_NODE_MAX_CELLS =
+    (PAGE_SIZE - LEGACY_LEAF_NODE_HEADER_SIZE) / LEGACY_LEAF_NODE_CELL_SIZE;
 
 /*
  * Leaf Node Body Layout
  */
+//slotted page：头部后面是key数组，紧接着是同样个数的u16记录偏移
+//变长记录从页尾往前放：[u8 username长度][u8 email长度][username][email]
+//二分只碰key数组所在的一两条cache line
 const uint32_t LEAF_NODE_KEY_SIZE = sizeof(uint32_t);
-const uint32_t LEAF_NODE_KEY_OFFSET = 0;
-const uint32_t LEAF_NODE_VALUE_SIZE = ROW_SIZE;
-const uint32_t LEAF_NODE_VALUE_OFFSET =
-    LEAF_NODE_KEY_OFFSET + LEAF_NODE_KEY_SIZE;
-const uint32_t LEAF_NODE_CELL_SIZE = LEAF_NODE_KEY_SIZE + LEAF_NODE_VALUE_SIZE;
+const uint32_t LEAF_NODE_RECORD_OFFSET_SIZE = sizeof(uint16_t);
+const uint32_t LEAF_NODE_SLOT_SIZE = LEAF_NODE_KEY_SIZE + LEAF_NODE_RECORD_OFFSET_SIZE;
+const uint32_t LEAF_NODE_KEYS_OFFSET = LEAF_NODE_HEADER_SIZE;
+const uint32_t LEAF_NODE_RECORD_HEADER_SIZE = 2 * sizeof(uint8_t);
+const uint32_t LEAF_NODE_MAX_RECORD_SIZE =
+    LEAF_NODE_RECORD_HEADER_SIZE + COLUMN_USERNAME_SIZE + COLUMN_EMAIL_SIZE;
 const uint32_t LEAF_NODE_SPACE_FOR_CELLS = PAGE_SIZE - LEAF_NODE_HEADER_SIZE;
+//两个字段都为空时一页能放的行数，只用来定临时数组的大小
 const uint32_t LEAF_NODE_MAX_CELLS =
-    LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_CELL_SIZE;
-const uint32_t LEAF_NODE_RIGHT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) / 2;
-const uint32_t LEAF_NODE_LEFT_SPLIT_COUNT =
-    (LEAF_NODE_MAX_CELLS + 1) - LEAF_NODE_RIGHT_SPLIT_COUNT;
+    LEAF_NODE_SPACE_FOR_CELLS / (LEAF_NODE_SLOT_SIZE + LEAF_NODE_RECORD_HEADER_SIZE);
 
+/*
+ * Header Page Layout
+ */
+//第0页是文件头：类型字节占4字节，后面是魔数、格式版本、页大小、选项、页数、free list的头和行数
+//然后每棵树一组(根页号, 高度)，第0组是主表，后面每个可索引列一组，根页号0表示没有这棵树
+//最后是前面这些字段的校验和，提交时重算
+#define HEADER_MAGIC "mydbfile"
+//版本2的中间节点带子树行数，版本1的文件第一次打开时重建
+#define HEADER_FORMAT_VERSION 2
+#define HEADER_UNCOUNTED_VERSION 1
+#define HEADER_FLAG_CHECKSUMS 1
+#define HEADER_TREE_PRIMARY 0
+const uint32_t HEADER_PAGE_NUM = 0;
+const uint32_t HEADER_MAGIC_OFFSET = sizeof(uint32_t);
+const uint32_t HEADER_MAGIC_SIZE = sizeof(HEADER_MAGIC) - 1;
+const uint32_t HEADER_VERSION_OFFSET = HEADER_MAGIC_OFFSET + HEADER_MAGIC_SIZE;
+const uint32_t HEADER_PAGE_SIZE_OFFSET = HEADER_VERSION_OFFSET + sizeof(uint32_t);
+const uint32_t HEADER_FLAGS_OFFSET = HEADER_PAGE_SIZE_OFFSET + sizeof(uint32_t);
+const uint32_t HEADER_PAGE_COUNT_OFFSET = HEADER_FLAGS_OFFSET + sizeof(uint32_t);
+const uint32_t HEADER_FREE_HEAD_OFFSET = HEADER_PAGE_COUNT_OFFSET + sizeof(uint32_t);
+const uint32_t HEADER_ROW_COUNT_OFFSET = HEADER_FREE_HEAD_OFFSET + sizeof(uint32_t);
+const uint32_t HEADER_TREES_OFFSET = HEADER_ROW_COUNT_OFFSET + sizeof(uint64_t);
+const uint32_t HEADER_TREE_SIZE = 2 * sizeof(uint32_t);
+const uint32_t HEADER_TREES = 1 + INDEX_COLUMNS;
+const uint32_t HEADER_CHECKSUM_OFFSET = HEADER_TREES_OFFSET + HEADER_TREES * HEADER_TREE_SIZE;
 
-//pager以文件为存储方式
-//以页为基本单位存储数据
-Pager * pager_open(const char * filename){
-  int fd = open(filename, O_RDWR|O_CREAT, S_IWUSR|S_IRUSR);
-
-  if(fd == -1){
-    printf("unable to open the file\n");
-    exit(EXIT_FAILURE);
-  }
-  
-  off_t file_length = lseek(fd, 0, SEEK_END);
+/*
+ * Catalog Page Layout
+ */
+//旧文件的目录页：类型字节占4字节，后面每个可索引列一个索引根页号（0表示没有索引），然后是free list的头
+//目录页的页号存在主表根节点的父指针里，打开时搬进文件头
+const uint32_t CATALOG_ROOTS_OFFSET = sizeof(uint32_t);
+const uint32_t CATALOG_FREE_HEAD_OFFSET = CATALOG_ROOTS_OFFSET + INDEX_COLUMNS * sizeof(uint32_t);
+//空闲页：类型字节占4字节，后面是free list上下一个空闲页的页号，0表示到头了
+const uint32_t FREE_PAGE_NEXT_OFFSET = sizeof(uint32_t);
+//索引项沿用叶子的变长记录：第一段是4字节的主键id，第二段是列值
+//key是列值的哈希，不同的行可以有相同的key
+const uint32_t INDEX_RECORD_ID_SIZE = sizeof(uint32_t);
+
+//聚合查询按树上的分隔key把id范围切成段，每个扫描线程平均分到4段，先做完的多拿几段
+#define SCAN_MAX_THREADS 64
+#define SCAN_SLICES_PER_THREAD 4
+//从树上最多收集这么多个切分点
+#define SCAN_MAX_SPLIT_POINTS 4096
+
+//每个中间节点至少两个孩子，32位key的树不会超过这个深度
+#define BTREE_MAX_DEPTH 64
+//删除后叶子里的有效字节（slot加记录）少于可用空间的1/4就和兄弟合并或者重新分配
+//分裂出来的叶子大约半满，门槛定得低一些，删删插插不会来回合并分裂
+#define LEAF_NODE_MIN_FILL_DIVISOR 4
+
+//批量插入或--batch时未提交的页超过缓存帧数的1/4就先提交一次，免得脏页占满缓存
+#define BATCH_COMMIT_FRAME_DIVISOR 4
+
+//.load默认把节点填到90%，给之后的随机插入留点空间
+#define LOAD_DEFAULT_FILL_PERCENT 90
+//外排序每次在内存里排128K行，超过就写成有序的临时run再多路归并
+#define LOAD_SORT_CHUNK_ROWS (1U << 17)
+//表不空时每批插入的行数
+#define LOAD_INSERT_BATCH_ROWS 10000
+//导入期间每新建这么多页就写回一次，mmap模式下私有副本不会无限增长
+#define LOAD_FLUSH_PAGES 4096
+#define LOAD_MAX_LEVELS 16
+//.backup每次从快照里拷这么多页再写一次
+#define BACKUP_CHUNK_PAGES 256
+
+
+StatsBlock * stats_blocks = NULL;
+pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+pthread_key_t stats_key;
+__thread StatsBlock * thread_stats;
+
+//线程退出时由pthread调用，把块还回链表
+void stats_release(void * arg){
+  StatsBlock * block = arg;
+  pthread_mutex_lock(&stats_lock);
+  block->in_use = false;
+  pthread_mutex_unlock(&stats_lock);
+}
 
-  Pager* pager = malloc(sizeof(Pager));
-  pager->file_descriptor = fd;
-  pager->file_length = file_length;
-  pager->num_pages = file_length/PAGE_SIZE;
+void stats_key_create(){
+  pthread_key_create(&stats_key, stats_release);
+}
 
-  if(file_length / PAGE_SIZE != 0){
-    printf("必须是4096整数倍\n");
-    exit(EXIT_FAILURE);
+StatsBlock* stats_claim(){
+  pthread_once(&stats_once, stats_key_create);
+  pthread_mutex_lock(&stats_lock);
+  StatsBlock * block = stats_blocks;
+  while(block != NULL && block->in_use){
+    block = block->next;
+  }
+  if(block == NULL){
+    block = calloc(1, sizeof(StatsBlock));
+    block->next = stats_blocks;
+    stats_blocks = block;
   }
+  block->in_use = true;
+  pthread_mutex_unlock(&stats_lock);
+  pthread_setspecific(stats_key, block);
+  thread_stats = block;
+  return block;
+}
 
-  for(uint32_t i = 0; i< TABLE_MAX_PAGES; i++){
-    pager->pages[i] = NULL;
+//.stats可能同时在读，存回去用原子写，读到的不会是撕裂的值
+void stats_add(StatCounter counter, uint64_t n){
+  StatsBlock * block = thread_stats;
+  if(block == NULL){
+    block = stats_claim();
   }
+  __atomic_store_n(&block->counters[counter], block->counters[counter] + n, __ATOMIC_RELAXED);
+}
 
-  return pager;
+uint64_t stats_now_ns(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
-//返回的pager->page[]数组存的是堆地址初始值
-//如果该页不存在则申请4096空间，否则直接返回
-void * get_page(Pager* pager, uint32_t page_num){
-  if(page_num > TABLE_MAX_PAGES){
-    printf("最多100个page\n");
-    exit(EXIT_FAILURE);
+//小于8纳秒的每个值一个桶，之后每个2的幂区间按最高的3位之后的3位分成8个桶
+uint32_t latency_bucket(uint64_t ns){
+  if(ns < LATENCY_SUB_BUCKETS){
+    return ns;
   }
+  uint32_t exponent = 63 - __builtin_clzll(ns);
+  uint64_t bucket = (uint64_t)(exponent - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKETS +
+                    ((ns >> (exponent - LATENCY_SUB_BUCKET_BITS)) & (LATENCY_SUB_BUCKETS - 1));
+  return bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1;
+}
 
-  if(pager->pages[page_num] == NULL){
-    void * page = malloc(PAGE_SIZE);
-    uint32_t num_pages = pager->file_length / PAGE_SIZE;
+//桶里最大的值，报百分位时用它，宁可报得偏大
+uint64_t latency_bucket_max(uint32_t bucket){
+  if(bucket < LATENCY_SUB_BUCKETS){
+    return bucket;
+  }
+  uint32_t shift = bucket / LATENCY_SUB_BUCKETS - 1;
+  uint64_t low = (uint64_t)(LATENCY_SUB_BUCKETS + bucket % LATENCY_SUB_BUCKETS) << shift;
+  return low + (1ULL << shift) - 1;
+}
 
-    if(pager->file_length % PAGE_SIZE){
-      num_pages += 1;
-    }
+void stats_record_latency(LatencyKind kind, uint64_t start_ns){
+  uint64_t ns = stats_now_ns() - start_ns;
+  StatsBlock * block = thread_stats;
+  if(block == NULL){
+    block = stats_claim();
+  }
+  uint64_t* bucket = &block->latency[kind][latency_bucket(ns)];
+  __atomic_store_n(bucket, *bucket + 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&block->latency_total_ns[kind], block->latency_total_ns[kind] + ns, __ATOMIC_RELAXED);
+}
 
-    if(page_num < num_pages){
-      lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-      ssize_t bytes_read = read(pager->file_descriptor, page, PAGE_SIZE);
-      if(bytes_read == -1){
-        printf("读文件错误\n");
-        exit(EXIT_FAILURE);
-      }
+//把所有线程的块加到total里
+void stats_collect(StatsBlock * total){
+  memset(total, 0, sizeof(StatsBlock));
+  pthread_mutex_lock(&stats_lock);
+  for(StatsBlock * block = stats_blocks; block != NULL; block = block->next){
+    for(uint32_t i = 0; i < STAT_COUNTERS; i++){
+      total->counters[i] += __atomic_load_n(&block->counters[i], __ATOMIC_RELAXED);
     }
-
-    pager->pages[num_pages] = page;
-
-    if(page_num > pager->num_pages){
-      pager->num_pages = page_num + 1;
+    for(uint32_t kind = 0; kind < LATENCY_KINDS; kind++){
+      for(uint32_t i = 0; i < LATENCY_BUCKETS; i++){
+        total->latency[kind][i] += __atomic_load_n(&block->latency[kind][i], __ATOMIC_RELAXED);
+      }
+      total->latency_total_ns[kind] += __atomic_load_n(&block->latency_total_ns[kind], __ATOMIC_RELAXED);
     }
+  }
+  pthread_mutex_unlock(&stats_lock);
+}
 
-    return pager->pages[num_pages];
+uint32_t wal_checksum(const void * data, size_t length, uint32_t seed){
+  const uint32_t * words = data;
+  uint32_t hash = seed ^ 2166136261U;
+  for(size_t i = 0; i < length / sizeof(uint32_t); i++){
+    hash = (hash ^ words[i]) * 16777619U;
   }
+  return hash;
 }
 
-//Page堆空间开始８字节为节点类型
-//标为中间节点或者叶子节点
-void set_node_type(void * node, NodeType type){
-  uint8_t value = type;
-  *((uint8_t *) (node + NODE_TYPE_OFFSET)) = value;
+uint32_t wal_record_checksum(WalRecordHeader * header, const void * image){
+  uint32_t seed = header->type * 31 + header->page_num;
+  return wal_checksum(image, image == NULL ? 0 : PAGE_SIZE, seed);
 }
 
-//表明该页是不是根节点
-void set_node_root(void * node, bool is_root){
-  uint8_t value = is_root;
-  *((uint8_t *) (node + IS_ROOT_OFFSET)) = value;
+//每页的校验和按页号存在-sum文件里，写回数据库文件时算，读进来时核对
+//0表示这一页还没有写回过，不校验
+uint32_t page_checksum(const void * page, uint32_t page_num){
+  uint32_t checksum = wal_checksum(page, PAGE_SIZE, page_num);
+  return checksum == 0 ? 1 : checksum;
 }
 
-uint32_t* leaf_node_num_cells(void * node){
-  return node + LEAF_NODE_NUM_CELLS_OFFSET;
+//文件存在就打开，create为true时没有就新建，都不是返回-1
+int checksum_open(const char * filename, bool create){
+  char * path = malloc(strlen(filename) + 5);
+  sprintf(path, "%s-sum", filename);
+  int fd = open(path, O_RDWR|(create ? O_CREAT : 0), S_IWUSR|S_IRUSR);
+  free(path);
+  return fd;
 }
 
-uint32_t * leaf_node_next_leaf(void * node){
-  return node + LEAF_NODE_NEXT_LEAF_OFFSET;
+//pages是从first_page开始连续的count页
+void checksum_write(int fd, uint32_t first_page, const void * pages, uint32_t count){
+  uint32_t checksums[PAGER_FLUSH_MAX_RUN];
+  while(count > 0){
+    uint32_t n = count < PAGER_FLUSH_MAX_RUN ? count : PAGER_FLUSH_MAX_RUN;
+    for(uint32_t i = 0; i < n; i++){
+      checksums[i] = page_checksum(pages + (size_t)i * PAGE_SIZE, first_page + i);
+    }
+    ssize_t length = n * sizeof(uint32_t);
+    if(pwrite(fd, checksums, length, (off_t)first_page * sizeof(uint32_t)) != length){
+      printf("checksum write error\n");
+      exit(EXIT_FAILURE);
+    }
+    first_page += n;
+    pages += (size_t)n * PAGE_SIZE;
+    count -= n;
+  }
 }
 
-//node是堆起始地址值
-void initialize_leaf_node(void * node){
-  set_node_type(node, NODE_LEAF);
-  set_node_root(node, false);
-  *leaf_node_num_cells(node) = 0;
-  *leaf_node_next_leaf(node) = 0;
+void checksum_verify(int fd, uint32_t page_num, const void * page){
+  uint32_t expected = 0;
+  if(pread(fd, &expected, sizeof(expected), (off_t)page_num * sizeof(uint32_t)) == -1){
+    printf("checksum read error\n");
+    exit(EXIT_FAILURE);
+  }
+  if(expected != 0 && expected != page_checksum(page, page_num)){
+    printf("checksum mismatch on page %d\n", page_num);
+    exit(EXIT_FAILURE);
+  }
 }
 
-//实例化table和pager
-//如果db为空则顺便设置根节点
-//db结构为b-树
-Table * db_open(const char * filename){
-  Pager * pager = pager_open(filename);
+//把sync_lsn推进到至少lsn，flusher线程和换出写回都走这里
+void wal_sync(Wal * wal, uint64_t lsn){
+  pthread_mutex_lock(&wal->lock);
+  bool synced = lsn <= wal->sync_lsn;
+  pthread_mutex_unlock(&wal->lock);
+  if(synced){
+    return;
+  }
 
-  Table* table = malloc(sizeof(Table));
-  table->pager = pager;
-  table->root_page_num = 0;
+  pthread_mutex_lock(&wal->sync_lock);
+  pthread_mutex_lock(&wal->lock);
+  uint64_t target = wal->write_lsn;
+  bool needed = wal->sync_lsn < target;
+  pthread_mutex_unlock(&wal->lock);
 
-  //如果pager中没有数据
-  //该page为根节点
-  if(pager->num_pages == 0){
-    void * root_node = get_page(pager, 0);
-    initialize_leaf_node(root_node);
-    set_node_root(root_node, true);
+  if(needed){
+    if(fdatasync(wal->file_descriptor) == -1){
+      printf("wal sync error\n");
+      exit(EXIT_FAILURE);
+    }
+    stats_add(STAT_WAL_SYNCS, 1);
+    pthread_mutex_lock(&wal->lock);
+    if(target > wal->sync_lsn){
+      wal->sync_lsn = target;
+    }
+    pthread_cond_broadcast(&wal->synced);
+    pthread_mutex_unlock(&wal->lock);
   }
-
-  return table;
+  pthread_mutex_unlock(&wal->sync_lock);
 }
 
-InputBuffer * new_input_buffer() {
-  InputBuffer * input_buffer = malloc(sizeof(InputBuffer));
-  input_buffer->buffer = NULL;
-  input_buffer->buffer_length = 0;
-  input_buffer->input_length = 0;
+//第一次有未落盘的提交时开始计时，窗口结束做一次fdatasync
+//窗口内的其它提交共用这一次
+void * wal_flusher(void * arg){
+  Wal * wal = arg;
 
-  return input_buffer;
-}
+  pthread_mutex_lock(&wal->lock);
+  while(!wal->stop){
+    while(!wal->stop && wal->sync_lsn >= wal->write_lsn){
+      pthread_cond_wait(&wal->cond, &wal->lock);
+    }
+    if(wal->stop){
+      break;
+    }
 
-void print_prompt(){ printf("db > ");}
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += (long)wal->sync_window_ms * 1000000L;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+    while(!wal->stop &&
+          pthread_cond_timedwait(&wal->cond, &wal->lock, &deadline) == 0){
+    }
 
-//getline获取输入行
-//here could be hacked 
-void read_input(InputBuffer* input_buffer){
-  ssize_t bytes_read = 
-    getline(&(input_buffer->buffer), &(input_buffer->buffer_length), stdin);
-  
-  input_buffer->input_length = bytes_read - 1;
-  input_buffer->buffer[bytes_read - 1] = 0;
-}
+    uint64_t target = wal->write_lsn;
+    pthread_mutex_unlock(&wal->lock);
+    wal_sync(wal, target);
+    pthread_mutex_lock(&wal->lock);
+  }
+  //退出前把剩下的提交也落盘，不会有提交一直等着
+  uint64_t target = wal->write_lsn;
+  pthread_mutex_unlock(&wal->lock);
+  wal_sync(wal, target);
 
-//释放堆空间
-void close_input_buffer(InputBuffer* input_buffer){
-  free(input_buffer->buffer);
-  free(input_buffer);
+  return NULL;
 }
 
-//把堆上的数据写到文件中
-void pager_flush(Pager* pager, uint32_t page_num){
-  if(pager->pages[page_num] == NULL){
-    printf("flush null page\n");
+//WAL文件是数据库文件名加-wal
+Wal * wal_open(const char * filename, DbConfig * config){
+  char * path = malloc(strlen(filename) + 5);
+  sprintf(path, "%s-wal", filename);
+  int fd = open(path, O_RDWR|O_CREAT, S_IWUSR|S_IRUSR);
+  free(path);
+
+  if(fd == -1){
+    printf("unable to open the wal\n");
     exit(EXIT_FAILURE);
   }
 
-  off_t offset = lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-
-  if(offset == -1){
-    printf("seek error\n");
-    exit(EXIT_FAILURE);
+  Wal * wal = malloc(sizeof(Wal));
+  wal->file_descriptor = fd;
+  wal->write_lsn = 0;
+  wal->sync_lsn = 0;
+  wal->sync_window_ms = config->wal_sync_window_ms;
+  wal->checkpoint_bytes = config->wal_checkpoint_bytes;
+  wal->txn_capacity = 64;
+  wal->txn_pages = malloc(sizeof(uint32_t) * wal->txn_capacity);
+  wal->txn_count = 0;
+  wal->buffer_capacity = WAL_BUFFER_SIZE;
+  wal->buffer = malloc(wal->buffer_capacity);
+  wal->buffer_length = 0;
+  pthread_mutex_init(&wal->lock, NULL);
+  pthread_mutex_init(&wal->sync_lock, NULL);
+  pthread_cond_init(&wal->cond, NULL);
+  pthread_cond_init(&wal->synced, NULL);
+  wal->generation = 0;
+  wal->stop = false;
+
+  if(wal->sync_window_ms > 0){
+    pthread_create(&wal->flusher, NULL, wal_flusher, wal);
   }
 
-  ssize_t bytes_written = write(pager->file_descriptor , pager->pages[page_num], PAGE_SIZE);
+  return wal;
+}
 
-  if(bytes_written == -1){
-    printf("flush error\n");
-    exit(EXIT_FAILURE);
+void wal_close(Wal * wal){
+  if(wal->sync_window_ms > 0){
+    pthread_mutex_lock(&wal->lock);
+    wal->stop = true;
+    pthread_cond_broadcast(&wal->cond);
+    pthread_mutex_unlock(&wal->lock);
+    pthread_join(wal->flusher, NULL);
   }
+
+  close(wal->file_descriptor);
+  pthread_mutex_destroy(&wal->lock);
+  pthread_mutex_destroy(&wal->sync_lock);
+  pthread_cond_destroy(&wal->cond);
+  pthread_cond_destroy(&wal->synced);
+  free(wal->txn_pages);
+  free(wal->buffer);
+  free(wal);
 }
 
-void db_close(Table* table){
-  Pager* pager = table->pager;
+//io_uring的收割线程：阻塞等完成事件，tag为UINT32_MAX的空操作是关闭信号
+void* io_uring_reaper(void* arg){
+  IoQueue* io = arg;
+  while(true){
+    syscall(__NR_io_uring_enter, io->ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+    uint32_t head = *io->cq_head;
+    uint32_t tail = __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE);
+    bool stop = false;
+    while(head != tail){
+      struct io_uring_cqe* cqe = &io->cqes[head & *io->cq_mask];
+      if(cqe->user_data == UINT32_MAX){
+        stop = true;
+      }else{
+        io->done(io->context, cqe->user_data, cqe->res);
+      }
+      head++;
+    }
+    __atomic_store_n(io->cq_head, head, __ATOMIC_RELEASE);
+    if(stop){
+      return NULL;
+    }
+  }
+}
 
-  for(uint32_t i = 0; i< pager->num_pages; i++){
-    if(pager->pages[i] == NULL){
-      continue;
+void* io_pool_worker(void* arg){
+  IoQueue* io = arg;
+  pthread_mutex_lock(&io->lock);
+  while(true){
+    while(io->queue_count == 0 && !io->stop){
+      pthread_cond_wait(&io->cond, &io->lock);
+    }
+    if(io->queue_count == 0){
+      break;
     }
-    pager_flush(pager, i);
-    free(pager->pages[i]);
-    pager->pages[i] = NULL;
+    IoRequest request = io->queue[io->queue_head];
+    io->queue_head = (io->queue_head + 1) % PAGER_READAHEAD_MAX_INFLIGHT;
+    io->queue_count--;
+    pthread_mutex_unlock(&io->lock);
+    ssize_t result = pread(io->file_descriptor, request.buffer, PAGE_SIZE, request.offset);
+    io->done(io->context, request.tag, result == -1 ? -errno : result);
+    pthread_mutex_lock(&io->lock);
   }
+  pthread_mutex_unlock(&io->lock);
+  return NULL;
+}
 
-  int result = close(pager->file_descriptor);
-  if(result == -1){
-    printf("ERROR CLOSING DB\n");
-    exit(EXIT_FAILURE);
+//建io_uring的环并映射SQ、CQ和SQE数组，失败（老内核、seccomp禁了）返回false
+bool io_uring_open(IoQueue* io){
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int ring_fd = syscall(__NR_io_uring_setup, PAGER_READAHEAD_MAX_INFLIGHT, &params);
+  if(ring_fd < 0){
+    return false;
   }
-  for(uint32_t i = 0; i<TABLE_MAX_PAGES; i++){
-    void * page = pager->pages[i];
-    if(page){
-      free(page);
-      pager->pages[i] = NULL;
+  io->ring_fd = ring_fd;
+  io->sq_ring_bytes = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+  io->cq_ring_bytes = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  io->sqes_bytes = params.sq_entries * sizeof(struct io_uring_sqe);
+  if(params.features & IORING_FEAT_SINGLE_MMAP){
+    if(io->cq_ring_bytes > io->sq_ring_bytes){
+      io->sq_ring_bytes = io->cq_ring_bytes;
     }
+    io->cq_ring_bytes = 0;
   }
-  free(pager);
-  free(table);
+  io->sq_ring = mmap(NULL, io->sq_ring_bytes, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                     ring_fd, IORING_OFF_SQ_RING);
+  io->cq_ring = io->cq_ring_bytes == 0 ? io->sq_ring :
+                mmap(NULL, io->cq_ring_bytes, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                     ring_fd, IORING_OFF_CQ_RING);
+  io->sqes = mmap(NULL, io->sqes_bytes, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                  ring_fd, IORING_OFF_SQES);
+  if(io->sq_ring == MAP_FAILED || io->cq_ring == MAP_FAILED || io->sqes == MAP_FAILED){
+    if(io->sqes != MAP_FAILED){
+      munmap(io->sqes, io->sqes_bytes);
+    }
+    if(io->cq_ring != MAP_FAILED && io->cq_ring != io->sq_ring){
+      munmap(io->cq_ring, io->cq_ring_bytes);
+    }
+    if(io->sq_ring != MAP_FAILED){
+      munmap(io->sq_ring, io->sq_ring_bytes);
+    }
+    close(ring_fd);
+    return false;
+  }
+  io->sq_head = io->sq_ring + params.sq_off.head;
+  io->sq_tail = io->sq_ring + params.sq_off.tail;
+  io->sq_mask = io->sq_ring + params.sq_off.ring_mask;
+  io->sq_array = io->sq_ring + params.sq_off.array;
+  io->cq_head = io->cq_ring + params.cq_off.head;
+  io->cq_tail = io->cq_ring + params.cq_off.tail;
+  io->cq_mask = io->cq_ring + params.cq_off.ring_mask;
+  io->cqes = io->cq_ring + params.cq_off.cqes;
+  return true;
 }
 
-NodeType get_node_type(void * node){
-  uint8_t value = *((uint8_t *) (node+ NODE_TYPE_OFFSET));
-  return (NodeType)value;
+IoQueue* io_open(int file_descriptor, void (*done)(void*, uint32_t, ssize_t), void* context){
+  IoQueue* io = malloc(sizeof(IoQueue));
+  io->file_descriptor = file_descriptor;
+  io->done = done;
+  io->context = context;
+  io->queue_head = 0;
+  io->queue_count = 0;
+  io->stop = false;
+  pthread_mutex_init(&io->lock, NULL);
+  pthread_cond_init(&io->cond, NULL);
+
+  io->uring = io_uring_open(io);
+  if(io->uring){
+    io->num_threads = 1;
+    pthread_create(&io->threads[0], NULL, io_uring_reaper, io);
+  }else{
+    io->num_threads = IO_POOL_THREADS;
+    for(uint32_t i = 0; i < io->num_threads; i++){
+      pthread_create(&io->threads[i], NULL, io_pool_worker, io);
+    }
+  }
+  return io;
 }
 
-void indent(uint32_t level){
-  for(uint32_t i = 0; i< level; i++){
-    printf("  ");
+//往SQ里放一项再io_uring_enter提交，没有SQPOLL，返回时内核已经取走了
+//提交失败时把这一项从SQ里撤回，返回-errno，成功返回0
+int io_uring_push(IoQueue* io, uint8_t opcode, IoRequest* request){
+  pthread_mutex_lock(&io->lock);
+  uint32_t tail = *io->sq_tail;
+  uint32_t index = tail & *io->sq_mask;
+  struct io_uring_sqe* sqe = &io->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = opcode;
+  sqe->fd = io->file_descriptor;
+  sqe->addr = (uintptr_t)request->buffer;
+  sqe->len = request->buffer == NULL ? 0 : PAGE_SIZE;
+  sqe->off = request->offset;
+  sqe->user_data = request->tag;
+  io->sq_array[index] = index;
+  __atomic_store_n(io->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  int error = 0;
+  for(uint32_t attempt = 0; attempt < IO_URING_SUBMIT_RETRIES; attempt++){
+    long submitted = syscall(__NR_io_uring_enter, io->ring_fd, 1, 0, 0, NULL, 0);
+    if(submitted == 1){
+      error = 0;
+      break;
+    }
+    error = submitted == -1 ? -errno : -EAGAIN;
+    if(error != -EINTR && error != -EAGAIN && error != -EBUSY){
+      break;
+    }
+  }
+  //没有SQPOLL，内核只在io_uring_enter里取SQ：head没动说明这一项还在，撤回tail
+  //head动了说明内核已经取走，之后会有完成事件，当作提交成功
+  if(error != 0){
+    if(__atomic_load_n(io->sq_head, __ATOMIC_ACQUIRE) == tail){
+      __atomic_store_n(io->sq_tail, tail, __ATOMIC_RELEASE);
+    }else{
+      error = 0;
+    }
   }
+  pthread_mutex_unlock(&io->lock);
+  return error;
 }
 
-void * leaf_node_cell(void * node, uint32_t cell_num){
-  return node+ LEAF_NODE_HEADER_SIZE+ cell_num * LEAF_NODE_CELL_SIZE;
+void io_submit_read(IoQueue* io, void* buffer, off_t offset, uint32_t tag){
+  IoRequest request = {offset, buffer, tag};
+  if(io->uring){
+    //提交不了就当作读失败交给done，done里会同步补读并放开等这页的线程
+    int error = io_uring_push(io, IORING_OP_READ, &request);
+    if(error != 0){
+      io->done(io->context, tag, error);
+    }
+    return;
+  }
+  pthread_mutex_lock(&io->lock);
+  io->queue[(io->queue_head + io->queue_count) % PAGER_READAHEAD_MAX_INFLIGHT] = request;
+  io->queue_count++;
+  pthread_cond_signal(&io->cond);
+  pthread_mutex_unlock(&io->lock);
 }
 
-uint32_t* leaf_node_key(void* node, uint32_t cell_num){
-  return leaf_node_cell(node , cell_num);
+//调用方保证已经没有在路上的请求
+void io_close(IoQueue* io){
+  if(io->uring){
+    IoRequest stop = {0, NULL, UINT32_MAX};
+    if(io_uring_push(io, IORING_OP_NOP, &stop) != 0){
+      printf("io_uring submit error\n");
+      exit(EXIT_FAILURE);
+    }
+  }else{
+    pthread_mutex_lock(&io->lock);
+    io->stop = true;
+    pthread_cond_broadcast(&io->cond);
+    pthread_mutex_unlock(&io->lock);
+  }
+  for(uint32_t i = 0; i < io->num_threads; i++){
+    pthread_join(io->threads[i], NULL);
+  }
+  if(io->uring){
+    munmap(io->sqes, io->sqes_bytes);
+    if(io->cq_ring != io->sq_ring){
+      munmap(io->cq_ring, io->cq_ring_bytes);
+    }
+    munmap(io->sq_ring, io->sq_ring_bytes);
+    close(io->ring_fd);
+  }
+  pthread_mutex_destroy(&io->lock);
+  pthread_cond_destroy(&io->cond);
+  free(io);
 }
 
-uint32_t* internal_node_num_keys(void* node){
-  return node + INTERNAL_NODE_NUM_KEYS_OFFSET;
+//redo：从头读WAL，遇到提交记录就把这条语句的页镜像写进数据库文件
+//校验失败或者读到半条记录说明是崩溃时没写完的尾巴，到此为止
+//checksum_file_descriptor不是-1时重做写回的页也更新校验和
+void wal_recover(Wal * wal, int db_file_descriptor, int checksum_file_descriptor){
+  int fd = wal->file_descriptor;
+  void * image = malloc(PAGE_SIZE);
+  uint32_t pending_capacity = 64;
+  uint32_t pending_count = 0;
+  uint32_t * pending_pages = malloc(sizeof(uint32_t) * pending_capacity);
+  off_t * pending_offsets = malloc(sizeof(off_t) * pending_capacity);
+  uint32_t num_commits = 0;
+  off_t offset = 0;
+
+  while(true){
+    WalRecordHeader header;
+    if(pread(fd, &header, sizeof(header), offset) != sizeof(header)){
+      break;
+    }
+
+    if(header.type == WAL_PAGE_RECORD){
+      if(pread(fd, image, PAGE_SIZE, offset + sizeof(header)) != PAGE_SIZE ||
+         wal_record_checksum(&header, image) != header.checksum){
+        break;
+      }
+      if(pending_count == pending_capacity){
+        pending_capacity *= 2;
+        pending_pages = realloc(pending_pages, sizeof(uint32_t) * pending_capacity);
+        pending_offsets = realloc(pending_offsets, sizeof(off_t) * pending_capacity);
+      }
+      pending_pages[pending_count] = header.page_num;
+      pending_offsets[pending_count] = offset + sizeof(header);
+      pending_count++;
+      offset += sizeof(header) + PAGE_SIZE;
+    }else if(header.type == WAL_COMMIT_RECORD &&
+             wal_record_checksum(&header, NULL) == header.checksum){
+      for(uint32_t i = 0; i < pending_count; i++){
+        if(pread(fd, image, PAGE_SIZE, pending_offsets[i]) != PAGE_SIZE ||
+           pwrite(db_file_descriptor, image, PAGE_SIZE,
+                  (off_t)pending_pages[i] * PAGE_SIZE) != PAGE_SIZE){
+          printf("wal recovery error\n");
+          exit(EXIT_FAILURE);
+        }
+        if(checksum_file_descriptor != -1){
+          checksum_write(checksum_file_descriptor, pending_pages[i], image, 1);
+        }
+      }
+      //提交时的页数可能比文件里的多（新页还没写回过）
+      off_t length = (off_t)header.page_num * PAGE_SIZE;
+      if(lseek(db_file_descriptor, 0, SEEK_END) < length &&
+         ftruncate(db_file_descriptor, length) == -1){
+        printf("wal recovery error\n");
+        exit(EXIT_FAILURE);
+      }
+      pending_count = 0;
+      num_commits++;
+      offset += sizeof(header);
+    }else{
+      break;
+    }
+  }
+
+  if(num_commits > 0 && (fsync(db_file_descriptor) == -1 ||
+                         (checksum_file_descriptor != -1 && fsync(checksum_file_descriptor) == -1))){
+    printf("wal recovery error\n");
+    exit(EXIT_FAILURE);
+  }
+  if(ftruncate(fd, 0) == -1){
+    printf("wal truncate error\n");
+    exit(EXIT_FAILURE);
+  }
+
+  free(image);
+  free(pending_pages);
+  free(pending_offsets);
 }
 
-uint32_t* internal_node_right_child(void* node){
-  return node + INTERNAL_NODE_RIGHT_CHILD_OFFSET;
+//把buffer里攒的记录写到WAL末尾
+void wal_write(Wal * wal){
+  if(wal->buffer_length == 0){
+    return;
+  }
+  ssize_t bytes_written = pwrite(wal->file_descriptor, wal->buffer,
+                                 wal->buffer_length, wal->write_lsn);
+  if(bytes_written != (ssize_t)wal->buffer_length){
+    printf("wal write error\n");
+    exit(EXIT_FAILURE);
+  }
+  stats_add(STAT_WAL_BYTES, wal->buffer_length);
+
+  pthread_mutex_lock(&wal->lock);
+  wal->write_lsn += wal->buffer_length;
+  pthread_cond_signal(&wal->cond);
+  pthread_mutex_unlock(&wal->lock);
+  wal->buffer_length = 0;
 }
 
-//中间节点最多为3个key
-//返回
-uint32_t* internal_node_cell(void* node , uint32_t cell_num){
-  return node + INTERNAL_NODE_HEADER_SIZE + cell_num * INTERNAL_NODE_CELL_SIZE;
+//追加一条记录，返回该记录末尾的lsn
+uint64_t wal_append(Wal * wal, uint32_t type, uint32_t page_num, const void * image){
+  WalRecordHeader header;
+  header.type = type;
+  header.page_num = page_num;
+  header.checksum = wal_record_checksum(&header, image);
+
+  size_t length = sizeof(header) + (image == NULL ? 0 : PAGE_SIZE);
+  if(wal->buffer_length + length > wal->buffer_capacity){
+    wal_write(wal);
+  }
+  memcpy(wal->buffer + wal->buffer_length, &header, sizeof(header));
+  if(image != NULL){
+    memcpy(wal->buffer + wal->buffer_length + sizeof(header), image, PAGE_SIZE);
+  }
+  wal->buffer_length += length;
+
+  return wal->write_lsn + wal->buffer_length;
 }
 
-uint32_t* internal_node_child(void * node , uint32_t child_num){
-  uint32_t num_keys = *internal_node_num_keys(node);
-  if(child_num > num_keys){
-    printf("最多%d个孩子", num_keys);
+//checkpoint之后WAL从头开始写
+void wal_reset(Wal * wal){
+  pthread_mutex_lock(&wal->sync_lock);
+  pthread_mutex_lock(&wal->lock);
+  if(ftruncate(wal->file_descriptor, 0) == -1){
+    printf("wal truncate error\n");
     exit(EXIT_FAILURE);
-  } else if(child_num == num_keys){
-    return internal_node_right_child(node);
-  } else {
-    return internal_node_cell(node, child_num);
   }
+  wal->write_lsn = 0;
+  wal->sync_lsn = 0;
+  wal->generation++;
+  pthread_cond_broadcast(&wal->synced);
+  pthread_mutex_unlock(&wal->lock);
+  pthread_mutex_unlock(&wal->sync_lock);
 }
 
-uint32_t* internal_node_key(void* node, uint32_t key_num){
-  return (void*) internal_node_cell(node, key_num) + INTERNAL_NODE_CHILD_SIZE;
+//等flusher把generation这一轮WAL里lsn之前的记录落盘
+//之后做过checkpoint的话generation变了，记录已经在数据库文件里了
+void wal_wait_synced(Wal * wal, uint64_t lsn, uint64_t generation){
+  pthread_mutex_lock(&wal->lock);
+  while(wal->sync_lsn < lsn && wal->generation == generation){
+    pthread_cond_wait(&wal->synced, &wal->lock);
+  }
+  pthread_mutex_unlock(&wal->lock);
 }
-//
-void print_tree(Pager* pager, uint32_t page_num, uint32_t indentation_level){
-  void * node = get_page(pager, page_num);
-  uint32_t num_keys, child;
 
-  switch(get_node_type(node)){
-    case(NODE_LEAF):
-      num_keys = *leaf_node_num_cells(node);
-      indent(indentation_level);
-      printf("- leaf (size %d)\n", num_keys);
-      for (uint32_t i = 0; i < num_keys; i++) {
-        indent(indentation_level+1);
-        printf("- %d\n", *leaf_node_key(node, i));
+void wal_txn_add(Wal * wal, uint32_t page_num){
+  if(wal->txn_count == wal->txn_capacity){
+    wal->txn_capacity *= 2;
+    wal->txn_pages = realloc(wal->txn_pages, sizeof(uint32_t) * wal->txn_capacity);
+  }
+  wal->txn_pages[wal->txn_count++] = page_num;
+}
+
+//缓冲池的帧一次分配成按页对齐的一整段，读页时不用再malloc
+//开大页时多映射2MB把起点对齐到大页边界，madvise只是建议，内核不给也照常工作
+void pager_slab_open(Pager* pager, bool huge_pages){
+  size_t bytes = (size_t)pager->num_frames * PAGE_SIZE;
+  size_t alignment = huge_pages ? PAGER_HUGE_PAGE_BYTES : PAGE_SIZE;
+  bytes = (bytes + alignment - 1) / alignment * alignment;
+  size_t reserve = bytes + alignment - PAGE_SIZE;
+  void* base = mmap(NULL, reserve, PROT_READ|PROT_WRITE,
+                    MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+  if(base == MAP_FAILED){
+    printf("mmap frames error\n");
+    exit(EXIT_FAILURE);
+  }
+  uintptr_t start = ((uintptr_t)base + alignment - 1) / alignment * alignment;
+  if(start > (uintptr_t)base){
+    munmap(base, start - (uintptr_t)base);
+  }
+  if((uintptr_t)base + reserve > start + bytes){
+    munmap((void*)(start + bytes), (uintptr_t)base + reserve - start - bytes);
+  }
+  if(huge_pages){
+    madvise((void*)start, bytes, MADV_HUGEPAGE);
+  }
+  pager->frame_slab = (void*)start;
+  pager->frame_slab_bytes = bytes;
+}
+
+//先预留一大段不可访问的地址空间，再把文件映射到开头
+//映射是MAP_PRIVATE的，修改不会被内核提前写回文件，保证页先进WAL再落盘
+void pager_mmap_open(Pager* pager){
+  void* base = mmap(NULL, PAGER_MMAP_RESERVE_BYTES, PROT_NONE,
+                    MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+  if(base == MAP_FAILED){
+    printf("mmap reserve error\n");
+    exit(EXIT_FAILURE);
+  }
+  pager->map_base = base;
+  pager->map_pages = 0;
+
+  if(pager->file_length > 0){
+    void* addr = mmap(base, pager->file_length, PROT_READ|PROT_WRITE,
+                      MAP_PRIVATE|MAP_FIXED, pager->file_descriptor, 0);
+    if(addr == MAP_FAILED){
+      printf("mmap error\n");
+      exit(EXIT_FAILURE);
+    }
+    pager->map_pages = pager->file_length / PAGE_SIZE;
+  }
+  pager->map_dirty = calloc((pager->map_pages + 63) / 64, sizeof(uint64_t));
+}
+
+//ftruncate扩展文件，再把新增的部分映射到原映射的后面
+//用MAP_FIXED原地扩展而不是mremap搬家，调用方手里的页指针不会失效
+void pager_mmap_grow(Pager* pager, uint32_t min_pages){
+  uint32_t new_pages = pager->map_pages * 2;
+  if(new_pages < pager->map_pages + PAGER_MMAP_GROW_PAGES){
+    new_pages = pager->map_pages + PAGER_MMAP_GROW_PAGES;
+  }
+  if(new_pages < min_pages){
+    new_pages = min_pages;
+  }
+  if((uint64_t)new_pages * PAGE_SIZE > PAGER_MMAP_RESERVE_BYTES){
+    printf("database exceeds mmap reservation\n");
+    exit(EXIT_FAILURE);
+  }
+
+  off_t old_length = (off_t)pager->map_pages * PAGE_SIZE;
+  off_t new_length = (off_t)new_pages * PAGE_SIZE;
+  if(ftruncate(pager->file_descriptor, new_length) == -1){
+    printf("ftruncate error\n");
+    exit(EXIT_FAILURE);
+  }
+
+  void* addr = mmap(pager->map_base + old_length, new_length - old_length,
+                    PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_FIXED,
+                    pager->file_descriptor, old_length);
+  if(addr == MAP_FAILED){
+    printf("mmap error\n");
+    exit(EXIT_FAILURE);
+  }
+
+  uint32_t old_words = (pager->map_pages + 63) / 64;
+  uint32_t new_words = (new_pages + 63) / 64;
+  pager->map_dirty = realloc(pager->map_dirty, sizeof(uint64_t) * new_words);
+  memset(pager->map_dirty + old_words, 0, sizeof(uint64_t) * (new_words - old_words));
+  //预读不拿锁读map_pages，新的部分映射好之后才发布
+  __atomic_store_n(&pager->map_pages, new_pages, __ATOMIC_RELEASE);
+  pager->file_length = new_length;
+}
+
+//pager以文件为存储方式
+//以页为基本单位存储数据，页缓存在固定数量的帧里
+void pager_readahead_done(void* context, uint32_t frame, ssize_t result);
+
+Pager * pager_open(const char * filename, DbConfig * config){
+  int fd = open(filename, O_RDWR|O_CREAT, S_IWUSR|S_IRUSR);
+
+  if(fd == -1){
+    printf("unable to open the file\n");
+    exit(EXIT_FAILURE);
+  }
+  
+  //校验和文件存在就先打开，重做写回的页也要更新校验和；开没开校验和最后以文件头为准
+  int checksum_fd = checksum_open(filename, config->checksums);
+
+  //先用WAL把上次没checkpoint的提交重做到文件里
+  Wal* wal = wal_open(filename, config);
+  wal_recover(wal, fd, checksum_fd);
+
+  off_t file_length = lseek(fd, 0, SEEK_END);
+
+  if(file_length % PAGE_SIZE != 0){
+    printf("必须是4096整数倍\n");
+    exit(EXIT_FAILURE);
+  }
+
+  Pager* pager = malloc(sizeof(Pager));
+  pager->file_descriptor = fd;
+  pager->file_length = file_length;
+  pager->num_pages = file_length/PAGE_SIZE;
+  pager->mode = config->mode;
+  pager->map_base = NULL;
+  pager->map_pages = 0;
+  pager->map_dirty = NULL;
+  pager->wal = wal;
+  pager->logging = true;
+  pthread_mutex_init(&pager->lock, NULL);
+  pager->row_count = 0;
+  pager->checksum_file_descriptor = checksum_fd;
+  pager->map_latches = NULL;
+  pager->frame_slab = NULL;
+  pager->frame_slab_bytes = 0;
+  pager->io = NULL;
+  pager->readahead_pages = config->readahead_pages;
+  pager->io_pending = 0;
+  pthread_cond_init(&pager->io_done, NULL);
+  pager->pages_read = 0;
+  pager->pages_written = 0;
+  pthread_mutex_init(&pager->write_lock, NULL);
+  pthread_mutex_init(&pager->version_lock, NULL);
+  pager->snapshots = NULL;
+  pager->num_snapshots = 0;
+  pager->num_versions = 0;
+  pager->snapshot_epoch = 0;
+  pager->snapshot_num_pages = 0;
+  pager->versions = calloc(PAGER_VERSION_BUCKETS, sizeof(PageVersion*));
+
+  //mmap模式不需要缓冲池，页地址直接来自映射
+  if(pager->mode == PAGER_MMAP){
+    pager_mmap_open(pager);
+    pager->map_latches = calloc(PAGER_LATCH_CHUNKS, sizeof(pthread_rwlock_t*));
+    pager->num_frames = 0;
+    pager->frames = NULL;
+    pager->page_table = NULL;
+    pager->page_table_mask = 0;
+    pager->clock_hand = 0;
+    return pager;
+  }
+
+  uint32_t num_frames = config->cache_pages;
+  if(num_frames < PAGER_MIN_CACHE_PAGES){
+    num_frames = PAGER_MIN_CACHE_PAGES;
+  }
+  pager->num_frames = num_frames;
+  pager_slab_open(pager, config->huge_pages);
+  pager->frames = malloc(sizeof(Frame) * num_frames);
+  for(uint32_t i = 0; i < num_frames; i++){
+    pager->frames[i].page_num = INVALID_PAGE_NUM;
+    pager->frames[i].pin_count = 0;
+    pager->frames[i].dirty = false;
+    pager->frames[i].referenced = false;
+    pager->frames[i].in_txn = false;
+    pager->frames[i].lsn = 0;
+    pager->frames[i].data = pager->frame_slab + (size_t)i * PAGE_SIZE;
+    pthread_rwlock_init(&pager->frames[i].latch, NULL);
+  }
+  pager->clock_hand = 0;
+
+  //哈希表大小取不小于2倍帧数的2的幂，保证装载因子不超过0.5
+  uint32_t table_size = 1;
+  while(table_size < num_frames * 2){
+    table_size <<= 1;
+  }
+  pager->page_table = malloc(sizeof(uint32_t) * table_size);
+  for(uint32_t i = 0; i < table_size; i++){
+    pager->page_table[i] = INVALID_FRAME;
+  }
+  pager->page_table_mask = table_size - 1;
+  if(pager->readahead_pages > 0){
+    pager->io = io_open(fd, pager_readahead_done, pager);
+  }
+
+  return pager;
+}
+
+uint32_t page_table_slot(Pager* pager, uint32_t page_num){
+  return (page_num * 2654435761U) & pager->page_table_mask;
+}
+
+//返回page_num所在的帧下标，不在缓存中返回INVALID_FRAME
+//不拿锁时也可以调用：别的线程正在增删时可能漏找，但不会找错，调用方要再核对帧的page_num
+uint32_t page_table_lookup(Pager* pager, uint32_t page_num){
+  uint32_t slot = page_table_slot(pager, page_num);
+  for(uint32_t probes = 0; probes <= pager->page_table_mask; probes++){
+    uint32_t frame = __atomic_load_n(&pager->page_table[slot], __ATOMIC_RELAXED);
+    if(frame == INVALID_FRAME){
+      break;
+    }
+    if(__atomic_load_n(&pager->frames[frame].page_num, __ATOMIC_RELAXED) == page_num){
+      return frame;
+    }
+    slot = (slot + 1) & pager->page_table_mask;
+  }
+  return INVALID_FRAME;
+}
+
+void page_table_insert(Pager* pager, uint32_t page_num, uint32_t frame){
+  uint32_t slot = page_table_slot(pager, page_num);
+  while(pager->page_table[slot] != INVALID_FRAME){
+    slot = (slot + 1) & pager->page_table_mask;
+  }
+  __atomic_store_n(&pager->page_table[slot], frame, __ATOMIC_RELAXED);
+}
+
+//线性探测的删除：把后面探测链上的项往前挪，不留墓碑
+void page_table_remove(Pager* pager, uint32_t page_num){
+  uint32_t mask = pager->page_table_mask;
+  uint32_t slot = page_table_slot(pager, page_num);
+  while(pager->frames[pager->page_table[slot]].page_num != page_num){
+    slot = (slot + 1) & mask;
+  }
+  __atomic_store_n(&pager->page_table[slot], INVALID_FRAME, __ATOMIC_RELAXED);
+
+  uint32_t next = (slot + 1) & mask;
+  while(pager->page_table[next] != INVALID_FRAME){
+    uint32_t frame = pager->page_table[next];
+    uint32_t home = page_table_slot(pager, pager->frames[frame].page_num);
+    //home不在(slot, next]区间内说明该项可以挪到空出来的slot
+    if(((next - home) & mask) >= ((next - slot) & mask)){
+      __atomic_store_n(&pager->page_table[slot], frame, __ATOMIC_RELAXED);
+      __atomic_store_n(&pager->page_table[next], INVALID_FRAME, __ATOMIC_RELAXED);
+      slot = next;
+    }
+    next = (next + 1) & mask;
+  }
+}
+
+//把缓存中的页写到文件中
+//mmap模式下从私有映射pwrite回文件，再丢掉私有副本，之后缺页时重新读文件
+void pager_flush(Pager* pager, uint32_t page_num){
+  if(pager->mode == PAGER_MMAP){
+    void* page = pager->map_base + (size_t)page_num * PAGE_SIZE;
+    if(pwrite(pager->file_descriptor, page, PAGE_SIZE, (off_t)page_num * PAGE_SIZE) != PAGE_SIZE){
+      printf("flush error\n");
+      exit(EXIT_FAILURE);
+    }
+    __atomic_fetch_add(&pager->pages_written, 1, __ATOMIC_RELAXED);
+    if(pager->checksum_file_descriptor != -1){
+      checksum_write(pager->checksum_file_descriptor, page_num, page, 1);
+    }
+    madvise(page, PAGE_SIZE, MADV_DONTNEED);
+    pager->map_dirty[page_num / 64] &= ~(1ULL << (page_num % 64));
+    return;
+  }
+
+  uint32_t frame = page_table_lookup(pager, page_num);
+  if(frame == INVALID_FRAME){
+    printf("flush null page\n");
+    exit(EXIT_FAILURE);
+  }
+
+  off_t offset = (off_t)page_num * PAGE_SIZE;
+  ssize_t bytes_written = pwrite(pager->file_descriptor, pager->frames[frame].data, PAGE_SIZE, offset);
+
+  if(bytes_written == -1){
+    printf("flush error\n");
+    exit(EXIT_FAILURE);
+  }
+  __atomic_fetch_add(&pager->pages_written, 1, __ATOMIC_RELAXED);
+  if(pager->checksum_file_descriptor != -1){
+    checksum_write(pager->checksum_file_descriptor, page_num, pager->frames[frame].data, 1);
+  }
+
+  pager->frames[frame].dirty = false;
+  if(offset + PAGE_SIZE > pager->file_length){
+    pager->file_length = offset + PAGE_SIZE;
+  }
+}
+
+//CLOCK算法选出一个可以换出的帧，调用方拿着pager->lock
+//被pin住的帧跳过，访问位为1的清零后给第二次机会
+//选中的帧pin_count置成FRAME_LOADING占住，装好新页后由调用方放开
+//转两圈都找不到返回INVALID_FRAME
+uint32_t pager_try_evict(Pager* pager){
+  for(uint32_t i = 0; i < pager->num_frames * 2; i++){
+    uint32_t frame = pager->clock_hand;
+    pager->clock_hand = (pager->clock_hand + 1) % pager->num_frames;
+
+    Frame* f = &pager->frames[frame];
+    if(__atomic_load_n(&f->pin_count, __ATOMIC_RELAXED) > 0 || f->in_txn){
+      continue;
+    }
+    if(__atomic_load_n(&f->referenced, __ATOMIC_RELAXED)){
+      __atomic_store_n(&f->referenced, false, __ATOMIC_RELAXED);
+      continue;
+    }
+    //命中路径可能刚好在pin这一帧，CAS失败就让给它
+    uint32_t unpinned = 0;
+    if(!__atomic_compare_exchange_n(&f->pin_count, &unpinned, FRAME_LOADING, false,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){
+      continue;
+    }
+
+    if(f->page_num != INVALID_PAGE_NUM){
+      if(f->dirty){
+        wal_sync(pager->wal, f->lsn);
+        pager_flush(pager, f->page_num);
+      }
+      page_table_remove(pager, f->page_num);
+      __atomic_store_n(&f->page_num, INVALID_PAGE_NUM, __ATOMIC_RELAXED);
+      stats_add(STAT_EVICTIONS, 1);
+    }
+    return frame;
+  }
+  return INVALID_FRAME;
+}
+
+uint32_t pager_evict(Pager* pager){
+  uint32_t frame = pager_try_evict(pager);
+  if(frame == INVALID_FRAME){
+    printf("all %d frames are pinned or modified by the statement\n", pager->num_frames);
+    exit(EXIT_FAILURE);
+  }
+  return frame;
+}
+
+bool upgrade_node_layout(void* node);
+bool node_layout_current(uint8_t type);
+
+//命中路径：不拿锁，哈希表里找到帧后CAS加pin，再核对帧还是这一页
+//找不到、帧正在换页或者刚被换成别的页都返回NULL，交给加锁的慢路径
+void* pager_pin_cached(Pager* pager, uint32_t page_num){
+  uint32_t frame = page_table_lookup(pager, page_num);
+  if(frame == INVALID_FRAME){
+    return NULL;
+  }
+  Frame* f = &pager->frames[frame];
+  uint32_t pins = __atomic_load_n(&f->pin_count, __ATOMIC_RELAXED);
+  do{
+    if(pins & FRAME_LOADING){
+      return NULL;
+    }
+  }while(!__atomic_compare_exchange_n(&f->pin_count, &pins, pins + 1, true,
+                                      __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+  if(__atomic_load_n(&f->page_num, __ATOMIC_RELAXED) != page_num){
+    __atomic_fetch_sub(&f->pin_count, 1, __ATOMIC_RELEASE);
+    return NULL;
+  }
+  if(!__atomic_load_n(&f->referenced, __ATOMIC_RELAXED)){
+    __atomic_store_n(&f->referenced, true, __ATOMIC_RELAXED);
+  }
+  return f->data;
+}
+
+//返回page_num对应页的地址，并pin住该页
+//调用方用完后必须调用pager_unpin，修改前必须调用pager_mark_dirty
+//页不在缓存中时拿锁换出一帧，从文件读入或者清零作为新页
+//文件里读出的旧格式节点在别的线程看到之前就地升级，不标脏，等这页真被修改时才写回
+void * get_page(Pager* pager, uint32_t page_num){
+  if(pager->mode == PAGER_MMAP){
+    void* page = pager->map_base + (size_t)page_num * PAGE_SIZE;
+    if(page_num < __atomic_load_n(&pager->num_pages, __ATOMIC_ACQUIRE) &&
+       node_layout_current(__atomic_load_n((uint8_t*)page, __ATOMIC_ACQUIRE))){
+      return page;
+    }
+    pthread_mutex_lock(&pager->lock);
+    if(page_num >= pager->map_pages){
+      pager_mmap_grow(pager, page_num + 1);
+    }
+    if(page_num >= pager->num_pages){
+      __atomic_store_n(&pager->num_pages, page_num + 1, __ATOMIC_RELEASE);
+    }else{
+      upgrade_node_layout(page);
+    }
+    pthread_mutex_unlock(&pager->lock);
+    return page;
+  }
+
+  void* data = pager_pin_cached(pager, page_num);
+  if(data != NULL){
+    stats_add(STAT_CACHE_HITS, 1);
+    return data;
+  }
+
+  pthread_mutex_lock(&pager->lock);
+  //拿到锁之前可能已经有别的线程把这页读进来了
+  //拿着锁还在哈希表里却pin不上，只能是预读还没读完，等它读完
+  while(true){
+    data = pager_pin_cached(pager, page_num);
+    if(data != NULL){
+      pthread_mutex_unlock(&pager->lock);
+      stats_add(STAT_CACHE_HITS, 1);
+      return data;
+    }
+    if(page_table_lookup(pager, page_num) == INVALID_FRAME){
+      break;
+    }
+    pthread_cond_wait(&pager->io_done, &pager->lock);
+  }
+
+  uint32_t frame = pager_evict(pager);
+  Frame* f = &pager->frames[frame];
+  stats_add(STAT_CACHE_MISSES, 1);
+
+  if((off_t)page_num * PAGE_SIZE < pager->file_length){
+    ssize_t bytes_read = pread(pager->file_descriptor, f->data, PAGE_SIZE, (off_t)page_num * PAGE_SIZE);
+    if(bytes_read == -1){
+      printf("读文件错误\n");
+      exit(EXIT_FAILURE);
+    }
+    __atomic_fetch_add(&pager->pages_read, 1, __ATOMIC_RELAXED);
+    if(pager->checksum_file_descriptor != -1){
+      checksum_verify(pager->checksum_file_descriptor, page_num, f->data);
+    }
+    upgrade_node_layout(f->data);
+  }else{
+    memset(f->data, 0, PAGE_SIZE);
+  }
+
+  f->dirty = false;
+  f->lsn = 0;
+  f->referenced = true;
+  __atomic_store_n(&f->page_num, page_num, __ATOMIC_RELAXED);
+  page_table_insert(pager, page_num, frame);
+
+  if(page_num >= pager->num_pages){
+    __atomic_store_n(&pager->num_pages, page_num + 1, __ATOMIC_RELEASE);
+  }
+  //放开FRAME_LOADING，同时算上调用方这一个pin
+  __atomic_store_n(&f->pin_count, 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&pager->lock);
+  return f->data;
+}
+
+//预读：空出一帧挂上FRAME_LOADING登记进哈希表，然后交给I/O线程去读，不等它读完
+//已经在缓存里、超出文件、在路上的太多或者没有能换出的帧时什么都不做，预读只是提示
+//mmap模式交给内核：MADV_WILLNEED让页缓存提前读
+void pager_readahead(Pager* pager, uint32_t page_num){
+  if(pager->mode == PAGER_MMAP){
+    if(page_num < __atomic_load_n(&pager->map_pages, __ATOMIC_ACQUIRE)){
+      madvise(pager->map_base + (size_t)page_num * PAGE_SIZE, PAGE_SIZE, MADV_WILLNEED);
+    }
+    return;
+  }
+  if(pager->io == NULL || page_table_lookup(pager, page_num) != INVALID_FRAME ||
+     __atomic_load_n(&pager->io_pending, __ATOMIC_RELAXED) >= PAGER_READAHEAD_MAX_INFLIGHT){
+    return;
+  }
+  pthread_mutex_lock(&pager->lock);
+  if((off_t)(page_num + 1) * PAGE_SIZE > pager->file_length ||
+     page_table_lookup(pager, page_num) != INVALID_FRAME ||
+     pager->io_pending >= PAGER_READAHEAD_MAX_INFLIGHT){
+    pthread_mutex_unlock(&pager->lock);
+    return;
+  }
+  uint32_t frame = pager_try_evict(pager);
+  if(frame == INVALID_FRAME){
+    pthread_mutex_unlock(&pager->lock);
+    return;
+  }
+  Frame* f = &pager->frames[frame];
+  f->dirty = false;
+  f->lsn = 0;
+  //读进来之后没人用就先被换出去
+  f->referenced = false;
+  __atomic_store_n(&f->page_num, page_num, __ATOMIC_RELAXED);
+  page_table_insert(pager, page_num, frame);
+  __atomic_fetch_add(&pager->io_pending, 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&pager->lock);
+  stats_add(STAT_READAHEAD_PAGES, 1);
+  io_submit_read(pager->io, f->data, (off_t)page_num * PAGE_SIZE, frame);
+}
+
+//在I/O线程里调用：核对、升级格式，再放开FRAME_LOADING唤醒等这页的线程
+//io_uring不支持这个操作或者读短了就在这里同步补读
+void pager_readahead_done(void* context, uint32_t frame, ssize_t result){
+  Pager* pager = context;
+  Frame* f = &pager->frames[frame];
+  uint32_t page_num = __atomic_load_n(&f->page_num, __ATOMIC_RELAXED);
+  if(result != PAGE_SIZE &&
+     pread(pager->file_descriptor, f->data, PAGE_SIZE, (off_t)page_num * PAGE_SIZE) != PAGE_SIZE){
+    printf("读文件错误\n");
+    exit(EXIT_FAILURE);
+  }
+  __atomic_fetch_add(&pager->pages_read, 1, __ATOMIC_RELAXED);
+  if(pager->checksum_file_descriptor != -1){
+    checksum_verify(pager->checksum_file_descriptor, page_num, f->data);
+  }
+  upgrade_node_layout(f->data);
+
+  pthread_mutex_lock(&pager->lock);
+  __atomic_store_n(&f->pin_count, 0, __ATOMIC_RELEASE);
+  __atomic_fetch_sub(&pager->io_pending, 1, __ATOMIC_RELAXED);
+  pthread_cond_broadcast(&pager->io_done);
+  pthread_mutex_unlock(&pager->lock);
+}
+
+//关闭前等所有预读落地
+void pager_readahead_drain(Pager* pager){
+  pthread_mutex_lock(&pager->lock);
+  while(pager->io_pending > 0){
+    pthread_cond_wait(&pager->io_done, &pager->lock);
+  }
+  pthread_mutex_unlock(&pager->lock);
+}
+
+//pin住的帧不会被换出，但无锁查找可能碰上别的线程正在挪哈希表，漏找时拿锁再找一次
+uint32_t pager_pinned_frame(Pager* pager, uint32_t page_num){
+  uint32_t frame = page_table_lookup(pager, page_num);
+  if(frame == INVALID_FRAME){
+    pthread_mutex_lock(&pager->lock);
+    frame = page_table_lookup(pager, page_num);
+    pthread_mutex_unlock(&pager->lock);
+  }
+  if(frame == INVALID_FRAME || __atomic_load_n(&pager->frames[frame].pin_count, __ATOMIC_RELAXED) == 0){
+    printf("page %d is not pinned\n", page_num);
+    exit(EXIT_FAILURE);
+  }
+  return frame;
+}
+
+void pager_unpin(Pager* pager, uint32_t page_num){
+  if(pager->mode == PAGER_MMAP){
+    return;
+  }
+  uint32_t frame = pager_pinned_frame(pager, page_num);
+  __atomic_fetch_sub(&pager->frames[frame].pin_count, 1, __ATOMIC_RELEASE);
+}
+
+//页的latch，调用方必须已经pin住这页
+pthread_rwlock_t* page_latch(Pager* pager, uint32_t page_num){
+  if(pager->mode == PAGER_BUFFERED){
+    return &pager->frames[pager_pinned_frame(pager, page_num)].latch;
+  }
+  uint32_t chunk = page_num / PAGER_LATCH_CHUNK_PAGES;
+  pthread_rwlock_t* latches = __atomic_load_n(&pager->map_latches[chunk], __ATOMIC_ACQUIRE);
+  if(latches == NULL){
+    pthread_mutex_lock(&pager->lock);
+    latches = pager->map_latches[chunk];
+    if(latches == NULL){
+      latches = malloc(sizeof(pthread_rwlock_t) * PAGER_LATCH_CHUNK_PAGES);
+      for(uint32_t i = 0; i < PAGER_LATCH_CHUNK_PAGES; i++){
+        pthread_rwlock_init(&latches[i], NULL);
+      }
+      __atomic_store_n(&pager->map_latches[chunk], latches, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&pager->lock);
+  }
+  return &latches[page_num % PAGER_LATCH_CHUNK_PAGES];
+}
+
+void page_lock(Pager* pager, uint32_t page_num, LatchMode mode){
+  pthread_rwlock_t* latch = page_latch(pager, page_num);
+  if(mode == LATCH_EXCLUSIVE){
+    pthread_rwlock_wrlock(latch);
+  }else{
+    pthread_rwlock_rdlock(latch);
+  }
+}
+
+void page_unlock(Pager* pager, uint32_t page_num){
+  pthread_rwlock_unlock(page_latch(pager, page_num));
+}
+
+//get_page再加latch，用pager_release放开
+void* pager_acquire(Pager* pager, uint32_t page_num, LatchMode mode){
+  void* page = get_page(pager, page_num);
+  page_lock(pager, page_num, mode);
+  return page;
+}
+
+void pager_release(Pager* pager, uint32_t page_num){
+  page_unlock(pager, page_num);
+  pager_unpin(pager, page_num);
+}
+
+//只在不用读盘、不用等latch的时候拿到页的共享latch，否则返回NULL
+//用来从下往上看父节点：往上等latch会和往下crabbing的写线程互相等
+void* pager_try_acquire_shared(Pager* pager, uint32_t page_num){
+  void* page;
+  if(pager->mode == PAGER_MMAP){
+    if(page_num >= __atomic_load_n(&pager->num_pages, __ATOMIC_ACQUIRE)){
+      return NULL;
+    }
+    page = pager->map_base + (size_t)page_num * PAGE_SIZE;
+    if(!node_layout_current(__atomic_load_n((uint8_t*)page, __ATOMIC_ACQUIRE))){
+      return NULL;
+    }
+  }else{
+    page = pager_pin_cached(pager, page_num);
+    if(page == NULL){
+      return NULL;
+    }
+  }
+  if(pthread_rwlock_tryrdlock(page_latch(pager, page_num)) != 0){
+    pager_unpin(pager, page_num);
+    return NULL;
+  }
+  return page;
+}
+
+//有快照开着的时候，最新的快照开始之后第一次改这一页之前先把旧内容留一份
+//改页的线程拿着这一页的排他latch，按快照读的线程拿着共享latch，不会看到改了一半的页
+void pager_version_page(Pager* pager, uint32_t page_num, void* page){
+  if(__atomic_load_n(&pager->num_snapshots, __ATOMIC_ACQUIRE) == 0){
+    return;
+  }
+  pthread_mutex_lock(&pager->version_lock);
+  if(pager->num_snapshots > 0 && page_num < pager->snapshot_num_pages){
+    PageVersion** bucket = &pager->versions[page_num % PAGER_VERSION_BUCKETS];
+    PageVersion* newest = *bucket;
+    while(newest != NULL && newest->page_num != page_num){
+      newest = newest->next;
+    }
+    if(newest == NULL || newest->epoch < pager->snapshot_epoch){
+      PageVersion* version = malloc(sizeof(PageVersion) + PAGE_SIZE);
+      version->page_num = page_num;
+      version->epoch = pager->snapshot_epoch;
+      memcpy(version->data, page, PAGE_SIZE);
+      version->next = *bucket;
+      *bucket = version;
+      __atomic_store_n(&pager->num_versions, pager->num_versions + 1, __ATOMIC_RELEASE);
+      stats_add(STAT_PAGE_VERSIONS, 1);
+    }
+  }
+  pthread_mutex_unlock(&pager->version_lock);
+}
+
+//标记为脏页，换出或者关闭时写回
+//同时记进当前语句的修改集合，提交时写进WAL
+//调用方在改页之前标脏，快照要在这里留下改之前的内容
+void pager_mark_dirty(Pager* pager, uint32_t page_num){
+  Wal* wal = pager->wal;
+  pthread_mutex_lock(&pager->lock);
+  if(pager->mode == PAGER_MMAP){
+    pager_version_page(pager, page_num, pager->map_base + (size_t)page_num * PAGE_SIZE);
+    pager->map_dirty[page_num / 64] |= 1ULL << (page_num % 64);
+    if(pager->logging &&
+       (wal->txn_count == 0 || wal->txn_pages[wal->txn_count - 1] != page_num)){
+      wal_txn_add(wal, page_num);
+    }
+    pthread_mutex_unlock(&pager->lock);
+    return;
+  }
+  uint32_t frame = page_table_lookup(pager, page_num);
+  if(frame == INVALID_FRAME){
+    printf("mark dirty on page %d which is not cached\n", page_num);
+    exit(EXIT_FAILURE);
+  }
+  Frame* f = &pager->frames[frame];
+  pager_version_page(pager, page_num, f->data);
+  f->dirty = true;
+  if(pager->logging && !f->in_txn){
+    f->in_txn = true;
+    wal_txn_add(wal, page_num);
+  }
+  pthread_mutex_unlock(&pager->lock);
+}
+
+int compare_page_num(const void* a, const void* b){
+  uint32_t x = *(const uint32_t*)a;
+  uint32_t y = *(const uint32_t*)b;
+  return (x > y) - (x < y);
+}
+
+//写回从first_page开始的连续一段页，一次pwritev
+void pager_write_run(Pager* pager, uint32_t first_page, struct iovec* iov, int iov_count){
+  off_t offset = (off_t)first_page * PAGE_SIZE;
+  ssize_t expected = 0;
+  for(int i = 0; i < iov_count; i++){
+    expected += iov[i].iov_len;
+  }
+  if(pwritev(pager->file_descriptor, iov, iov_count, offset) != expected){
+    printf("flush error\n");
+    exit(EXIT_FAILURE);
+  }
+  __atomic_fetch_add(&pager->pages_written, expected / PAGE_SIZE, __ATOMIC_RELAXED);
+  if(pager->checksum_file_descriptor != -1){
+    uint32_t page_num = first_page;
+    for(int i = 0; i < iov_count; i++){
+      checksum_write(pager->checksum_file_descriptor, page_num, iov[i].iov_base, iov[i].iov_len / PAGE_SIZE);
+      page_num += iov[i].iov_len / PAGE_SIZE;
+    }
+  }
+  if(offset + expected > pager->file_length){
+    pager->file_length = offset + expected;
+  }
+}
+
+//只写脏页：按页号排好序，页号连续的一段合成一次pwritev
+//mmap模式下连续的页在映射里也是连续的，直接整段写
+//拿着pager->lock，写回期间帧不会被换出线程挪走
+void pager_flush_dirty(Pager* pager){
+  pthread_mutex_lock(&pager->lock);
+  if(pager->mode == PAGER_MMAP){
+    uint32_t page_num = 0;
+    while(page_num < pager->map_pages){
+      if(!(pager->map_dirty[page_num / 64] & (1ULL << (page_num % 64)))){
+        page_num++;
+        continue;
+      }
+      uint32_t first_page = page_num;
+      while(page_num < pager->map_pages &&
+            (pager->map_dirty[page_num / 64] & (1ULL << (page_num % 64)))){
+        pager->map_dirty[page_num / 64] &= ~(1ULL << (page_num % 64));
+        page_num++;
+      }
+      struct iovec iov;
+      iov.iov_base = pager->map_base + (size_t)first_page * PAGE_SIZE;
+      iov.iov_len = (size_t)(page_num - first_page) * PAGE_SIZE;
+      pager_write_run(pager, first_page, &iov, 1);
+      madvise(iov.iov_base, iov.iov_len, MADV_DONTNEED);
+    }
+    pthread_mutex_unlock(&pager->lock);
+    return;
+  }
+
+  uint32_t* dirty = malloc(sizeof(uint32_t) * pager->num_frames);
+  uint32_t num_dirty = 0;
+  for(uint32_t i = 0; i < pager->num_frames; i++){
+    Frame* f = &pager->frames[i];
+    if(f->page_num != INVALID_PAGE_NUM && f->dirty){
+      dirty[num_dirty++] = f->page_num;
+    }
+    f->lsn = 0;
+  }
+  qsort(dirty, num_dirty, sizeof(uint32_t), compare_page_num);
+
+  struct iovec iov[PAGER_FLUSH_MAX_RUN];
+  uint32_t i = 0;
+  while(i < num_dirty){
+    uint32_t first_page = dirty[i];
+    int count = 0;
+    while(i < num_dirty && count < PAGER_FLUSH_MAX_RUN && dirty[i] == first_page + count){
+      Frame* f = &pager->frames[page_table_lookup(pager, dirty[i])];
+      iov[count].iov_base = f->data;
+      iov[count].iov_len = PAGE_SIZE;
+      f->dirty = false;
+      count++;
+      i++;
+    }
+    pager_write_run(pager, first_page, iov, count);
+  }
+  free(dirty);
+  pthread_mutex_unlock(&pager->lock);
+}
+
+//checkpoint：WAL先落盘，再把脏页写回并fsync数据库文件，最后清空WAL
+//分配了但还没写过的页把文件补齐，文件总是不短于文件头里记的页数
+void pager_checkpoint(Pager* pager){
+  Wal* wal = pager->wal;
+  wal_sync(wal, wal->write_lsn);
+
+  pager_flush_dirty(pager);
+
+  off_t length = (off_t)pager->num_pages * PAGE_SIZE;
+  if(pager->file_length < length){
+    if(ftruncate(pager->file_descriptor, length) == -1){
+      printf("ftruncate error\n");
+      exit(EXIT_FAILURE);
+    }
+    pager->file_length = length;
+  }
+  if(fsync(pager->file_descriptor) == -1 ||
+     (pager->checksum_file_descriptor != -1 && fsync(pager->checksum_file_descriptor) == -1)){
+    printf("fsync error\n");
+    exit(EXIT_FAILURE);
+  }
+  wal_reset(wal);
+}
+
+//未提交的修改占了太多缓存帧，调用方应该先提交
+//no-steal下这些帧在提交前换不出去
+bool pager_txn_full(Pager* pager){
+  return pager->mode == PAGER_BUFFERED &&
+         pager->wal->txn_count >= pager->num_frames / BATCH_COMMIT_FRAME_DIVISOR;
+}
+
+uint32_t* header_version(void* node){
+  return node + HEADER_VERSION_OFFSET;
+}
+
+uint32_t* header_page_size(void* node){
+  return node + HEADER_PAGE_SIZE_OFFSET;
+}
+
+uint32_t* header_flags(void* node){
+  return node + HEADER_FLAGS_OFFSET;
+}
+
+uint32_t* header_page_count(void* node){
+  return node + HEADER_PAGE_COUNT_OFFSET;
+}
+
+uint32_t* header_free_head(void* node){
+  return node + HEADER_FREE_HEAD_OFFSET;
+}
+
+uint64_t* header_row_count(void* node){
+  return node + HEADER_ROW_COUNT_OFFSET;
+}
+
+uint32_t* header_tree_root(void* node, uint32_t tree){
+  return node + HEADER_TREES_OFFSET + tree * HEADER_TREE_SIZE;
+}
+
+uint32_t* header_tree_height(void* node, uint32_t tree){
+  return node + HEADER_TREES_OFFSET + tree * HEADER_TREE_SIZE + sizeof(uint32_t);
+}
+
+uint32_t* header_checksum(void* node){
+  return node + HEADER_CHECKSUM_OFFSET;
+}
+
+//格式版本同时是校验和的种子
+uint32_t header_compute_checksum(void* node){
+  return wal_checksum(node, HEADER_CHECKSUM_OFFSET, *header_version(node));
+}
+
+//写进WAL之前重算校验和，文件里的文件头总是封好的
+void header_seal(void* node){
+  *header_checksum(node) = header_compute_checksum(node);
+}
+
+//新的文件头：各棵树和free list都是空的，页数和行数提交时写
+void header_init(void* node, bool checksums){
+  memset(node, 0, PAGE_SIZE);
+  *(uint8_t*)node = NODE_HEADER;
+  memcpy(node + HEADER_MAGIC_OFFSET, HEADER_MAGIC, HEADER_MAGIC_SIZE);
+  *header_version(node) = HEADER_FORMAT_VERSION;
+  *header_page_size(node) = PAGE_SIZE;
+  *header_flags(node) = checksums ? HEADER_FLAG_CHECKSUMS : 0;
+}
+
+//页数和行数平时只记在pager里，提交时有变化才写进文件头，一起进WAL
+void pager_sync_header(Pager* pager){
+  void* header = get_page(pager, HEADER_PAGE_NUM);
+  if(*header_page_count(header) != pager->num_pages || *header_row_count(header) != pager->row_count){
+    pager_mark_dirty(pager, HEADER_PAGE_NUM);
+    *header_page_count(header) = pager->num_pages;
+    *header_row_count(header) = pager->row_count;
+  }
+  pager_unpin(pager, HEADER_PAGE_NUM);
+}
+
+//开一个快照：等当前的写语句做完，记下这一刻的根、页数和行数
+//之后写线程改哪一页，改之前都先留一份旧内容，直到快照关掉
+//不能拿着页的latch开快照，写线程可能正等着这个latch
+Snapshot* snapshot_begin(Table* table){
+  Pager* pager = table->pager;
+  Snapshot* snapshot = malloc(sizeof(Snapshot));
+  pthread_mutex_lock(&pager->write_lock);
+  void* header = get_page(pager, HEADER_PAGE_NUM);
+  for(uint32_t tree = 0; tree < HEADER_TREES; tree++){
+    snapshot->roots[tree] = *header_tree_root(header, tree);
+    snapshot->heights[tree] = *header_tree_height(header, tree);
+  }
+  snapshot->free_head = *header_free_head(header);
+  pager_unpin(pager, HEADER_PAGE_NUM);
+  snapshot->num_pages = pager->num_pages;
+  snapshot->row_count = pager->row_count;
+
+  pthread_mutex_lock(&pager->version_lock);
+  snapshot->epoch = ++pager->snapshot_epoch;
+  pager->snapshot_num_pages = pager->num_pages;
+  snapshot->next = pager->snapshots;
+  pager->snapshots = snapshot;
+  __atomic_store_n(&pager->num_snapshots, pager->num_snapshots + 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&pager->version_lock);
+  pthread_mutex_unlock(&pager->write_lock);
+  return snapshot;
+}
+
+//关掉快照，epoch比剩下的快照都小的版本再也用不到了，放掉
+void snapshot_end(Table* table, Snapshot* snapshot){
+  Pager* pager = table->pager;
+  pthread_mutex_lock(&pager->version_lock);
+  Snapshot** link = &pager->snapshots;
+  while(*link != snapshot){
+    link = &(*link)->next;
+  }
+  *link = snapshot->next;
+  __atomic_store_n(&pager->num_snapshots, pager->num_snapshots - 1, __ATOMIC_RELEASE);
+
+  uint64_t oldest = UINT64_MAX;
+  for(Snapshot* s = pager->snapshots; s != NULL; s = s->next){
+    if(s->epoch < oldest){
+      oldest = s->epoch;
+    }
+  }
+  uint64_t num_versions = pager->num_versions;
+  for(uint32_t i = 0; i < PAGER_VERSION_BUCKETS && num_versions > 0; i++){
+    PageVersion** version = &pager->versions[i];
+    while(*version != NULL){
+      if((*version)->epoch < oldest){
+        PageVersion* stale = *version;
+        *version = stale->next;
+        free(stale);
+        num_versions--;
+      }else{
+        version = &(*version)->next;
+      }
+    }
+  }
+  __atomic_store_n(&pager->num_versions, num_versions, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&pager->version_lock);
+  free(snapshot);
+}
+
+//按快照读一页：和平时一样pin住并加共享latch，快照开始之后被改过的页换成留下的版本
+//用的是epoch不小于快照的版本里最早的那个，都没有时这一页从快照开始就没变过
+//版本在快照关掉之前不会被放掉，release照样按页号
+void* pager_acquire_snapshot(Pager* pager, uint32_t page_num, Snapshot* snapshot){
+  void* page = pager_acquire(pager, page_num, LATCH_SHARED);
+  if(__atomic_load_n(&pager->num_versions, __ATOMIC_ACQUIRE) == 0){
+    return page;
+  }
+  pthread_mutex_lock(&pager->version_lock);
+  for(PageVersion* version = pager->versions[page_num % PAGER_VERSION_BUCKETS];
+      version != NULL; version = version->next){
+    if(version->page_num != page_num){
+      continue;
+    }
+    if(version->epoch < snapshot->epoch){
+      break;
+    }
+    page = version->data;
+  }
+  pthread_mutex_unlock(&pager->version_lock);
+  return page;
+}
+
+//提交的前一半：把修改过的页镜像和一条提交记录写进WAL，返回提交记录的lsn，generation填这一轮WAL
+//txn_pages是所有写线程共用的，调用方要拿着write_lock（或者是唯一的写线程），别的语句的页不会混进来
+//WAL太大时顺便checkpoint，这时记录已经在数据库文件里，返回0
+uint64_t pager_commit_append(Pager* pager, uint64_t* generation){
+  Wal* wal = pager->wal;
+  *generation = wal->generation;
+  if(wal->txn_count == 0){
+    return 0;
+  }
+  pager_sync_header(pager);
+
+  pthread_mutex_lock(&pager->lock);
+  qsort(wal->txn_pages, wal->txn_count, sizeof(uint32_t), compare_page_num);
+  uint32_t previous = INVALID_PAGE_NUM;
+  for(uint32_t i = 0; i < wal->txn_count; i++){
+    uint32_t page_num = wal->txn_pages[i];
+    if(page_num == previous){
+      continue;
+    }
+    previous = page_num;
+
+    if(pager->mode == PAGER_MMAP){
+      void* page = pager->map_base + (size_t)page_num * PAGE_SIZE;
+      if(page_num == HEADER_PAGE_NUM){
+        header_seal(page);
+      }
+      wal_append(wal, WAL_PAGE_RECORD, page_num, page);
+    }else{
+      Frame* f = &pager->frames[page_table_lookup(pager, page_num)];
+      if(page_num == HEADER_PAGE_NUM){
+        header_seal(f->data);
+      }
+      f->lsn = wal_append(wal, WAL_PAGE_RECORD, page_num, f->data);
+      f->in_txn = false;
+    }
+  }
+  uint64_t commit_lsn = wal_append(wal, WAL_COMMIT_RECORD, pager->num_pages, NULL);
+  wal_write(wal);
+  wal->txn_count = 0;
+  pthread_mutex_unlock(&pager->lock);
+
+  //checkpoint会把所有脏页写回再清空WAL，不能让别的写语句改到一半的页混进去
+  if(wal->write_lsn >= wal->checkpoint_bytes){
+    pager_checkpoint(pager);
+    return 0;
+  }
+  return commit_lsn;
+}
+
+//提交的后一半：等提交记录落盘，不用拿write_lock，别的写线程可以接着执行、一起等同一次fdatasync
+//sync窗口为0时自己fdatasync，正在sync的线程做完之后排在后面的线程发现已经落盘就直接返回
+//窗口大于0时等flusher线程成组落盘
+void pager_commit_wait(Pager* pager, uint64_t lsn, uint64_t generation){
+  Wal* wal = pager->wal;
+  if(wal->sync_window_ms > 0){
+    wal_wait_synced(wal, lsn, generation);
+    return;
+  }
+  pthread_mutex_lock(&wal->lock);
+  bool current = wal->generation == generation;
+  pthread_mutex_unlock(&wal->lock);
+  if(current){
+    wal_sync(wal, lsn);
+  }
+}
+
+//语句结束时调用：写提交记录并等它落盘，落盘之后才算提交成功，调用方才能回复executed.
+//只有一个写线程的地方用它；并发写的语句由execute_statement拆成两半
+void pager_commit(Pager* pager){
+  uint64_t start_ns = stats_now_ns();
+  uint64_t generation;
+  uint64_t lsn = pager_commit_append(pager, &generation);
+  pager_commit_wait(pager, lsn, generation);
+  stats_record_latency(LATENCY_COMMIT, start_ns);
+}
+
+//Page堆空间开始８字节为节点类型
+//标为中间节点或者叶子节点
+void set_node_type(void * node, NodeType type){
+  uint8_t layout = type == NODE_INTERNAL ? INTERNAL_NODE_LAYOUT : LEAF_NODE_LAYOUT;
+  uint8_t value = type | (layout << NODE_LAYOUT_SHIFT);
+  //mmap模式下get_page不拿latch就原子地读这个字节看布局，这里也要原子写
+  __atomic_store_n((uint8_t *) (node + NODE_TYPE_OFFSET), value, __ATOMIC_RELEASE);
+}
+
+//表明该页是不是根节点
+void set_node_root(void * node, bool is_root){
+  uint8_t value = is_root;
+  *((uint8_t *) (node + IS_ROOT_OFFSET)) = value;
+}
+
+bool is_node_root(void * node){
+  uint8_t value = *((uint8_t *) (node + IS_ROOT_OFFSET));
+  return (bool)value;
+}
+
+uint32_t* leaf_node_num_cells(void * node){
+  return node + LEAF_NODE_NUM_CELLS_OFFSET;
+}
+
+uint32_t * leaf_node_next_leaf(void * node){
+  return node + LEAF_NODE_NEXT_LEAF_OFFSET;
+}
+
+uint16_t* leaf_node_heap_start(void * node){
+  return node + LEAF_NODE_HEAP_START_OFFSET;
+}
+
+uint16_t* leaf_node_fragmented(void * node){
+  return node + LEAF_NODE_FRAGMENTED_OFFSET;
+}
+
+//清空cell，保留父指针、根标记和next_leaf
+void leaf_node_reset(void * node){
+  set_node_type(node, NODE_LEAF);
+  *leaf_node_num_cells(node) = 0;
+  *leaf_node_heap_start(node) = PAGE_SIZE;
+  *leaf_node_fragmented(node) = 0;
+}
+
+//node是堆起始地址值
+void initialize_leaf_node(void * node){
+  set_node_root(node, false);
+  *leaf_node_next_leaf(node) = 0;
+  leaf_node_reset(node);
+}
+
+__thread Arena thread_arena;
+
+void* arena_alloc(Arena* arena, size_t size){
+  size = (size + 15) & ~(size_t)15;
+  ArenaBlock* block = arena->blocks;
+  if(block == NULL || block->capacity - block->used < size){
+    size_t capacity = block == NULL ? ARENA_BLOCK_BYTES : block->capacity * 2;
+    while(capacity < size){
+      capacity *= 2;
+    }
+    ArenaBlock* next = malloc(sizeof(ArenaBlock) + capacity);
+    next->next = block;
+    next->capacity = capacity;
+    next->used = 0;
+    arena->blocks = next;
+    block = next;
+  }
+  void* result = block->data + block->used;
+  block->used += size;
+  arena->last = result;
+  return result;
+}
+
+//把ptr从old_size扩到new_size：是最近一次分配并且块里还有地方就原地扩，否则拷到新分配的地方
+void* arena_grow(Arena* arena, void* ptr, size_t old_size, size_t new_size){
+  ArenaBlock* block = arena->blocks;
+  if(ptr != NULL && ptr == arena->last){
+    size_t offset = (char*)ptr - block->data;
+    size_t size = (new_size + 15) & ~(size_t)15;
+    if(block->capacity - offset >= size){
+      block->used = offset + size;
+      return ptr;
+    }
+  }
+  void* result = arena_alloc(arena, new_size);
+  if(old_size > 0){
+    memcpy(result, ptr, old_size);
+  }
+  return result;
+}
+
+//语句结束时调用，之前分配出去的东西全部作废，池子里的cursor也一起作废
+void arena_reset(Arena* arena){
+  ArenaBlock* block = arena->blocks;
+  if(block == NULL){
+    return;
+  }
+  //只留最大的一块，下一条同样大小的语句不用再malloc
+  while(block->next != NULL){
+    ArenaBlock* next = block->next;
+    block->next = next->next;
+    free(next);
+  }
+  block->used = 0;
+  arena->last = NULL;
+  arena->free_cursors = NULL;
+}
+
+//线程退出前调用
+void arena_free(Arena* arena){
+  while(arena->blocks != NULL){
+    ArenaBlock* next = arena->blocks->next;
+    free(arena->blocks);
+    arena->blocks = next;
+  }
+  arena->last = NULL;
+  arena->free_cursors = NULL;
+}
+
+Cursor* cursor_alloc(){
+  Arena* arena = &thread_arena;
+  Cursor* cursor = arena->free_cursors;
+  if(cursor != NULL){
+    arena->free_cursors = cursor->next_free;
+    return cursor;
+  }
+  return arena_alloc(arena, sizeof(Cursor));
+}
+
+void db_config_init(DbConfig * config){
+  config->cache_pages = PAGER_DEFAULT_CACHE_PAGES;
+  config->mode = PAGER_BUFFERED;
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  config->scan_threads = cores < 1 ? 1 : cores > SCAN_MAX_THREADS ? SCAN_MAX_THREADS : cores;
+  config->wal_sync_window_ms = WAL_DEFAULT_SYNC_WINDOW_MS;
+  config->wal_checkpoint_bytes = WAL_DEFAULT_CHECKPOINT_BYTES;
+  config->checksums = false;
+  config->huge_pages = false;
+  config->readahead_pages = PAGER_DEFAULT_READAHEAD_PAGES;
+  config->output_format = OUTPUT_TEXT;
+}
+
+//实例化table和pager
+//新文件先写文件头和空的根，没有文件头的旧文件先迁移，最后从文件头加载
+//db结构为b-树
+void key_search_init();
+void header_create(Pager* pager, bool checksums);
+void header_migrate(Pager* pager);
+void header_load(Table* table, DbConfig* config);
+
+Table * db_open(const char * filename, DbConfig * config){
+  key_search_init();
+  Pager * pager = pager_open(filename, config);
+
+  Table* table = malloc(sizeof(Table));
+  table->pager = pager;
+  table->scan_threads = config->scan_threads;
+  table->output_format = config->output_format;
+  table->tree = HEADER_TREE_PRIMARY;
+  table->root_page_num = INVALID_PAGE_NUM;
+  table->rightmost_leaf_page_num = INVALID_PAGE_NUM;
+  for(uint32_t c = 0; c < INDEX_COLUMNS; c++){
+    table->indexes[c] = NULL;
+  }
+
+  if(pager->num_pages == 0){
+    header_create(pager, config->checksums);
+  }else{
+    header_migrate(pager);
+  }
+  header_load(table, config);
+
+  return table;
+}
+
+InputBuffer * new_input_buffer() {
+  InputBuffer * input_buffer = malloc(sizeof(InputBuffer));
+  input_buffer->buffer = NULL;
+  input_buffer->buffer_length = 0;
+  input_buffer->input_length = 0;
+
+  return input_buffer;
+}
+
+void print_prompt(){ printf("db > ");}
+
+//getline获取输入行，输入结束时返回false
+//here could be hacked 
+bool read_input(InputBuffer* input_buffer){
+  ssize_t bytes_read = 
+    getline(&(input_buffer->buffer), &(input_buffer->buffer_length), stdin);
+  if(bytes_read <= 0){
+    return false;
+  }
+
+  if(input_buffer->buffer[bytes_read - 1] == '\n'){
+    bytes_read--;
+  }
+  input_buffer->input_length = bytes_read;
+  input_buffer->buffer[bytes_read] = 0;
+  return true;
+}
+
+//释放堆空间
+void close_input_buffer(InputBuffer* input_buffer){
+  free(input_buffer->buffer);
+  free(input_buffer);
+}
+
+//脏页已经由checkpoint写回，解除映射并把预分配的尾部截掉
+void pager_mmap_close(Pager* pager){
+  size_t length = (size_t)pager->num_pages * PAGE_SIZE;
+  munmap(pager->map_base, PAGER_MMAP_RESERVE_BYTES);
+  free(pager->map_dirty);
+  pager->map_base = NULL;
+
+  if(ftruncate(pager->file_descriptor, length) == -1){
+    printf("ftruncate error\n");
+    exit(EXIT_FAILURE);
+  }
+  pager->file_length = length;
+}
+
+//做一次checkpoint只写回脏页，然后释放所有帧
+void db_close(Table* table){
+  Pager* pager = table->pager;
+
+  if(pager->io != NULL){
+    pager_readahead_drain(pager);
+    io_close(pager->io);
+  }
+  pager_checkpoint(pager);
+  if(pager->mode == PAGER_MMAP){
+    pager_mmap_close(pager);
+  }
+
+  if(pager->frame_slab != NULL){
+    munmap(pager->frame_slab, pager->frame_slab_bytes);
+  }
+  if(pager->map_latches != NULL){
+    for(uint32_t i = 0; i < PAGER_LATCH_CHUNKS; i++){
+      free(pager->map_latches[i]);
+    }
+    free(pager->map_latches);
+  }
+  wal_close(pager->wal);
+  if(pager->checksum_file_descriptor != -1){
+    close(pager->checksum_file_descriptor);
+  }
+
+  int result = close(pager->file_descriptor);
+  if(result == -1){
+    printf("ERROR CLOSING DB\n");
+    exit(EXIT_FAILURE);
+  }
+  free(pager->frames);
+  free(pager->page_table);
+  free(pager->versions);
+  free(pager);
+  for(uint32_t c = 0; c < INDEX_COLUMNS; c++){
+    free(table->indexes[c]);
+  }
+  free(table);
+}
+
+NodeType get_node_type(void * node){
+  uint8_t value = *((uint8_t *) (node+ NODE_TYPE_OFFSET));
+  return (NodeType)(value & NODE_TYPE_MASK);
+}
+
+uint8_t get_node_layout(void * node){
+  uint8_t value = *((uint8_t *) (node+ NODE_TYPE_OFFSET));
+  return value >> NODE_LAYOUT_SHIFT;
+}
+
+void indent(uint32_t level){
+  for(uint32_t i = 0; i< level; i++){
+    printf("  ");
+  }
+}
+
+uint32_t* leaf_node_keys(void* node){
+  return node + LEAF_NODE_KEYS_OFFSET;
+}
+
+uint32_t* leaf_node_key(void* node, uint32_t cell_num){
+  return leaf_node_keys(node) + cell_num;
+}
+
+//偏移数组跟在key数组后面，位置随cell个数变化
+uint16_t* leaf_node_record_offsets(void* node){
+  return (void*)(leaf_node_keys(node) + *leaf_node_num_cells(node));
+}
+
+void* leaf_node_record(void* node, uint32_t cell_num){
+  return node + leaf_node_record_offsets(node)[cell_num];
+}
+
+uint32_t record_size(const void* record){
+  const uint8_t* lengths = record;
+  return LEAF_NODE_RECORD_HEADER_SIZE + lengths[0] + lengths[1];
+}
+
+//key数组、偏移数组和记录区之间的空闲字节
+uint32_t leaf_node_free_space(void* node){
+  uint32_t slots_end = LEAF_NODE_KEYS_OFFSET + *leaf_node_num_cells(node) * LEAF_NODE_SLOT_SIZE;
+  return *leaf_node_heap_start(node) - slots_end;
+}
+
+//把Row编码成变长记录，返回字节数，id存在key数组里
+uint32_t serialize_row(Row* source, void* destination){
+  uint8_t* lengths = destination;
+  lengths[0] = strlen(source->username);
+  lengths[1] = strlen(source->email);
+  memcpy(destination + LEAF_NODE_RECORD_HEADER_SIZE, source->username, lengths[0]);
+  memcpy(destination + LEAF_NODE_RECORD_HEADER_SIZE + lengths[0], source->email, lengths[1]);
+  return LEAF_NODE_RECORD_HEADER_SIZE + lengths[0] + lengths[1];
+}
+
+void deserialize_row(void* source, Row* destination){
+  const uint8_t* lengths = source;
+  memcpy(destination->username, source + LEAF_NODE_RECORD_HEADER_SIZE, lengths[0]);
+  destination->username[lengths[0]] = '\0';
+  memcpy(destination->email, source + LEAF_NODE_RECORD_HEADER_SIZE + lengths[0], lengths[1]);
+  destination->email[lengths[1]] = '\0';
+}
+
+void leaf_node_row(void* node, uint32_t cell_num, Row* row){
+  row->id = *leaf_node_key(node, cell_num);
+  deserialize_row(leaf_node_record(node, cell_num), row);
+}
+
+//在第index个位置插入一个cell，调用方保证空闲空间够size + LEAF_NODE_SLOT_SIZE
+//偏移数组整体后移：index之后的挪一个slot，之前的挪一个key
+void leaf_node_insert_cell(void* node, uint32_t index, uint32_t key,
+                           const void* record, uint32_t size){
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  uint32_t* keys = leaf_node_keys(node);
+  uint16_t* offsets = leaf_node_record_offsets(node);
+  memmove((void*)offsets + LEAF_NODE_SLOT_SIZE + index * LEAF_NODE_RECORD_OFFSET_SIZE,
+          offsets + index, (num_cells - index) * LEAF_NODE_RECORD_OFFSET_SIZE);
+  memmove((void*)offsets + LEAF_NODE_KEY_SIZE, offsets, index * LEAF_NODE_RECORD_OFFSET_SIZE);
+  memmove(keys + index + 1, keys + index, (num_cells - index) * LEAF_NODE_KEY_SIZE);
+
+  uint16_t heap_start = *leaf_node_heap_start(node) - size;
+  memcpy(node + heap_start, record, size);
+  *leaf_node_heap_start(node) = heap_start;
+  *leaf_node_num_cells(node) = num_cells + 1;
+  keys[index] = key;
+  leaf_node_record_offsets(node)[index] = heap_start;
+}
+
+//把记录按slot顺序重新紧凑地排到页尾，回收空洞
+void leaf_node_compact(void* node){
+  uint8_t snapshot[PAGE_SIZE];
+  memcpy(snapshot, node, PAGE_SIZE);
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  uint16_t* offsets = leaf_node_record_offsets(node);
+  uint32_t heap_start = PAGE_SIZE;
+  for(uint32_t i = 0; i < num_cells; i++){
+    uint32_t size = record_size(snapshot + offsets[i]);
+    heap_start -= size;
+    memcpy(node + heap_start, snapshot + offsets[i], size);
+    offsets[i] = heap_start;
+  }
+  *leaf_node_heap_start(node) = heap_start;
+  *leaf_node_fragmented(node) = 0;
+}
+
+//slot和记录实际占用的字节，不算空闲空间和空洞
+uint32_t leaf_node_used_space(void* node){
+  return LEAF_NODE_SPACE_FOR_CELLS - leaf_node_free_space(node) - *leaf_node_fragmented(node);
+}
+
+//删掉第index个cell：key数组和偏移数组往前挪，记录留下的空洞记到fragmented里，下次放不下时整理
+void leaf_node_delete_cell(void* node, uint32_t index){
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  uint32_t* keys = leaf_node_keys(node);
+  uint16_t* offsets = leaf_node_record_offsets(node);
+  uint32_t size = record_size(node + offsets[index]);
+  //偏移数组紧跟在key数组后面，少了一个key就整体前移一个key的宽度
+  uint16_t* new_offsets = (uint16_t*)(keys + num_cells - 1);
+  memmove(keys + index, keys + index + 1, (num_cells - index - 1) * LEAF_NODE_KEY_SIZE);
+  memmove(new_offsets, offsets, index * LEAF_NODE_RECORD_OFFSET_SIZE);
+  memmove(new_offsets + index, offsets + index + 1,
+          (num_cells - index - 1) * LEAF_NODE_RECORD_OFFSET_SIZE);
+  *leaf_node_num_cells(node) = num_cells - 1;
+  if(num_cells == 1){
+    leaf_node_reset(node);
+  }else{
+    *leaf_node_fragmented(node) += size;
+  }
+}
+
+uint32_t* internal_node_num_keys(void* node){
+  return node + INTERNAL_NODE_NUM_KEYS_OFFSET;
+}
+
+uint32_t* internal_node_right_child(void* node){
+  return node + INTERNAL_NODE_RIGHT_CHILD_OFFSET;
+}
+
+uint32_t* internal_node_keys(void* node){
+  return node + INTERNAL_NODE_KEYS_OFFSET;
+}
+
+//除右孩子以外的孩子页号数组
+uint32_t* internal_node_children(void* node){
+  return node + INTERNAL_NODE_CHILDREN_OFFSET;
+}
+
+uint32_t* internal_node_child(void * node , uint32_t child_num){
+  uint32_t num_keys = *internal_node_num_keys(node);
+  if(child_num > num_keys){
+    printf("最多%d个孩子", num_keys);
+    exit(EXIT_FAILURE);
+  } else if(child_num == num_keys){
+    return internal_node_right_child(node);
+  } else {
+    return internal_node_children(node) + child_num;
+  }
+}
+
+uint32_t* internal_node_key(void* node, uint32_t key_num){
+  return internal_node_keys(node) + key_num;
+}
+
+//按孩子下标的行数数组，比孩子数组多一格给右孩子
+uint32_t* internal_node_counts(void* node){
+  return node + INTERNAL_NODE_COUNTS_OFFSET;
+}
+
+uint32_t* internal_node_count(void* node, uint32_t child_num){
+  return internal_node_counts(node) + child_num;
+}
+
+//版本1的中间节点的第child_num个孩子，只在打开旧文件重建中间层时用
+uint32_t uncounted_internal_node_child(void* node, uint32_t child_num){
+  uint32_t num_keys = *internal_node_num_keys(node);
+  if(child_num == num_keys){
+    return *internal_node_right_child(node);
+  }
+  uint32_t* children = node + INTERNAL_NODE_HEADER_SIZE +
+                       INTERNAL_NODE_UNCOUNTED_MAX_CELLS * INTERNAL_NODE_KEY_SIZE;
+  return children[child_num];
+}
+
+//按keys/children/counts写一个中间节点，children和counts比keys多一个，最后一个是右孩子的
+void internal_node_fill(void* node, uint32_t* keys, uint32_t* children, uint32_t* counts, uint32_t num_keys){
+  *internal_node_num_keys(node) = num_keys;
+  memcpy(internal_node_keys(node), keys, num_keys * INTERNAL_NODE_KEY_SIZE);
+  memcpy(internal_node_children(node), children, num_keys * INTERNAL_NODE_CHILD_SIZE);
+  *internal_node_right_child(node) = children[num_keys];
+  memcpy(internal_node_counts(node), counts, (num_keys + 1) * INTERNAL_NODE_COUNT_SIZE);
+}
+
+//节点下面的行数：叶子数cell，中间节点把各个孩子的行数加起来
+uint32_t node_row_count(void* node){
+  if(get_node_type(node) == NODE_LEAF){
+    return *leaf_node_num_cells(node);
+  }
+  uint32_t num_keys = *internal_node_num_keys(node);
+  uint32_t count = 0;
+  for(uint32_t i = 0; i <= num_keys; i++){
+    count += *internal_node_count(node, i);
+  }
+  return count;
+}
+
+//版本0（key,row交错）和版本1（key数组加页尾定长行）的叶子重写成slotted page
+void upgrade_leaf_layout(void* node){
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  if(num_cells > LEGACY_LEAF_NODE_MAX_CELLS){
+    printf("corrupt leaf node with %d cells\n", num_cells);
+    exit(EXIT_FAILURE);
+  }
+  uint8_t snapshot[PAGE_SIZE];
+  memcpy(snapshot, node, PAGE_SIZE);
+  uint8_t layout = get_node_layout(node);
+  leaf_node_reset(node);
+
+  uint8_t record[LEAF_NODE_MAX_RECORD_SIZE];
+  Row row;
+  for(uint32_t i = 0; i < num_cells; i++){
+    uint8_t* cell;
+    uint32_t key;
+    if(layout == 0){
+      cell = snapshot + LEGACY_LEAF_NODE_HEADER_SIZE + i * LEGACY_LEAF_NODE_CELL_SIZE;
+      memcpy(&key, cell, sizeof(uint32_t));
+      cell += sizeof(uint32_t);
+    }else{
+      memcpy(&key, snapshot + LEGACY_LEAF_NODE_HEADER_SIZE + i * sizeof(uint32_t), sizeof(uint32_t));
+      cell = snapshot + PAGE_SIZE - (i + 1) * ROW_SIZE;
+    }
+    memcpy(row.username, cell + USERNAME_OFFSET, USERNAME_SIZE);
+    memcpy(row.email, cell + EMAIL_OFFSET, EMAIL_SIZE);
+    row.username[COLUMN_USERNAME_SIZE] = '\0';
+    row.email[COLUMN_EMAIL_SIZE] = '\0';
+    uint32_t size = serialize_row(&row, record);
+    leaf_node_insert_cell(node, i, key, record, size);
+  }
+}
+
+//类型字节里的格式版本已经是当前的
+bool node_layout_current(uint8_t type){
+  uint8_t layout = type >> NODE_LAYOUT_SHIFT;
+  if((type & NODE_TYPE_MASK) == NODE_LEAF){
+    return layout == LEAF_NODE_LAYOUT;
+  }
+  //目录页、空闲页和文件头没有旧格式
+  if((type & NODE_TYPE_MASK) == NODE_CATALOG || (type & NODE_TYPE_MASK) == NODE_FREE ||
+     (type & NODE_TYPE_MASK) == NODE_HEADER){
+    return true;
+  }
+  //版本1缺的行数要看孩子才知道，读页时补不了，留给打开时的重建
+  return layout == INTERNAL_NODE_LAYOUT || layout == INTERNAL_NODE_UNCOUNTED_LAYOUT;
+}
+
+//把版本0的中间节点（child,key交错）改成版本1的key数组加孩子数组
+void upgrade_internal_layout(void* node){
+  uint32_t num_keys = *internal_node_num_keys(node);
+  if(num_keys > INTERNAL_NODE_UNCOUNTED_MAX_CELLS){
+    printf("corrupt internal node with %d keys\n", num_keys);
+    exit(EXIT_FAILURE);
+  }
+  uint32_t keys[INTERNAL_NODE_UNCOUNTED_MAX_CELLS];
+  uint32_t children[INTERNAL_NODE_UNCOUNTED_MAX_CELLS];
+  uint32_t* cells = node + INTERNAL_NODE_HEADER_SIZE;
+  for(uint32_t i = 0; i < num_keys; i++){
+    children[i] = cells[2 * i];
+    keys[i] = cells[2 * i + 1];
+  }
+  memcpy(node + INTERNAL_NODE_HEADER_SIZE, keys, num_keys * INTERNAL_NODE_KEY_SIZE);
+  memcpy(node + INTERNAL_NODE_HEADER_SIZE + INTERNAL_NODE_UNCOUNTED_MAX_CELLS * INTERNAL_NODE_KEY_SIZE,
+         children, num_keys * INTERNAL_NODE_CHILD_SIZE);
+  *(uint8_t*)node = NODE_INTERNAL | INTERNAL_NODE_UNCOUNTED_LAYOUT << NODE_LAYOUT_SHIFT;
+}
+
+//旧格式的节点改成当前格式，返回true表示页被改写
+//mmap模式下别的线程可能正无锁地看类型字节：先在副本上升级，
+//拷回时类型字节最后写，别的线程看到新版本号时整页已经是新格式
+bool upgrade_node_layout(void* node){
+  if(node_layout_current(*(uint8_t*)node)){
+    return false;
+  }
+  uint8_t scratch[PAGE_SIZE];
+  memcpy(scratch, node, PAGE_SIZE);
+  if(get_node_type(scratch) == NODE_LEAF){
+    upgrade_leaf_layout(scratch);
+  }else{
+    upgrade_internal_layout(scratch);
+  }
+  memcpy(node + 1, scratch + 1, PAGE_SIZE - 1);
+  __atomic_store_n((uint8_t*)node, scratch[0], __ATOMIC_RELEASE);
+  return true;
+}
+//
+void print_tree(Pager* pager, uint32_t page_num, uint32_t indentation_level){
+  void * node = get_page(pager, page_num);
+  uint32_t num_keys, child;
+
+  switch(get_node_type(node)){
+    case(NODE_LEAF):
+      num_keys = *leaf_node_num_cells(node);
+      indent(indentation_level);
+      printf("- leaf (size %d)\n", num_keys);
+      for (uint32_t i = 0; i < num_keys; i++) {
+        indent(indentation_level+1);
+        printf("- %d\n", *leaf_node_key(node, i));
+      }
+      break;
+    case(NODE_INTERNAL):
+      num_keys = *internal_node_num_keys(node);
+      indent(indentation_level);
+      printf("- internal (size %d)\n", num_keys);
+      for(uint32_t i = 0; i < num_keys ; i++){
+        child = *internal_node_child(node, i);
+        print_tree(pager, child, indentation_level+1);
+
+        indent(indentation_level+1);
+        printf(" - key %d\n", *internal_node_key(node, i));
+      }
+      child = *internal_node_right_child(node);
+      print_tree(pager, child, indentation_level+1);
+      break;
+    case(NODE_CATALOG):
+    case(NODE_FREE):
+    case(NODE_HEADER):
+      break;
+  }
+  pager_unpin(pager, page_num);
+}
+
+void print_constants(){
+  printf("ROW_SIZE: %d\n", ROW_SIZE);
+  printf("COMMON_NODE_HEAGER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
+  printf("LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
+  printf("LEAF_NODE_SLOT_SIZE: %d\n", LEAF_NODE_SLOT_SIZE);
+  printf("LEAF_NODE_MAX_RECORD_SIZE: %d\n", LEAF_NODE_MAX_RECORD_SIZE);
+  printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
+  printf("LEAF_NODE_MAX_CELLS: %d\n", LEAF_NODE_MAX_CELLS);
+  printf("INTERNAL_NODE_MAX_CELLS: %d\n", INTERNAL_NODE_MAX_CELLS);
+}
+
+void bulk_load(Table* table, const char* filename, uint32_t fill_percent);
+void db_backup(Table* table, const char* filename);
+
+void print_header(Pager* pager){
+  void* header = get_page(pager, HEADER_PAGE_NUM);
+  printf("version: %d\n", *header_version(header));
+  printf("page size: %d\n", *header_page_size(header));
+  printf("pages: %d\n", pager->num_pages);
+  printf("rows: %llu\n", (unsigned long long)pager->row_count);
+  printf("free list head: %d\n", *header_free_head(header));
+  printf("checksums: %s\n", *header_flags(header) & HEADER_FLAG_CHECKSUMS ? "on" : "off");
+  for(uint32_t tree = 0; tree < HEADER_TREES; tree++){
+    uint32_t root_page_num = *header_tree_root(header, tree);
+    if(root_page_num == 0){
+      continue;
+    }
+    if(tree == HEADER_TREE_PRIMARY){
+      printf("primary");
+    }else{
+      printf("index %s", tree - HEADER_TREE_PRIMARY - 1 == INDEX_USERNAME ? "username" : "email");
+    }
+    printf(": root %d, height %d\n", root_page_num, *header_tree_height(header, tree));
+  }
+  pager_unpin(pager, HEADER_PAGE_NUM);
+}
+
+const char* STAT_NAMES[STAT_COUNTERS] = {
+  "cache_hits", "cache_misses", "evictions", "readahead_pages", "leaf_splits",
+  "internal_splits", "merges", "wal_bytes", "wal_syncs", "page_versions",
+};
+const char* LATENCY_NAMES[LATENCY_KINDS] = {
+  "insert", "insert_batch", "select", "create_index", "delete", "commit",
+};
+#define LATENCY_PERCENTILES 4
+const double LATENCY_PERCENTILE_VALUES[LATENCY_PERCENTILES] = {0.5, 0.9, 0.99, 0.999};
+const char* LATENCY_PERCENTILE_NAMES[LATENCY_PERCENTILES] = {"p50", "p90", "p99", "p999"};
+
+typedef struct {
+  uint64_t leaves;
+  uint64_t internal_nodes;
+  uint64_t leaf_bytes;
+  uint64_t internal_keys;
+} TreeStats;
+
+//整棵树走一遍，数节点和用掉的空间，树大时要把整棵树读一遍，只给.stats用
+//和读线程一样从上往下加共享latch
+void tree_stats_walk(Pager* pager, uint32_t page_num, TreeStats* stats){
+  void* node = pager_acquire(pager, page_num, LATCH_SHARED);
+  if(get_node_type(node) == NODE_LEAF){
+    stats->leaves++;
+    stats->leaf_bytes += leaf_node_used_space(node);
+  }else{
+    uint32_t num_keys = *internal_node_num_keys(node);
+    stats->internal_nodes++;
+    stats->internal_keys += num_keys;
+    for(uint32_t i = 0; i <= num_keys; i++){
+      tree_stats_walk(pager, *internal_node_child(node, i), stats);
+    }
+  }
+  pager_release(pager, page_num);
+}
+
+double fill_fraction(uint64_t used, uint64_t nodes, uint32_t capacity){
+  return nodes == 0 ? 0 : (double)used / ((double)nodes * capacity);
+}
+
+//第一个累计个数够percentile的桶的上界，单位微秒
+double latency_percentile_us(uint64_t* buckets, uint64_t count, double percentile){
+  uint64_t target = (uint64_t)(percentile * count);
+  if(target == 0){
+    target = 1;
+  }
+  uint64_t seen = 0;
+  for(uint32_t i = 0; i < LATENCY_BUCKETS; i++){
+    seen += buckets[i];
+    if(seen >= target){
+      return latency_bucket_max(i) / 1000.0;
+    }
+  }
+  return latency_bucket_max(LATENCY_BUCKETS - 1) / 1000.0;
+}
+
+double latency_max_us(uint64_t* buckets){
+  for(uint32_t i = LATENCY_BUCKETS; i > 0; i--){
+    if(buckets[i - 1] > 0){
+      return latency_bucket_max(i - 1) / 1000.0;
+    }
+  }
+  return 0;
+}
+
+//.stats打表给人看，.stats json输出一行json给脚本收集
+//计数器从进程启动开始累计，填充率每次现走一遍树
+void print_stats(Table* table, bool json){
+  Pager* pager = table->pager;
+  StatsBlock* total = malloc(sizeof(StatsBlock));
+  stats_collect(total);
+  uint64_t* counters = total->counters;
+  uint64_t pages_read = __atomic_load_n(&pager->pages_read, __ATOMIC_RELAXED);
+  uint64_t pages_written = __atomic_load_n(&pager->pages_written, __ATOMIC_RELAXED);
+  uint64_t lookups = counters[STAT_CACHE_HITS] + counters[STAT_CACHE_MISSES];
+  double hit_rate = lookups == 0 ? 0 : (double)counters[STAT_CACHE_HITS] / lookups;
+
+  if(json){
+    printf("{\"mode\": \"%s\", \"cache_pages\": %d, \"pages\": %d, \"rows\": %llu",
+           pager->mode == PAGER_MMAP ? "mmap" : "buffered", pager->num_frames,
+           pager->num_pages, (unsigned long long)pager->row_count);
+    for(uint32_t i = 0; i < STAT_COUNTERS; i++){
+      printf(", \"%s\": %llu", STAT_NAMES[i], (unsigned long long)counters[i]);
+    }
+    printf(", \"hit_rate\": %.4f, \"pages_read\": %llu, \"bytes_read\": %llu"
+           ", \"pages_written\": %llu, \"bytes_written\": %llu, \"trees\": [",
+           hit_rate, (unsigned long long)pages_read, (unsigned long long)pages_read * PAGE_SIZE,
+           (unsigned long long)pages_written, (unsigned long long)pages_written * PAGE_SIZE);
+  }else{
+    if(pager->mode == PAGER_MMAP){
+      printf("cache: mmap\n");
+    }else{
+      printf("cache: %d frames, %llu hits, %llu misses, hit rate %.1f%%\n", pager->num_frames,
+             (unsigned long long)counters[STAT_CACHE_HITS],
+             (unsigned long long)counters[STAT_CACHE_MISSES], hit_rate * 100);
+      printf("evictions: %llu, readahead pages: %llu\n",
+             (unsigned long long)counters[STAT_EVICTIONS],
+             (unsigned long long)counters[STAT_READAHEAD_PAGES]);
+    }
+    printf("pages read: %llu (%llu bytes), pages written: %llu (%llu bytes)\n",
+           (unsigned long long)pages_read, (unsigned long long)pages_read * PAGE_SIZE,
+           (unsigned long long)pages_written, (unsigned long long)pages_written * PAGE_SIZE);
+    printf("wal: %llu bytes, %llu syncs\n", (unsigned long long)counters[STAT_WAL_BYTES],
+           (unsigned long long)counters[STAT_WAL_SYNCS]);
+    printf("splits: %llu leaf, %llu internal, merges: %llu\n",
+           (unsigned long long)counters[STAT_LEAF_SPLITS],
+           (unsigned long long)counters[STAT_INTERNAL_SPLITS],
+           (unsigned long long)counters[STAT_MERGES]);
+    printf("snapshots: %d open, %llu page versions kept, %llu made\n",
+           __atomic_load_n(&pager->num_snapshots, __ATOMIC_RELAXED),
+           (unsigned long long)__atomic_load_n(&pager->num_versions, __ATOMIC_RELAXED),
+           (unsigned long long)counters[STAT_PAGE_VERSIONS]);
+  }
+
+  void* header = get_page(pager, HEADER_PAGE_NUM);
+  bool first = true;
+  for(uint32_t tree = 0; tree < HEADER_TREES; tree++){
+    uint32_t root_page_num = *header_tree_root(header, tree);
+    if(root_page_num == 0){
+      continue;
+    }
+    uint32_t height = *header_tree_height(header, tree);
+    const char* name = tree == HEADER_TREE_PRIMARY ? "primary" :
+                       tree - HEADER_TREE_PRIMARY - 1 == INDEX_USERNAME ? "username" : "email";
+    TreeStats stats = {0};
+    tree_stats_walk(pager, root_page_num, &stats);
+    double leaf_fill = fill_fraction(stats.leaf_bytes, stats.leaves, LEAF_NODE_SPACE_FOR_CELLS);
+    double internal_fill = fill_fraction(stats.internal_keys, stats.internal_nodes, INTERNAL_NODE_MAX_CELLS);
+    if(json){
+      printf("%s{\"name\": \"%s\", \"height\": %d, \"leaves\": %llu, \"leaf_fill\": %.4f"
+             ", \"internal_nodes\": %llu, \"internal_fill\": %.4f}",
+             first ? "" : ", ", name, height, (unsigned long long)stats.leaves, leaf_fill,
+             (unsigned long long)stats.internal_nodes, internal_fill);
+    }else{
+      printf("%s: height %d, %llu leaves %.1f%% full, %llu internal nodes %.1f%% full\n",
+             name, height, (unsigned long long)stats.leaves, leaf_fill * 100,
+             (unsigned long long)stats.internal_nodes, internal_fill * 100);
+    }
+    first = false;
+  }
+  pager_unpin(pager, HEADER_PAGE_NUM);
+
+  if(json){
+    printf("], \"latency_us\": {");
+  }else{
+    printf("latency (us)     count       mean        p50        p90        p99      p99.9        max\n");
+  }
+  first = true;
+  for(uint32_t kind = 0; kind < LATENCY_KINDS; kind++){
+    uint64_t* buckets = total->latency[kind];
+    uint64_t count = 0;
+    for(uint32_t i = 0; i < LATENCY_BUCKETS; i++){
+      count += buckets[i];
+    }
+    if(count == 0){
+      continue;
+    }
+    double mean = total->latency_total_ns[kind] / 1000.0 / count;
+    if(json){
+      printf("%s\"%s\": {\"count\": %llu, \"mean\": %.2f", first ? "" : ", ",
+             LATENCY_NAMES[kind], (unsigned long long)count, mean);
+      for(uint32_t p = 0; p < LATENCY_PERCENTILES; p++){
+        printf(", \"%s\": %.2f", LATENCY_PERCENTILE_NAMES[p],
+               latency_percentile_us(buckets, count, LATENCY_PERCENTILE_VALUES[p]));
+      }
+      printf(", \"max\": %.2f}", latency_max_us(buckets));
+    }else{
+      printf("%-12s %9llu %10.2f", LATENCY_NAMES[kind], (unsigned long long)count, mean);
+      for(uint32_t p = 0; p < LATENCY_PERCENTILES; p++){
+        printf(" %10.2f", latency_percentile_us(buckets, count, LATENCY_PERCENTILE_VALUES[p]));
+      }
+      printf(" %10.2f\n", latency_max_us(buckets));
+    }
+    first = false;
+  }
+  if(json){
+    printf("}}\n");
+  }
+  free(total);
+}
+
+MetaCommandResult do_meta_command(InputBuffer * input_buffer, Table * table){
+  if(strcmp(input_buffer->buffer, ".exit") == 0){
+    close_input_buffer(input_buffer);
+    db_close(table);
+    exit(EXIT_SUCCESS);
+  }else if(strcmp(input_buffer->buffer, ".btree") == 0){
+    printf("tree:\n");
+    print_tree(table->pager, table->root_page_num, 0);
+    return META_COMMAND_SUCCESS;
+  }else if(strcmp(input_buffer->buffer, ".header") == 0){
+    print_header(table->pager);
+    return META_COMMAND_SUCCESS;
+  }else if(strcmp(input_buffer->buffer, ".stats") == 0){
+    print_stats(table, false);
+    return META_COMMAND_SUCCESS;
+  }else if(strcmp(input_buffer->buffer, ".stats json") == 0){
+    print_stats(table, true);
+    return META_COMMAND_SUCCESS;
+  }else if(strcmp(input_buffer->buffer, ".constants") == 0){
+    printf("Constants:\n");
+    print_constants();
+    return META_COMMAND_SUCCESS;
+  }else if(strncmp(input_buffer->buffer, ".load ", 6) == 0){
+    strtok(input_buffer->buffer, " ");
+    char * filename = strtok(NULL, " ");
+    char * fill_string = strtok(NULL, " ");
+    uint32_t fill_percent = fill_string == NULL ? LOAD_DEFAULT_FILL_PERCENT : atoi(fill_string);
+    if(filename == NULL || fill_percent == 0 || fill_percent > 100){
+      fprintf(table_diagnostics(table), "usage: .load <file> [fill percent]\n");
+      return META_COMMAND_SUCCESS;
+    }
+    pthread_mutex_lock(&table->pager->write_lock);
+    bulk_load(table, filename, fill_percent);
+    pthread_mutex_unlock(&table->pager->write_lock);
+    return META_COMMAND_SUCCESS;
+  }else if(strncmp(input_buffer->buffer, ".backup ", 8) == 0){
+    strtok(input_buffer->buffer, " ");
+    char * filename = strtok(NULL, " ");
+    if(filename == NULL){
+      fprintf(table_diagnostics(table), "usage: .backup <file>\n");
+      return META_COMMAND_SUCCESS;
+    }
+    db_backup(table, filename);
+    return META_COMMAND_SUCCESS;
+  }else {
+    return META_COMMAND_UNRECOGNIZED_COMMAND;
+  }
+}
+
+//按空格和separator切词，最多切max个，还有剩余时返回max+1
+uint32_t tokenize(const char * p, const char * end, char separator, Token * tokens, uint32_t max){
+  uint32_t count = 0;
+  while(true){
+    while(p < end && (*p == ' ' || *p == separator)){
+      p++;
+    }
+    if(p == end){
+      return count;
+    }
+    if(count == max){
+      return max + 1;
+    }
+    const char * start = p;
+    while(p < end && *p != ' ' && *p != separator){
+      p++;
+    }
+    tokens[count].start = start;
+    tokens[count].length = p - start;
+    count++;
+  }
+}
+
+bool token_equals(Token token, const char * word){
+  uint32_t length = strlen(word);
+  return token.length == length && memcmp(token.start, word, length) == 0;
+}
+
+bool token_uint32(Token token, uint32_t * value){
+  if(token.length == 0 || token.length > 10){
+    return false;
+  }
+  uint64_t result = 0;
+  for(uint32_t i = 0; i < token.length; i++){
+    char c = token.start[i];
+    if(c < '0' || c > '9'){
+      return false;
+    }
+    result = result * 10 + (c - '0');
+  }
+  if(result > UINT32_MAX){
+    return false;
+  }
+  *value = result;
+  return true;
+}
+
+//校验三个字段并填到row里，insert语句和.load共用
+PrepareResult prepare_row_tokens(Token id, Token username, Token email, Row* row){
+  if(id.length > 0 && id.start[0] == '-'){
+    return PREPARE_NEGATIVE_ID;
+  }
+  if(!token_uint32(id, &row->id)){
+    return PREPARE_SYNTAX_ERROR;
+  }
+  if(username.length > COLUMN_USERNAME_SIZE || email.length > COLUMN_EMAIL_SIZE){
+    return PREPARE_STRING_TOO_LONG;
+  }
+
+  memcpy(row->username, username.start, username.length);
+  row->username[username.length] = '\0';
+  memcpy(row->email, email.start, email.length);
+  row->email[email.length] = '\0';
+  return PREPARE_SUCCESS;
+}
+
+PrepareResult prepare_row(char * id_string, char * username, char * email, Row* row){
+  if(id_string == NULL || username == NULL || email == NULL){
+    return PREPARE_SYNTAX_ERROR;
+  }
+  Token id = {id_string, strlen(id_string)};
+  Token name = {username, strlen(username)};
+  Token mail = {email, strlen(email)};
+  return prepare_row_tokens(id, name, mail, row);
+}
+
+//insert values (id, username, email), (...), ...
+//每个括号里按逗号和空格切出三个字段，交给prepare_row_tokens校验
+//rows分配在线程的arena里，执行完这条语句就回收
+PrepareResult prepare_insert_values(const char * p, const char * end, Statement* statement){
+  statement->type = STATEMENT_INSERT_BATCH;
+  uint32_t capacity = 16;
+  statement->rows = arena_alloc(&thread_arena, sizeof(Row) * capacity);
+  statement->num_rows = 0;
+
+  PrepareResult result = PREPARE_SUCCESS;
+  while(result == PREPARE_SUCCESS){
+    while(p < end && *p == ' '){
+      p++;
+    }
+    const char * close = p < end ? memchr(p, ')', end - p) : NULL;
+    if(p == end || *p != '(' || close == NULL){
+      result = PREPARE_SYNTAX_ERROR;
+      break;
+    }
+
+    if(statement->num_rows == capacity){
+      statement->rows = arena_grow(&thread_arena, statement->rows, sizeof(Row) * capacity, sizeof(Row) * capacity * 2);
+      capacity *= 2;
+    }
+    Token fields[3];
+    if(tokenize(p + 1, close, ',', fields, 3) != 3){
+      result = PREPARE_SYNTAX_ERROR;
+      break;
+    }
+    result = prepare_row_tokens(fields[0], fields[1], fields[2],
+                                &statement->rows[statement->num_rows]);
+    if(result != PREPARE_SUCCESS){
+      break;
+    }
+    statement->num_rows++;
+
+    p = close + 1;
+    while(p < end && *p == ' '){
+      p++;
+    }
+    if(p == end){
+      break;
+    }
+    if(*p != ','){
+      result = PREPARE_SYNTAX_ERROR;
+    }
+    p++;
+  }
+
+  if(result != PREPARE_SUCCESS){
+    statement->rows = NULL;
+    statement->num_rows = 0;
+  }
+  return result;
+}
+
+//insert id username email
+PrepareResult prepare_insert(Token * tokens, uint32_t count, Statement* statement){
+  statement->type = STATEMENT_INSERT;
+  if(count != 4){
+    return PREPARE_SYNTAX_ERROR;
+  }
+  return prepare_row_tokens(tokens[1], tokens[2], tokens[3], &statement->row_to_insert);
+}
+
+//select [aggregates] [where id =|<|<=|>|>= n | where id between a and b | where username|email = x] [limit n] [offset n]
+//谓词都换成id的闭区间，执行时从下界seek然后沿着叶子链扫到上界
+//count(*)，或者min/max/sum/avg套在id、len(username)、len(email)上
+bool parse_aggregate(Token token, Aggregate* aggregate){
+  const char* open = memchr(token.start, '(', token.length);
+  if(open == NULL || token.start[token.length - 1] != ')'){
+    return false;
+  }
+  Token name = {token.start, open - token.start};
+  Token argument = {open + 1, token.start + token.length - 1 - (open + 1)};
+
+  static const char* names[] = {"count", "min", "max", "sum", "avg"};
+  uint32_t function = 0;
+  while(function < sizeof(names) / sizeof(names[0]) && !token_equals(name, names[function])){
+    function++;
+  }
+  if(function == sizeof(names) / sizeof(names[0])){
+    return false;
+  }
+  aggregate->function = function;
+  aggregate->column = AGGREGATE_ID;
+  if(function == AGGREGATE_COUNT){
+    return token_equals(argument, "*");
+  }
+  if(token_equals(argument, "id")){
+    return true;
+  }
+  if(token_equals(argument, "len(username)")){
+    aggregate->column = AGGREGATE_USERNAME_LENGTH;
+    return true;
+  }
+  if(token_equals(argument, "len(email)")){
+    aggregate->column = AGGREGATE_EMAIL_LENGTH;
+    return true;
+  }
+  return false;
+}
+
+bool parse_index_column(Token token, IndexColumn* column){
+  if(token_equals(token, "username")){
+    *column = INDEX_USERNAME;
+    return true;
+  }
+  if(token_equals(token, "email")){
+    *column = INDEX_EMAIL;
+    return true;
+  }
+  return false;
+}
+
+uint32_t index_column_size(IndexColumn column){
+  return column == INDEX_USERNAME ? COLUMN_USERNAME_SIZE : COLUMN_EMAIL_SIZE;
+}
+
+//where id ...或者where username|email = x，select和delete共用
+//username|email只支持等值，值是一个词
+//*index指向where，没有where时什么都不做
+PrepareResult prepare_where(Token * tokens, uint32_t count, uint32_t* index, Statement* statement){
+  uint32_t i = *index;
+  statement->id_min = 0;
+  statement->id_max = UINT32_MAX;
+  statement->filter.active = false;
+  if(i + 4 <= count && token_equals(tokens[i], "where") &&
+     parse_index_column(tokens[i + 1], &statement->filter.column)){
+    if(!token_equals(tokens[i + 2], "=")){
+      return PREPARE_SYNTAX_ERROR;
+    }
+    if(tokens[i + 3].length > index_column_size(statement->filter.column)){
+      return PREPARE_STRING_TOO_LONG;
+    }
+    statement->filter.active = true;
+    statement->filter.value = tokens[i + 3];
+    i += 4;
+  }else if(i < count && token_equals(tokens[i], "where")){
+    uint32_t value;
+    if(i + 4 > count){
+      return PREPARE_SYNTAX_ERROR;
+    }
+    if(!token_equals(tokens[i + 1], "id") || !token_uint32(tokens[i + 3], &value)){
+      return PREPARE_SYNTAX_ERROR;
+    }
+    Token op = tokens[i + 2];
+    i += 4;
+
+    if(token_equals(op, "=")){
+      statement->id_min = value;
+      statement->id_max = value;
+    }else if(token_equals(op, "<")){
+      if(value == 0){
+        statement->id_min = 1;
+        statement->id_max = 0;
+      }else{
+        statement->id_max = value - 1;
+      }
+    }else if(token_equals(op, "<=")){
+      statement->id_max = value;
+    }else if(token_equals(op, ">")){
+      if(value == UINT32_MAX){
+        statement->id_min = 1;
+        statement->id_max = 0;
+      }else{
+        statement->id_min = value + 1;
+      }
+    }else if(token_equals(op, ">=")){
+      statement->id_min = value;
+    }else if(token_equals(op, "between")){
+      if(i + 2 > count || !token_equals(tokens[i], "and") ||
+         !token_uint32(tokens[i + 1], &statement->id_max)){
+        return PREPARE_SYNTAX_ERROR;
+      }
+      statement->id_min = value;
+      i += 2;
+    }else{
+      return PREPARE_SYNTAX_ERROR;
+    }
+  }
+  *index = i;
+  return PREPARE_SUCCESS;
+}
+
+//tokens按空格切；逗号只用来分隔聚合，只把where/limit/offset前面那一段按逗号重新切
+//where后面的值和delete一样按空格切，值里可以有逗号
+PrepareResult prepare_select(Token * tokens, uint32_t count, Statement* statement){
+  statement->type = STATEMENT_SELECT;
+  statement->limit = UINT32_MAX;
+  statement->offset = 0;
+  statement->num_aggregates = 0;
+
+  uint32_t i = 1;
+  while(i < count && !token_equals(tokens[i], "where") && !token_equals(tokens[i], "limit") &&
+        !token_equals(tokens[i], "offset")){
+    i++;
+  }
+  if(i > 1){
+    Token aggregates[STATEMENT_MAX_AGGREGATES];
+    uint32_t num_aggregates = tokenize(tokens[1].start, tokens[i - 1].start + tokens[i - 1].length, ',',
+                                       aggregates, STATEMENT_MAX_AGGREGATES);
+    if(num_aggregates > STATEMENT_MAX_AGGREGATES){
+      return PREPARE_SYNTAX_ERROR;
+    }
+    for(uint32_t a = 0; a < num_aggregates; a++){
+      if(!parse_aggregate(aggregates[a], &statement->aggregates[a])){
+        return PREPARE_SYNTAX_ERROR;
+      }
+    }
+    statement->num_aggregates = num_aggregates;
+  }
+  PrepareResult result = prepare_where(tokens, count, &i, statement);
+  if(result != PREPARE_SUCCESS){
+    return result;
+  }
+
+  if(i < count && token_equals(tokens[i], "limit")){
+    if(i + 2 > count || !token_uint32(tokens[i + 1], &statement->limit)){
+      return PREPARE_SYNTAX_ERROR;
+    }
+    i += 2;
+  }
+  if(i < count && token_equals(tokens[i], "offset")){
+    if(i + 2 > count || !token_uint32(tokens[i + 1], &statement->offset)){
+      return PREPARE_SYNTAX_ERROR;
+    }
+    i += 2;
+  }
+
+  if(i != count){
+    return PREPARE_SYNTAX_ERROR;
+  }
+  return PREPARE_SUCCESS;
+}
+
+//直接在输入的字节上解析一条语句，不复制也不改写输入
+PrepareResult parse_statement(const char * line, uint32_t length, Statement* statement){
+  statement->rows = NULL;
+  statement->num_rows = 0;
+
+  const char * end = line + length;
+  Token tokens[STATEMENT_MAX_TOKENS];
+  uint32_t count = tokenize(line, end, ' ', tokens, STATEMENT_MAX_TOKENS);
+  if(count == 0){
+    return PREPARE_UNRECOGNIZE_STATEMENT;
+  }
+
+  if(token_equals(tokens[0], "insert")){
+    if(count >= 2 && token_equals(tokens[1], "values")){
+      return prepare_insert_values(tokens[1].start + tokens[1].length, end, statement);
+    }
+    return prepare_insert(tokens, count > STATEMENT_MAX_TOKENS ? 0 : count, statement);
+  }
+  if(token_equals(tokens[0], "create")){
+    //create index on username|email
+    statement->type = STATEMENT_CREATE_INDEX;
+    if(count != 4 || !token_equals(tokens[1], "index") || !token_equals(tokens[2], "on") ||
+       !parse_index_column(tokens[3], &statement->index_column)){
+      return PREPARE_SYNTAX_ERROR;
+    }
+    return PREPARE_SUCCESS;
+  }
+  if(token_equals(tokens[0], "delete")){
+    //delete [where ...]，不带where删掉所有行
+    statement->type = STATEMENT_DELETE;
+    if(count > STATEMENT_MAX_TOKENS){
+      return PREPARE_SYNTAX_ERROR;
+    }
+    uint32_t i = 1;
+    PrepareResult result = prepare_where(tokens, count, &i, statement);
+    if(result != PREPARE_SUCCESS){
+      return result;
+    }
+    return i == count ? PREPARE_SUCCESS : PREPARE_SYNTAX_ERROR;
+  }
+  if(token_equals(tokens[0], "select")){
+    if(count > STATEMENT_MAX_TOKENS){
+      return PREPARE_SYNTAX_ERROR;
+    }
+    return prepare_select(tokens, count, statement);
+  }
+
+  return PREPARE_UNRECOGNIZE_STATEMENT;
+}
+
+PrepareResult prepare_statement(InputBuffer * input_buffer, Statement* statement){
+  return parse_statement(input_buffer->buffer, input_buffer->input_length, statement);
+}
+
+//在升序key数组里找第一个>=key的位置
+uint32_t key_search_scalar(const uint32_t* keys, uint32_t num_keys, uint32_t key){
+  uint32_t min_index = 0;
+  uint32_t max_index = num_keys;
+
+  while(min_index != max_index){
+    uint32_t index = (min_index + max_index )/2;
+    if(keys[index] >= key){
+      max_index = index;
+    }else{
+      min_index = index + 1;
+    }
+  }
+
+  return min_index;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+//SIMD版本先二分到不超过NODE_SEARCH_LINEAR_WINDOW个key，再数窗口里比key小的个数
+//结果是窗口[*min_index, *max_index)，第一个>=key的位置一定在里面或者就是*max_index
+void key_search_window(const uint32_t* keys, uint32_t num_keys, uint32_t key,
+                       uint32_t* min_index, uint32_t* max_index){
+  uint32_t low = 0;
+  uint32_t high = num_keys;
+  while(high - low > NODE_SEARCH_LINEAR_WINDOW){
+    uint32_t index = (low + high)/2;
+    if(keys[index] >= key){
+      high = index;
+    }else{
+      low = index + 1;
+    }
+  }
+  *min_index = low;
+  *max_index = high;
+}
+
+//没有无符号32位比较，两边都翻转符号位后用有符号比较
+__attribute__((target("avx2")))
+uint32_t key_search_avx2(const uint32_t* keys, uint32_t num_keys, uint32_t key){
+  uint32_t min_index;
+  uint32_t max_index;
+  key_search_window(keys, num_keys, key, &min_index, &max_index);
+
+  __m256i sign = _mm256_set1_epi32((int)0x80000000);
+  __m256i target = _mm256_xor_si256(_mm256_set1_epi32((int)key), sign);
+  uint32_t count = min_index;
+  uint32_t i = min_index;
+  for(; i + 8 <= max_index; i += 8){
+    __m256i block = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(keys + i)), sign);
+    __m256i less = _mm256_cmpgt_epi32(target, block);
+    count += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(less)));
+  }
+  for(; i < max_index; i++){
+    count += keys[i] < key;
+  }
+  return count;
+}
+
+__attribute__((target("sse4.2")))
+uint32_t key_search_sse42(const uint32_t* keys, uint32_t num_keys, uint32_t key){
+  uint32_t min_index;
+  uint32_t max_index;
+  key_search_window(keys, num_keys, key, &min_index, &max_index);
+
+  __m128i sign = _mm_set1_epi32((int)0x80000000);
+  __m128i target = _mm_xor_si128(_mm_set1_epi32((int)key), sign);
+  uint32_t count = min_index;
+  uint32_t i = min_index;
+  for(; i + 4 <= max_index; i += 4){
+    __m128i block = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(keys + i)), sign);
+    __m128i less = _mm_cmpgt_epi32(target, block);
+    count += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(less)));
+  }
+  for(; i < max_index; i++){
+    count += keys[i] < key;
+  }
+  return count;
+}
+#endif
+
+typedef uint32_t (*KeySearchFunction)(const uint32_t* keys, uint32_t num_keys, uint32_t key);
+KeySearchFunction key_search = key_search_scalar;
+
+//运行时按CPU支持的指令集选实现，db_open时调用
+void key_search_init(){
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2")){
+    key_search = key_search_avx2;
+  }else if(__builtin_cpu_supports("sse4.2")){
+    key_search = key_search_sse42;
+  }
+#endif
+}
+
+//找到叶子节点后,节点信息必然在叶子结点上
+//在连续的key数组里查找cell
+//返回的cursor接管调用方对该叶子的pin和latch，用完调用cursor_close
+Cursor* leaf_node_find(Table* table, uint32_t page_num, void* node, LatchMode mode, uint32_t key){
+  Cursor* cursor = cursor_alloc();
+  cursor->table = table;
+  cursor->page_num = page_num;
+  cursor->node = node;
+  cursor->latch_mode = mode;
+  cursor->end_of_table = false;
+  cursor->readahead_parent = INVALID_PAGE_NUM;
+  cursor->readahead_next = 0;
+  cursor->snapshot = NULL;
+  cursor->cell_num = key_search(leaf_node_keys(node), *leaf_node_num_cells(node), key);
+  return cursor;
+}
+
+//返回子节点索引位置
+uint32_t internal_node_find_child(void* node, uint32_t key){
+  return key_search(internal_node_keys(node), *internal_node_num_keys(node), key);
+}
+
+//latch crabbing往下找：锁住孩子之后才放开父节点
+//中间节点都加共享latch，叶子加leaf_mode
+//共享latch不能原地升级，叶子要排他时先放开再加：父节点一直锁着，期间没人能分裂这个叶子
+//同时算出这个叶子能接收的key上界：每经过一个非最右的孩子，上界收紧成它的分隔key
+Cursor* table_find_bounded(Table* table, uint32_t key, LatchMode leaf_mode, uint32_t* upper_bound){
+  Pager* pager = table->pager;
+  uint32_t page_num = table->root_page_num;
+  *upper_bound = UINT32_MAX;
+  void* node = pager_acquire(pager, page_num, LATCH_SHARED);
+  //根没有父节点护着，换latch的空档里可能已经分裂成了中间节点，那就换回共享latch往下走
+  if(get_node_type(node) == NODE_LEAF && leaf_mode == LATCH_EXCLUSIVE){
+    page_unlock(pager, page_num);
+    page_lock(pager, page_num, LATCH_EXCLUSIVE);
+    if(get_node_type(node) != NODE_LEAF){
+      page_unlock(pager, page_num);
+      page_lock(pager, page_num, LATCH_SHARED);
+    }
+  }
+
+  while(get_node_type(node) == NODE_INTERNAL){
+    uint32_t index = internal_node_find_child(node, key);
+    if(index < *internal_node_num_keys(node)){
+      *upper_bound = *internal_node_key(node, index);
+    }
+    uint32_t child_page_num = *internal_node_child(node, index);
+    void* child = pager_acquire(pager, child_page_num, LATCH_SHARED);
+    if(get_node_type(child) == NODE_LEAF && leaf_mode == LATCH_EXCLUSIVE){
+      page_unlock(pager, child_page_num);
+      page_lock(pager, child_page_num, LATCH_EXCLUSIVE);
+    }
+    pager_release(pager, page_num);
+    page_num = child_page_num;
+    node = child;
+  }
+  return leaf_node_find(table, page_num, node, leaf_mode, key);
+}
+
+//读路径：一路共享latch，可以在多个线程里同时调用
+Cursor* table_find(Table* table, uint32_t key){
+  uint32_t upper_bound;
+  return table_find_bounded(table, key, LATCH_SHARED, &upper_bound);
+}
+
+//返回最后面的key为最大的key
+//中间节点最大的key在最右边的子树里
+uint32_t get_node_max_key(Pager* pager, void* node){
+  if(get_node_type(node) == NODE_LEAF){
+    return *leaf_node_key(node, *leaf_node_num_cells(node)-1);
+  }
+  uint32_t right_child_page_num = *internal_node_right_child(node);
+  void* right_child = get_page(pager, right_child_page_num);
+  uint32_t max_key = get_node_max_key(pager, right_child);
+  pager_unpin(pager, right_child_page_num);
+  return max_key;
+}
+
+uint32_t* catalog_roots(void* node){
+  return node + CATALOG_ROOTS_OFFSET;
+}
+
+uint32_t* catalog_free_head(void* node){
+  return node + CATALOG_FREE_HEAD_OFFSET;
+}
+
+uint32_t* free_page_next(void* node){
+  return node + FREE_PAGE_NEXT_OFFSET;
+}
+
+//分配一页：先从文件头记的free list上摘，没有空闲页才扩展文件
+//摘下来的页还是空闲页的样子，调用方要整页初始化
+uint32_t get_unused_page_num(Pager* pager){
+  void* header = get_page(pager, HEADER_PAGE_NUM);
+  uint32_t page_num = *header_free_head(header);
+  if(page_num != 0){
+    void* page = get_page(pager, page_num);
+    pager_mark_dirty(pager, HEADER_PAGE_NUM);
+    *header_free_head(header) = *free_page_next(page);
+    pager_unpin(pager, page_num);
+  }else{
+    page_num = pager->num_pages;
+  }
+  pager_unpin(pager, HEADER_PAGE_NUM);
+  return page_num;
+}
+
+//把不再被引用的页挂到free list的头上，调用方保证没有别的线程还能走到这一页
+void pager_free_page(Pager* pager, uint32_t page_num){
+  void* header = get_page(pager, HEADER_PAGE_NUM);
+  void* page = get_page(pager, page_num);
+  pager_mark_dirty(pager, HEADER_PAGE_NUM);
+  pager_mark_dirty(pager, page_num);
+  *(uint8_t*)page = NODE_FREE;
+  *free_page_next(page) = *header_free_head(header);
+  *header_free_head(header) = page_num;
+  pager_unpin(pager, page_num);
+  pager_unpin(pager, HEADER_PAGE_NUM);
+}
+
+//从根一直往左走到叶子，数经过的层数
+uint32_t tree_height(Pager* pager, uint32_t root_page_num){
+  uint32_t height = 1;
+  uint32_t page_num = root_page_num;
+  void* node = get_page(pager, page_num);
+  while(get_node_type(node) == NODE_INTERNAL){
+    uint32_t child_page_num = *internal_node_child(node, 0);
+    pager_unpin(pager, page_num);
+    page_num = child_page_num;
+    node = get_page(pager, page_num);
+    height++;
+  }
+  pager_unpin(pager, page_num);
+  return height;
+}
+
+//树长高或者变矮一层时改文件头里记的高度
+void table_add_height(Table* table, int32_t delta){
+  Pager* pager = table->pager;
+  void* header = get_page(pager, HEADER_PAGE_NUM);
+  pager_mark_dirty(pager, HEADER_PAGE_NUM);
+  *header_tree_height(header, table->tree) += delta;
+  pager_unpin(pager, HEADER_PAGE_NUM);
+}
+
+uint32_t* node_parent(void* node){
+  return node + PARENT_POINTER_OFFSET;
+}
+
+//扫描进到一个叶子时从父节点里找出后面几个兄弟叶子，提前发读请求
+//同一个父节点下已经发过的不再发，每进一个叶子大约只多发一页
+//父节点拿不到（不在缓存里、被写线程锁着）或者父指针已经过时就跳过，预读只是提示
+void cursor_readahead(Cursor* cursor){
+  Pager* pager = cursor->table->pager;
+  void* leaf = cursor->node;
+  if(pager->readahead_pages == 0 || cursor->latch_mode != LATCH_SHARED ||
+     is_node_root(leaf) || *leaf_node_num_cells(leaf) == 0){
+    return;
+  }
+  uint32_t parent_page_num = *node_parent(leaf);
+  void* parent = pager_try_acquire_shared(pager, parent_page_num);
+  if(parent == NULL){
+    return;
+  }
+  if(get_node_type(parent) == NODE_INTERNAL){
+    uint32_t num_keys = *internal_node_num_keys(parent);
+    uint32_t index = internal_node_find_child(parent, *leaf_node_key(leaf, 0));
+    if(index <= num_keys && *internal_node_child(parent, index) == cursor->page_num){
+      uint32_t first = index + 1;
+      if(cursor->readahead_parent == parent_page_num && cursor->readahead_next > first){
+        first = cursor->readahead_next;
+      }
+      uint32_t last = index + pager->readahead_pages;
+      if(last > num_keys){
+        last = num_keys;
+      }
+      for(uint32_t i = first; i <= last; i++){
+        pager_readahead(pager, *internal_node_child(parent, i));
+      }
+      cursor->readahead_parent = parent_page_num;
+      cursor->readahead_next = last + 1;
+    }
+  }
+  pager_release(pager, parent_page_num);
+}
+
+//沿着next_leaf走到下一个叶子：先锁住下一个再放开当前的，pin和latch一起转移过去
+//叶子之间总是从左往右锁，扫描的线程之间不会互相等成环
+void cursor_next_leaf(Cursor* cursor){
+  Pager* pager = cursor->table->pager;
+  uint32_t next_page_num = *leaf_node_next_leaf(cursor->node);
+  if(next_page_num == 0){
+    cursor->end_of_table = true;
+    return;
+  }
+  void* next = cursor->snapshot != NULL ? pager_acquire_snapshot(pager, next_page_num, cursor->snapshot) :
+                                          pager_acquire(pager, next_page_num, cursor->latch_mode);
+  pager_release(pager, cursor->page_num);
+  cursor->page_num = next_page_num;
+  cursor->node = next;
+  cursor->cell_num = 0;
+  cursor_readahead(cursor);
+}
+
+//定位到第一个>=key的行
+//table_find可能停在叶子末尾之后，这时要跳到下一个叶子
+Cursor* table_seek(Table* table, uint32_t key){
+  Cursor* cursor = table_find(table, key);
+  if(cursor->cell_num >= *leaf_node_num_cells(cursor->node)){
+    cursor_next_leaf(cursor);
+  }
+  return cursor;
+}
+
+//从最小的key开始的cursor
+Cursor* table_start(Table* table){
+  return table_seek(table, 0);
+}
+
+//table_find的快照版本：从快照里的根往下，每一页都按快照读
+Cursor* table_find_at(Table* table, Snapshot* snapshot, uint32_t key){
+  Pager* pager = table->pager;
+  uint32_t page_num = snapshot->roots[table->tree];
+  void* node = pager_acquire_snapshot(pager, page_num, snapshot);
+  while(get_node_type(node) == NODE_INTERNAL){
+    uint32_t child_page_num = *internal_node_child(node, internal_node_find_child(node, key));
+    void* child = pager_acquire_snapshot(pager, child_page_num, snapshot);
+    pager_release(pager, page_num);
+    page_num = child_page_num;
+    node = child;
+  }
+  Cursor* cursor = leaf_node_find(table, page_num, node, LATCH_SHARED, key);
+  cursor->snapshot = snapshot;
+  return cursor;
+}
+
+//在快照上定位到第一个>=key的行
+Cursor* table_seek_at(Table* table, Snapshot* snapshot, uint32_t key){
+  Cursor* cursor = table_find_at(table, snapshot, key);
+  if(cursor->cell_num >= *leaf_node_num_cells(cursor->node)){
+    cursor_next_leaf(cursor);
+  }
+  return cursor;
+}
+
+//快照里id<=key的行数：往下走的时候把key左边那些孩子的行数加起来，到叶子再加上叶子里<=key的个数
+//写线程更新行数是在语句里、放开latch之后自底向上补的，快照总在两条写语句之间，看到的行数是准的
+uint64_t table_count_le(Table* table, Snapshot* snapshot, uint32_t key){
+  Pager* pager = table->pager;
+  uint32_t page_num = snapshot->roots[table->tree];
+  void* node = pager_acquire_snapshot(pager, page_num, snapshot);
+  uint64_t count = 0;
+  while(get_node_type(node) == NODE_INTERNAL){
+    uint32_t index = internal_node_find_child(node, key);
+    for(uint32_t i = 0; i < index; i++){
+      count += *internal_node_count(node, i);
+    }
+    uint32_t child_page_num = *internal_node_child(node, index);
+    void* child = pager_acquire_snapshot(pager, child_page_num, snapshot);
+    pager_release(pager, page_num);
+    page_num = child_page_num;
+    node = child;
+  }
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  uint32_t cell_num = key_search(leaf_node_keys(node), num_cells, key);
+  count += cell_num;
+  if(cell_num < num_cells && *leaf_node_key(node, cell_num) == key){
+    count++;
+  }
+  pager_release(pager, page_num);
+  return count;
+}
+
+//在快照上定位到按id排第rank行（从0开始）：在每个中间节点上按孩子的行数减下去，超过总行数就停在表尾
+Cursor* table_seek_rank(Table* table, Snapshot* snapshot, uint64_t rank){
+  Pager* pager = table->pager;
+  uint32_t page_num = snapshot->roots[table->tree];
+  void* node = pager_acquire_snapshot(pager, page_num, snapshot);
+  while(get_node_type(node) == NODE_INTERNAL){
+    uint32_t num_keys = *internal_node_num_keys(node);
+    uint32_t index = 0;
+    while(index < num_keys && rank >= *internal_node_count(node, index)){
+      rank -= *internal_node_count(node, index);
+      index++;
+    }
+    uint32_t child_page_num = *internal_node_child(node, index);
+    void* child = pager_acquire_snapshot(pager, child_page_num, snapshot);
+    pager_release(pager, page_num);
+    page_num = child_page_num;
+    node = child;
+  }
+  Cursor* cursor = leaf_node_find(table, page_num, node, LATCH_SHARED, 0);
+  cursor->snapshot = snapshot;
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  cursor->cell_num = rank < num_cells ? rank : num_cells;
+  if(cursor->cell_num >= num_cells){
+    cursor_next_leaf(cursor);
+  }
+  return cursor;
+}
+
+//把当前行解码到row里
+void cursor_row(Cursor* cursor, Row* row){
+  leaf_node_row(cursor->node, cursor->cell_num, row);
+}
+
+void cursor_advance(Cursor* cursor){
+  cursor->cell_num += 1;
+  if(cursor->cell_num >= *leaf_node_num_cells(cursor->node)){
+    cursor_next_leaf(cursor);
+  }
+}
+
+//cursor只能在打开它的线程里关
+void cursor_close(Cursor* cursor){
+  pager_release(cursor->table->pager, cursor->page_num);
+  cursor->next_free = thread_arena.free_cursors;
+  thread_arena.free_cursors = cursor;
+}
+
+//点查：找到时把行解码到row里返回true
+bool table_get(Table* table, uint32_t key, Row* row){
+  Cursor* cursor = table_find(table, key);
+  bool found = cursor->cell_num < *leaf_node_num_cells(cursor->node) &&
+               *leaf_node_key(cursor->node, cursor->cell_num) == key;
+  if(found){
+    cursor_row(cursor, row);
+  }
+  cursor_close(cursor);
+  return found;
+}
+
+void initialize_internal_node(void * node){
+  set_node_type(node, NODE_INTERNAL);
+  set_node_root(node, false);
+  *internal_node_num_keys(node) = 0;
+}
+
+//把page_num的父指针改成parent_page_num
+void set_node_parent(Pager* pager, uint32_t page_num, uint32_t parent_page_num){
+  void* node = get_page(pager, page_num);
+  if(*node_parent(node) != parent_page_num){
+    pager_mark_dirty(pager, page_num);
+    *node_parent(node) = parent_page_num;
+  }
+  pager_unpin(pager, page_num);
+}
+
+//根节点页号不变：旧根拷到新页作为左孩子，根改成只有一个key的中间节点
+//左孩子是中间节点时它的孩子们要改父指针
+void create_new_root(Table* table, uint32_t right_child_page_num){
+  Pager* pager = table->pager;
+  void* root = get_page(pager , table->root_page_num);
+  void* right_child = get_page(pager, right_child_page_num);
+  uint32_t left_child_page_num = get_unused_page_num(pager);
+  void* left_child = get_page(pager, left_child_page_num);
+  pager_mark_dirty(pager, table->root_page_num);
+  pager_mark_dirty(pager, right_child_page_num);
+  pager_mark_dirty(pager, left_child_page_num);
+
+  memcpy(left_child, root, PAGE_SIZE);
+  set_node_root(left_child, false);
+
+  if(get_node_type(left_child) == NODE_INTERNAL){
+    uint32_t num_keys = *internal_node_num_keys(left_child);
+    for(uint32_t i = 0; i <= num_keys; i++){
+      set_node_parent(pager, *internal_node_child(left_child, i), left_child_page_num);
+    }
+  }
+
+  initialize_internal_node(root);
+  set_node_root(root, true);
+  *internal_node_num_keys(root) = 1;
+  *internal_node_child(root, 0) = left_child_page_num;
+  uint32_t left_child_max_key = get_node_max_key(pager, left_child);
+  *internal_node_key(root, 0) = left_child_max_key;
+  *internal_node_right_child(root) = right_child_page_num;
+  *internal_node_count(root, 0) = node_row_count(left_child);
+  *internal_node_count(root, 1) = node_row_count(right_child);
+  *node_parent(left_child) = table->root_page_num;
+  *node_parent(right_child) = table->root_page_num;
+
+  pager_unpin(pager, left_child_page_num);
+  pager_unpin(pager, right_child_page_num);
+  pager_unpin(pager, table->root_page_num);
+  table_add_height(table, 1);
+}
+
+//返回孩子old_page_num在父节点里的下标，最右孩子的下标是num_keys
+uint32_t internal_node_child_index(void* node, uint32_t old_page_num, uint32_t old_max){
+  uint32_t num_keys = *internal_node_num_keys(node);
+  uint32_t index = internal_node_find_child(node, old_max);
+  while(index < num_keys && *internal_node_child(node, index) != old_page_num){
+    index++;
+  }
+  return index;
+}
+
+//page_num下面多了或者少了delta行，沿父指针把各层祖先里记的行数改掉，key用来在父节点里找它
+//调用方要先放开这棵树上所有的latch：往上走每层只拿一个排他latch，不会和往下crabbing的读者互相等
+//写者只有一个，父指针不会变；读者在这中间可能看到上下差几行
+void tree_add_count(Table* table, uint32_t page_num, uint32_t key, int32_t delta){
+  Pager* pager = table->pager;
+  while(page_num != table->root_page_num){
+    void* node = get_page(pager, page_num);
+    uint32_t parent_page_num = *node_parent(node);
+    pager_unpin(pager, page_num);
+    void* parent = pager_acquire(pager, parent_page_num, LATCH_EXCLUSIVE);
+    uint32_t index = internal_node_child_index(parent, page_num, key);
+    if(*internal_node_child(parent, index) != page_num){
+      printf("corrupt parent pointer on page %d\n", page_num);
+      exit(EXIT_FAILURE);
+    }
+    pager_mark_dirty(pager, parent_page_num);
+    *internal_node_count(parent, index) += delta;
+    pager_release(pager, parent_page_num);
+    page_num = parent_page_num;
+  }
+}
+
+void internal_node_split_and_insert(Table* table, uint32_t page_num,
+                                    uint32_t old_page_num, uint32_t left_max,
+                                    uint32_t new_page_num);
+
+//页上现在的行数
+uint32_t page_row_count(Pager* pager, uint32_t page_num){
+  uint32_t count = node_row_count(get_page(pager, page_num));
+  pager_unpin(pager, page_num);
+  return count;
+}
+
+//old_page_num分裂出了new_page_num，把新页插在父节点里old_page_num的右边
+//left_max是分裂后old_page_num这一半的最大key，新页沿用old_page_num原来的key
+//两个孩子的行数都按分裂后的内容重算，新行已经算在里面，更上面的祖先由调用方补
+void internal_node_insert(Table* table, uint32_t parent_page_num,
+                          uint32_t old_page_num, uint32_t left_max,
+                          uint32_t new_page_num){
+  Pager* pager = table->pager;
+  void* parent = get_page(pager, parent_page_num);
+
+  // 之前Parent节点key数量
+  uint32_t original_num_keys = *internal_node_num_keys(parent);
+
+  if (original_num_keys >= INTERNAL_NODE_MAX_CELLS) {
+    pager_unpin(pager, parent_page_num);
+    internal_node_split_and_insert(table, parent_page_num, old_page_num,
+                                   left_max, new_page_num);
+    return;
+  }
+
+  pager_mark_dirty(pager, parent_page_num);
+  uint32_t index = internal_node_child_index(parent, old_page_num, left_max);
+  memmove(internal_node_counts(parent) + index + 2, internal_node_counts(parent) + index + 1,
+          (original_num_keys - index) * INTERNAL_NODE_COUNT_SIZE);
+  *internal_node_count(parent, index) = page_row_count(pager, old_page_num);
+  *internal_node_count(parent, index + 1) = page_row_count(pager, new_page_num);
+
+  if (index == original_num_keys) {
+    /* Replace right child */
+    *internal_node_num_keys(parent) = original_num_keys + 1;
+    *internal_node_child(parent, original_num_keys) = old_page_num;
+    *internal_node_key(parent, original_num_keys) = left_max;
+    *internal_node_right_child(parent) = new_page_num;
+  } else {
+    /* Make room for the new cell */
+    uint32_t moved = original_num_keys - index;
+    memmove(internal_node_keys(parent) + index + 1, internal_node_keys(parent) + index,
+            moved * INTERNAL_NODE_KEY_SIZE);
+    memmove(internal_node_children(parent) + index + 1, internal_node_children(parent) + index,
+            moved * INTERNAL_NODE_CHILD_SIZE);
+    *internal_node_num_keys(parent) = original_num_keys + 1;
+    *internal_node_key(parent, index) = left_max;
+    *internal_node_child(parent, index + 1) = new_page_num;
+  }
+
+  pager_unpin(pager, parent_page_num);
+}
+
+//从page_num往上一直是父节点的右孩子，说明它在树的最右路径上
+bool node_is_rightmost(Pager* pager, uint32_t page_num){
+  while(true){
+    void* node = get_page(pager, page_num);
+    bool is_root = is_node_root(node);
+    uint32_t parent_page_num = *node_parent(node);
+    pager_unpin(pager, page_num);
+    if(is_root){
+      return true;
+    }
+    void* parent = get_page(pager, parent_page_num);
+    bool right = *internal_node_right_child(parent) == page_num;
+    pager_unpin(pager, parent_page_num);
+    if(!right){
+      return false;
+    }
+    page_num = parent_page_num;
+  }
+}
+
+//中间节点满了：连同要插入的孩子一共MAX+2个孩子
+//左边留INTERNAL_NODE_LEFT_SPLIT_COUNT个key，下一个key提到父节点，其余搬到新页
+//搬到新页的孩子要改父指针；分裂的是根就交给create_new_root
+void internal_node_split_and_insert(Table* table, uint32_t page_num,
+                                    uint32_t old_page_num, uint32_t left_max,
+                                    uint32_t new_page_num){
+  Pager* pager = table->pager;
+  void* node = get_page(pager, page_num);
+  pager_mark_dirty(pager, page_num);
+  stats_add(STAT_INTERNAL_SPLITS, 1);
+
+  uint32_t num_keys = *internal_node_num_keys(node);
+  uint32_t children[INTERNAL_NODE_MAX_CELLS + 2];
+  uint32_t keys[INTERNAL_NODE_MAX_CELLS + 1];
+  uint32_t counts[INTERNAL_NODE_MAX_CELLS + 2];
+  uint32_t index = internal_node_child_index(node, old_page_num, left_max);
+  uint32_t count = 0;
+  for(uint32_t i = 0; i <= num_keys; i++){
+    children[count] = *internal_node_child(node, i);
+    counts[count] = *internal_node_count(node, i);
+    if(i < num_keys){
+      keys[count] = *internal_node_key(node, i);
+    }
+    count++;
+    if(i == index){
+      if(i < num_keys){
+        keys[count] = keys[count - 1];
+      }
+      keys[count - 1] = left_max;
+      counts[count - 1] = page_row_count(pager, old_page_num);
+      children[count] = new_page_num;
+      counts[count] = page_row_count(pager, new_page_num);
+      count++;
+    }
+  }
+
+  uint32_t split_page_num = get_unused_page_num(pager);
+  void* split_node = get_page(pager, split_page_num);
+  pager_mark_dirty(pager, split_page_num);
+  initialize_internal_node(split_node);
+
+  //最右路径上的节点在末尾追加时，左边几乎填满，新节点只拿走最后两个孩子
+  uint32_t left_count = INTERNAL_NODE_LEFT_SPLIT_COUNT;
+  if(index == num_keys && node_is_rightmost(pager, page_num)){
+    left_count = INTERNAL_NODE_MAX_CELLS - 1;
+  }
+  uint32_t right_count = INTERNAL_NODE_MAX_CELLS - left_count;
+  internal_node_fill(node, keys, children, counts, left_count);
+  uint32_t promoted_key = keys[left_count];
+  internal_node_fill(split_node, keys + left_count + 1, children + left_count + 1,
+                     counts + left_count + 1, right_count);
+
+  set_node_parent(pager, new_page_num, page_num);
+  for(uint32_t i = left_count + 1; i < count; i++){
+    set_node_parent(pager, children[i], split_page_num);
+  }
+
+  bool splitting_root = is_node_root(node);
+  uint32_t grandparent_page_num = *node_parent(node);
+  *node_parent(split_node) = grandparent_page_num;
+  pager_unpin(pager, split_page_num);
+  pager_unpin(pager, page_num);
+
+  if(splitting_root){
+    create_new_root(table, split_page_num);
+  }else{
+    internal_node_insert(table, grandparent_page_num, page_num, promoted_key,
+                         split_page_num);
+  }
+}
+
+//b数节点分裂，record是编码好的新记录
+void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, const void* record, uint32_t size){
+  Pager* pager = cursor->table->pager;
+  void* old_node = cursor->node;
+  uint32_t new_page_num = get_unused_page_num(pager);
+  void* new_node = get_page(pager, new_page_num);
+  pager_mark_dirty(pager, cursor->page_num);
+  pager_mark_dirty(pager, new_page_num);
+  initialize_leaf_node(new_node);
+  stats_add(STAT_LEAF_SPLITS, 1);
+  *node_parent(new_node) = *node_parent(old_node);
+  bool rightmost = *leaf_node_next_leaf(old_node) == 0;
+  *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
+  *leaf_node_next_leaf(old_node) = new_page_num;
+  if(rightmost){
+    cursor->table->rightmost_leaf_page_num = new_page_num;
+  }
+
+  //旧页拍个快照，连同新行一共num_cells+1个cell，按字节数大致对半分
+  uint8_t snapshot[PAGE_SIZE];
+  memcpy(snapshot, old_node, PAGE_SIZE);
+  uint32_t num_cells = *leaf_node_num_cells(snapshot);
+  uint32_t total = num_cells + 1;
+  uint32_t keys[LEAF_NODE_MAX_CELLS + 1];
+  void* records[LEAF_NODE_MAX_CELLS + 1];
+  uint32_t sizes[LEAF_NODE_MAX_CELLS + 1];
+  uint32_t total_bytes = 0;
+  for(uint32_t i = 0; i < total; i++){
+    if(i == cursor->cell_num){
+      keys[i] = key;
+      records[i] = (void*)record;
+      sizes[i] = size;
+    }else{
+      uint32_t j = i < cursor->cell_num ? i : i - 1;
+      keys[i] = *leaf_node_key(snapshot, j);
+      records[i] = leaf_node_record(snapshot, j);
+      sizes[i] = record_size(records[i]);
+    }
+    total_bytes += sizes[i] + LEAF_NODE_SLOT_SIZE;
+  }
+
+  uint32_t left_count = 0;
+  uint32_t left_bytes = 0;
+  while(left_count < total - 1 && left_bytes < total_bytes / 2){
+    left_bytes += sizes[left_count] + LEAF_NODE_SLOT_SIZE;
+    left_count++;
+  }
+  if(left_count == 0){
+    left_count = 1;
+  }
+  //在最右叶子末尾追加（id递增）时旧页保持满的，新行单独开一页
+  if(rightmost && cursor->cell_num == num_cells){
+    left_count = num_cells;
+  }
+
+  leaf_node_reset(old_node);
+  for(uint32_t i = 0; i < total; i++){
+    void* destination_node = i < left_count ? old_node : new_node;
+    uint32_t index_within_node = i < left_count ? i : i - left_count;
+    leaf_node_insert_cell(destination_node, index_within_node, keys[i], records[i], sizes[i]);
+  }
+
+  if(is_node_root(old_node)){
+    create_new_root(cursor->table, new_page_num);
+  }else {
+    uint32_t parent_page_num = *node_parent(old_node);
+    uint32_t new_max = get_node_max_key(pager, old_node);
+    internal_node_insert(cursor->table, parent_page_num, cursor->page_num,
+                         new_max, new_page_num);
+  }
+
+  pager_unpin(pager, new_page_num);
+}
+
+//叶子放得下就插进去返回true；放不下返回false，页没有动过，调用方去分裂
+bool leaf_node_insert(Cursor* cursor, uint32_t key, const void* record, uint32_t size){
+  Pager* pager = cursor->table->pager;
+  void * node = cursor->node;
+
+  //空闲空间不够时，算上空洞够的话先整理
+  uint32_t needed = size + LEAF_NODE_SLOT_SIZE;
+  uint32_t free_space = leaf_node_free_space(node);
+  if(free_space < needed && free_space + *leaf_node_fragmented(node) < needed){
+    return false;
+  }
+
+  pager_mark_dirty(pager, cursor->page_num);
+  if(free_space < needed){
+    leaf_node_compact(node);
+  }
+  leaf_node_insert_cell(node, cursor->cell_num, key, record, size);
+  return true;
+}
+
+//找插入位置：乐观地一路共享latch下来，只在叶子上加排他latch
+//key比最右叶子里最大的还大时直接锁住最右叶子，不用从根往下找
+Cursor* table_find_insert(Table* table, uint32_t key, uint32_t* upper_bound){
+  Pager* pager = table->pager;
+  uint32_t page_num = table->rightmost_leaf_page_num;
+  *upper_bound = UINT32_MAX;
+  if(page_num != INVALID_PAGE_NUM){
+    void* node = pager_acquire(pager, page_num, LATCH_EXCLUSIVE);
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    if(get_node_type(node) == NODE_LEAF && *leaf_node_next_leaf(node) == 0 &&
+       num_cells > 0 && key > *leaf_node_key(node, num_cells - 1)){
+      return leaf_node_find(table, page_num, node, LATCH_EXCLUSIVE, key);
+    }
+    pager_release(pager, page_num);
+  }
+
+  Cursor* cursor = table_find_bounded(table, key, LATCH_EXCLUSIVE, upper_bound);
+  if(*leaf_node_next_leaf(cursor->node) == 0){
+    table->rightmost_leaf_page_num = cursor->page_num;
+  }
+  return cursor;
+}
+
+//悲观路径：叶子要分裂时从根开始一路加排他latch
+//遇到不满的中间节点，分裂最多传到它为止，它上面的祖先都可以放开
+//返回的cursor持有叶子的排他latch，path里从上到下是仍然锁着的中间节点
+Cursor* table_find_exclusive(Table* table, uint32_t key, uint32_t* path, uint32_t* path_length){
+  Pager* pager = table->pager;
+  uint32_t page_num = table->root_page_num;
+  void* node = pager_acquire(pager, page_num, LATCH_EXCLUSIVE);
+  *path_length = 0;
+  while(get_node_type(node) == NODE_INTERNAL){
+    if(*internal_node_num_keys(node) < INTERNAL_NODE_MAX_CELLS){
+      for(uint32_t i = 0; i < *path_length; i++){
+        pager_release(pager, path[i]);
+      }
+      *path_length = 0;
+    }
+    if(*path_length == BTREE_MAX_DEPTH){
+      printf("btree too deep\n");
+      exit(EXIT_FAILURE);
+    }
+    path[(*path_length)++] = page_num;
+    uint32_t child_page_num = *internal_node_child(node, internal_node_find_child(node, key));
+    node = pager_acquire(pager, child_page_num, LATCH_EXCLUSIVE);
+    page_num = child_page_num;
+  }
+  return leaf_node_find(table, page_num, node, LATCH_EXCLUSIVE, key);
+}
+
+//乐观插入放不下时重新用排他latch锁住分裂会改到的路径，再插入
+//分裂一直传到path[0]为止，它和下面各层的行数在分裂时已经重算过，放开latch后再给它的祖先加一
+void table_insert_split(Table* table, uint32_t key, const void* record, uint32_t size){
+  uint32_t path[BTREE_MAX_DEPTH];
+  uint32_t path_length;
+  Cursor* cursor = table_find_exclusive(table, key, path, &path_length);
+  uint32_t counted_page_num = cursor->page_num;
+  if(!leaf_node_insert(cursor, key, record, size)){
+    leaf_node_split_and_insert(cursor, key, record, size);
+    if(path_length > 0){
+      counted_page_num = path[0];
+    }
+  }
+  cursor_close(cursor);
+  for(uint32_t i = 0; i < path_length; i++){
+    pager_release(table->pager, path[i]);
+  }
+  tree_add_count(table, counted_page_num, key, 1);
+}
+
+//FNV-1a，索引树的key
+uint32_t string_hash(const char* value, uint32_t length){
+  uint32_t hash = 2166136261U;
+  for(uint32_t i = 0; i < length; i++){
+    hash = (hash ^ (uint8_t)value[i]) * 16777619U;
+  }
+  return hash;
+}
+
+//索引项：[4][列值长度][主键id][列值]
+uint32_t index_record(uint32_t id, const char* value, uint32_t length, uint8_t* record){
+  record[0] = INDEX_RECORD_ID_SIZE;
+  record[1] = length;
+  memcpy(record + LEAF_NODE_RECORD_HEADER_SIZE, &id, INDEX_RECORD_ID_SIZE);
+  memcpy(record + LEAF_NODE_RECORD_HEADER_SIZE + INDEX_RECORD_ID_SIZE, value, length);
+  return LEAF_NODE_RECORD_HEADER_SIZE + INDEX_RECORD_ID_SIZE + length;
+}
+
+uint32_t index_record_id(const uint8_t* record){
+  uint32_t id;
+  memcpy(&id, record + LEAF_NODE_RECORD_HEADER_SIZE, INDEX_RECORD_ID_SIZE);
+  return id;
+}
+
+//记录的第field段是否等于value
+//行记录里username是第0段、email是第1段，和IndexColumn的取值一致；索引项的列值是第1段
+bool record_field_equals(const uint8_t* record, uint32_t field, Token value){
+  const uint8_t* start = record + LEAF_NODE_RECORD_HEADER_SIZE + (field == 0 ? 0 : record[0]);
+  return record[field] == value.length && memcmp(start, value.start, value.length) == 0;
+}
+
+const char* row_column(Row* row, IndexColumn column){
+  return column == INDEX_USERNAME ? row->username : row->email;
+}
+
+//往索引树里插一项：key相同的项不去重，新项插在它们前面
+void index_insert(Table* index, uint32_t id, const char* value, uint32_t length){
+  uint8_t record[LEAF_NODE_MAX_RECORD_SIZE];
+  uint32_t key = string_hash(value, length);
+  uint32_t size = index_record(id, value, length, record);
+  uint32_t upper_bound;
+  Cursor* cursor = table_find_insert(index, key, &upper_bound);
+  uint32_t leaf_page_num = cursor->page_num;
+  bool inserted = leaf_node_insert(cursor, key, record, size);
+  cursor_close(cursor);
+  if(inserted){
+    tree_add_count(index, leaf_page_num, key, 1);
+  }else{
+    table_insert_split(index, key, record, size);
+  }
+}
+
+//主表插入一行之后把它加进各个索引
+void table_index_row(Table* table, Row* row){
+  for(uint32_t c = 0; c < INDEX_COLUMNS; c++){
+    if(table->indexes[c] != NULL){
+      const char* value = row_column(row, c);
+      index_insert(table->indexes[c], row->id, value, strlen(value));
+    }
+  }
+}
+
+//按列值等值查：从哈希值seek下去，key相同的项可能跨好几个叶子，逐个比对列值
+//返回匹配的主键id个数，*ids按id升序，分配在线程的arena里，语句结束时回收
+uint32_t index_lookup(Table* index, Token value, uint32_t** ids){
+  uint32_t key = string_hash(value.start, value.length);
+  uint32_t capacity = 16;
+  uint32_t count = 0;
+  *ids = arena_alloc(&thread_arena, sizeof(uint32_t) * capacity);
+
+  Cursor* cursor = table_seek(index, key);
+  while(!cursor->end_of_table && *leaf_node_key(cursor->node, cursor->cell_num) == key){
+    uint8_t* record = leaf_node_record(cursor->node, cursor->cell_num);
+    if(record_field_equals(record, 1, value)){
+      if(count == capacity){
+        *ids = arena_grow(&thread_arena, *ids, sizeof(uint32_t) * capacity, sizeof(uint32_t) * capacity * 2);
+        capacity *= 2;
+      }
+      (*ids)[count++] = index_record_id(record);
+    }
+    cursor_advance(cursor);
+  }
+  cursor_close(cursor);
+  qsort(*ids, count, sizeof(uint32_t), compare_page_num);
+  return count;
+}
+
+//建索引时从主表收集的一项，列值存在共享的字节区里
+typedef struct {
+  uint32_t key;
+  uint32_t id;
+  uint32_t offset;
+  uint32_t length;
+} IndexBuildEntry;
+
+int compare_index_build_entry(const void* a, const void* b){
+  const IndexBuildEntry* x = a;
+  const IndexBuildEntry* y = b;
+  if(x->key != y->key){
+    return (x->key > y->key) - (x->key < y->key);
+  }
+  return (x->id > y->id) - (x->id < y->id);
+}
+
+//给主表已有的行建索引：扫一遍主表收集(哈希, id, 列值)，按哈希排好序再插
+//key递增时每一项都落在最右叶子末尾，走追加路径，建出来的叶子基本是满的
+void index_build(Table* table, Table* index, IndexColumn column){
+  Pager* pager = table->pager;
+  uint32_t capacity = 1024;
+  uint32_t count = 0;
+  IndexBuildEntry* entries = malloc(sizeof(IndexBuildEntry) * capacity);
+  size_t bytes_capacity = 1 << 16;
+  size_t bytes_length = 0;
+  char* bytes = malloc(bytes_capacity);
+
+  Cursor* cursor = table_start(table);
+  while(!cursor->end_of_table){
+    uint8_t* record = leaf_node_record(cursor->node, cursor->cell_num);
+    uint32_t length = record[column];
+    const uint8_t* value = record + LEAF_NODE_RECORD_HEADER_SIZE + (column == 0 ? 0 : record[0]);
+    if(count == capacity){
+      capacity *= 2;
+      entries = realloc(entries, sizeof(IndexBuildEntry) * capacity);
+    }
+    if(bytes_length + length > bytes_capacity){
+      bytes_capacity *= 2;
+      bytes = realloc(bytes, bytes_capacity);
+    }
+    memcpy(bytes + bytes_length, value, length);
+    entries[count].key = string_hash(bytes + bytes_length, length);
+    entries[count].id = *leaf_node_key(cursor->node, cursor->cell_num);
+    entries[count].offset = bytes_length;
+    entries[count].length = length;
+    bytes_length += length;
+    count++;
+    cursor_advance(cursor);
+  }
+  cursor_close(cursor);
+
+  qsort(entries, count, sizeof(IndexBuildEntry), compare_index_build_entry);
+  for(uint32_t i = 0; i < count; i++){
+    index_insert(index, entries[i].id, bytes + entries[i].offset, entries[i].length);
+    if(pager_txn_full(pager)){
+      pager_commit(pager);
+    }
+  }
+  free(entries);
+  free(bytes);
+}
+
+//索引树和主表共用pager，rightmost_leaf_page_num各管各的
+Table* index_open(Table* table, IndexColumn column, uint32_t root_page_num){
+  Table* index = malloc(sizeof(Table));
+  index->pager = table->pager;
+  index->scan_threads = table->scan_threads;
+  index->output_format = table->output_format;
+  index->tree = HEADER_TREE_PRIMARY + 1 + column;
+  index->root_page_num = root_page_num;
+  index->rightmost_leaf_page_num = INVALID_PAGE_NUM;
+  for(uint32_t c = 0; c < INDEX_COLUMNS; c++){
+    index->indexes[c] = NULL;
+  }
+  return index;
+}
+
+//新文件：第0页是文件头，第1页是主表空的根叶子
+void header_create(Pager* pager, bool checksums){
+  void* header = get_page(pager, HEADER_PAGE_NUM);
+  pager_mark_dirty(pager, HEADER_PAGE_NUM);
+  header_init(header, checksums);
+  uint32_t root_page_num = get_unused_page_num(pager);
+  void* root = get_page(pager, root_page_num);
+  pager_mark_dirty(pager, root_page_num);
+  initialize_leaf_node(root);
+  set_node_root(root, true);
+  *node_parent(root) = 0;
+  *header_tree_root(header, HEADER_TREE_PRIMARY) = root_page_num;
+  *header_tree_height(header, HEADER_TREE_PRIMARY) = 1;
+  pager_unpin(pager, root_page_num);
+  pager_unpin(pager, HEADER_PAGE_NUM);
+  pager_commit(pager);
+}
+
+void header_rebuild_counts(Pager* pager);
+
+//没有文件头的旧文件第0页是主表的根：把根搬到文件末尾的新页，第0页改成文件头
+//旧目录页里的索引根和free list搬进文件头，目录页本身放回free list
+//这样得到的是版本1的文件头，和文件头版本1的文件一样接着重建中间层，顺便算出行数和树高
+//只在第一次打开旧文件时做一次
+void header_migrate(Pager* pager){
+  void* old_root = get_page(pager, HEADER_PAGE_NUM);
+  NodeType type = get_node_type(old_root);
+  if(type == NODE_HEADER){
+    bool uncounted = *header_version(old_root) == HEADER_UNCOUNTED_VERSION &&
+                     *header_checksum(old_root) == header_compute_checksum(old_root);
+    pager_unpin(pager, HEADER_PAGE_NUM);
+    if(uncounted){
+      header_rebuild_counts(pager);
+    }
+    return;
+  }
+  if((type != NODE_LEAF && type != NODE_INTERNAL) || !is_node_root(old_root)){
+    printf("not a database file\n");
+    exit(EXIT_FAILURE);
+  }
+  uint32_t catalog_page_num = *node_parent(old_root);
+  uint32_t root_page_num = pager->num_pages;
+  void* root = get_page(pager, root_page_num);
+  pager_mark_dirty(pager, HEADER_PAGE_NUM);
+  pager_mark_dirty(pager, root_page_num);
+  memcpy(root, old_root, PAGE_SIZE);
+  *node_parent(root) = 0;
+  if(type == NODE_INTERNAL){
+    uint32_t num_keys = *internal_node_num_keys(root);
+    for(uint32_t i = 0; i <= num_keys; i++){
+      set_node_parent(pager, uncounted_internal_node_child(root, i), root_page_num);
+    }
+  }
+
+  void* header = old_root;
+  header_init(header, false);
+  *header_version(header) = HEADER_UNCOUNTED_VERSION;
+  *header_tree_root(header, HEADER_TREE_PRIMARY) = root_page_num;
+  if(catalog_page_num != 0 && catalog_page_num < root_page_num){
+    void* catalog = get_page(pager, catalog_page_num);
+    bool valid = get_node_type(catalog) == NODE_CATALOG;
+    if(valid){
+      for(uint32_t c = 0; c < INDEX_COLUMNS; c++){
+        *header_tree_root(header, HEADER_TREE_PRIMARY + 1 + c) = catalog_roots(catalog)[c];
+      }
+      *header_free_head(header) = *catalog_free_head(catalog);
+    }
+    pager_unpin(pager, catalog_page_num);
+    if(valid){
+      pager_free_page(pager, catalog_page_num);
+    }
+  }
+
+  pager_unpin(pager, root_page_num);
+  pager_unpin(pager, HEADER_PAGE_NUM);
+  pager_commit(pager);
+  header_rebuild_counts(pager);
+}
+
+//给已有的文件打开校验和：文件里现有的页先各算一遍，之后写回时再更新
+void checksum_enable(Pager* pager){
+  void* page = malloc(PAGE_SIZE);
+  uint32_t file_pages = pager->file_length / PAGE_SIZE;
+  for(uint32_t page_num = 0; page_num < file_pages && page_num < pager->num_pages; page_num++){
+    if(pread(pager->file_descriptor, page, PAGE_SIZE, (off_t)page_num * PAGE_SIZE) != PAGE_SIZE){
+      printf("读文件错误\n");
+      exit(EXIT_FAILURE);
+    }
+    checksum_write(pager->checksum_file_descriptor, page_num, page, 1);
+  }
+  free(page);
+  if(fsync(pager->checksum_file_descriptor) == -1){
+    printf("fsync error\n");
+    exit(EXIT_FAILURE);
+  }
+
+  void* header = get_page(pager, HEADER_PAGE_NUM);
+  pager_mark_dirty(pager, HEADER_PAGE_NUM);
+  *header_flags(header) |= HEADER_FLAG_CHECKSUMS;
+  pager_unpin(pager, HEADER_PAGE_NUM);
+  pager_commit(pager);
+}
+
+//打开时只读第0页：核对魔数、格式版本、页大小和校验和，页数、行数和各棵树的根都从这里拿
+//不碰任何数据页，打开的时间和文件大小无关
+void header_load(Table* table, DbConfig* config){
+  Pager* pager = table->pager;
+  void* header = get_page(pager, HEADER_PAGE_NUM);
+  if(get_node_type(header) != NODE_HEADER ||
+     memcmp(header + HEADER_MAGIC_OFFSET, HEADER_MAGIC, HEADER_MAGIC_SIZE) != 0){
+    printf("not a database file\n");
+    exit(EXIT_FAILURE);
+  }
+  if(*header_version(header) != HEADER_FORMAT_VERSION){
+    printf("unsupported format version %d\n", *header_version(header));
+    exit(EXIT_FAILURE);
+  }
+  if(*header_page_size(header) != PAGE_SIZE){
+    printf("page size %d does not match %d\n", *header_page_size(header), PAGE_SIZE);
+    exit(EXIT_FAILURE);
+  }
+  if(*header_checksum(header) != header_compute_checksum(header)){
+    printf("corrupt header\n");
+    exit(EXIT_FAILURE);
+  }
+  //文件可能比记的页数长（mmap预分配的尾部，导入到一半崩溃），多出来的页当作没用过
+  uint32_t page_count = *header_page_count(header);
+  if(page_count < 2 || page_count > pager->num_pages){
+    printf("file is truncated: %d of %d pages\n", pager->num_pages, page_count);
+    exit(EXIT_FAILURE);
+  }
+  for(uint32_t tree = 0; tree < HEADER_TREES; tree++){
+    if(*header_tree_root(header, tree) >= page_count){
+      printf("corrupt header\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  if(*header_tree_root(header, HEADER_TREE_PRIMARY) == 0 || *header_free_head(header) >= page_count){
+    printf("corrupt header\n");
+    exit(EXIT_FAILURE);
+  }
+
+  pager->num_pages = page_count;
+  pager->row_count = *header_row_count(header);
+  table->root_page_num = *header_tree_root(header, HEADER_TREE_PRIMARY);
+  for(uint32_t c = 0; c < INDEX_COLUMNS; c++){
+    uint32_t root_page_num = *header_tree_root(header, HEADER_TREE_PRIMARY + 1 + c);
+    if(root_page_num != 0){
+      table->indexes[c] = index_open(table, c, root_page_num);
+    }
+  }
+
+  bool checksums = *header_flags(header) & HEADER_FLAG_CHECKSUMS;
+  pager_unpin(pager, HEADER_PAGE_NUM);
+  if(checksums && pager->checksum_file_descriptor == -1){
+    printf("checksum file is missing\n");
+    exit(EXIT_FAILURE);
+  }
+  if(!checksums && pager->checksum_file_descriptor != -1){
+    if(config->checksums){
+      checksum_enable(pager);
+    }else{
+      close(pager->checksum_file_descriptor);
+      pager->checksum_file_descriptor = -1;
+    }
+  }
+}
+
+//create index on：先在新的根页上把索引建好，最后才把根登记到文件头
+//建的过程中会中途提交，崩溃时留下的只是没人引用的页
+ExecuteResult execute_create_index(Statement* statement, Table* table){
+  Pager* pager = table->pager;
+  IndexColumn column = statement->index_column;
+  if(table->indexes[column] != NULL){
+    return EXECUTE_INDEX_EXISTS;
+  }
+
+  uint32_t root_page_num = get_unused_page_num(pager);
+  void* root = get_page(pager, root_page_num);
+  pager_mark_dirty(pager, root_page_num);
+  initialize_leaf_node(root);
+  set_node_root(root, true);
+  *node_parent(root) = 0;
+  pager_unpin(pager, root_page_num);
+  Table* index = index_open(table, column, root_page_num);
+  void* header = get_page(pager, HEADER_PAGE_NUM);
+  pager_mark_dirty(pager, HEADER_PAGE_NUM);
+  *header_tree_height(header, index->tree) = 1;
+  pager_unpin(pager, HEADER_PAGE_NUM);
+  index_build(table, index, column);
+
+  header = get_page(pager, HEADER_PAGE_NUM);
+  pager_mark_dirty(pager, HEADER_PAGE_NUM);
+  *header_tree_root(header, index->tree) = root_page_num;
+  pager_unpin(pager, HEADER_PAGE_NUM);
+
+  __atomic_store_n(&table->indexes[column], index, __ATOMIC_RELEASE);
+  return EXECUTE_SUCCESS;
+}
+
+//叶子里key对应的cell下标，索引树还要比对记录里的主键id，没有时返回num_cells
+//索引树里key相同的项可能延续到后面的叶子，这里只看当前叶子
+uint32_t leaf_node_find_cell(void* node, uint32_t key, const uint32_t* index_id){
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  uint32_t i = key_search(leaf_node_keys(node), num_cells, key);
+  while(i < num_cells && *leaf_node_key(node, i) == key){
+    if(index_id == NULL || index_record_id(leaf_node_record(node, i)) == *index_id){
+      return i;
+    }
+    i++;
+  }
+  return num_cells;
+}
+
+//删一个cell或者少一个key之后还不会欠满，叶子按最大的记录估计
+bool node_delete_safe(void* node){
+  if(get_node_type(node) == NODE_LEAF){
+    return leaf_node_used_space(node) >= LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_MIN_FILL_DIVISOR +
+                                         LEAF_NODE_MAX_RECORD_SIZE + LEAF_NODE_SLOT_SIZE;
+  }
+  return *internal_node_num_keys(node) > INTERNAL_NODE_MIN_KEYS;
+}
+
+//根节点不算欠满，空的根叶子和只有一个key的根都是合法的
+bool node_underfull(void* node){
+  if(is_node_root(node)){
+    return false;
+  }
+  if(get_node_type(node) == NODE_LEAF){
+    return leaf_node_used_space(node) < LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_MIN_FILL_DIVISOR;
+  }
+  return *internal_node_num_keys(node) < INTERNAL_NODE_MIN_KEYS;
+}
+
+//删除的悲观路径上的一层
+typedef struct {
+  uint32_t page_num;
+  //和它配对的兄弟（同一个父节点下相邻的孩子），INVALID_PAGE_NUM表示没有锁兄弟
+  uint32_t sibling_page_num;
+  //这一对里左边那个在父节点里的下标
+  uint32_t left_index;
+} DeletePathLevel;
+
+//悲观删除要锁住的路径：写者只有一个，父指针在这期间不会变
+//先顺着父指针记下根到leaf_page_num的页号，再从根开始沿着它一路加排他latch
+//每层连同配对的兄弟一起锁，同一层总是先左后右，和读者沿叶子链往右的方向一致
+//孩子删掉一个cell（或者少一个key）也不会欠满时，上面的祖先和兄弟都不会被改，可以放开
+//返回叶子所在的层，path[0..depth]从上到下仍然锁着，path[depth]是叶子
+uint32_t table_find_delete(Table* table, uint32_t leaf_page_num, uint32_t key, DeletePathLevel* path){
+  Pager* pager = table->pager;
+  uint32_t pages[BTREE_MAX_DEPTH];
+  uint32_t num_pages = 0;
+  uint32_t page_num = leaf_page_num;
+  while(true){
+    if(num_pages == BTREE_MAX_DEPTH){
+      printf("btree too deep\n");
+      exit(EXIT_FAILURE);
+    }
+    pages[num_pages++] = page_num;
+    void* node = get_page(pager, page_num);
+    bool is_root = is_node_root(node);
+    uint32_t parent_page_num = *node_parent(node);
+    pager_unpin(pager, page_num);
+    if(is_root){
+      break;
+    }
+    page_num = parent_page_num;
+  }
+
+  uint32_t depth = 0;
+  path[0].page_num = pages[num_pages - 1];
+  path[0].sibling_page_num = INVALID_PAGE_NUM;
+  path[0].left_index = 0;
+  void* node = pager_acquire(pager, path[0].page_num, LATCH_EXCLUSIVE);
+  for(uint32_t i = num_pages - 1; i > 0; i--){
+    uint32_t child_page_num = pages[i - 1];
+    uint32_t num_keys = *internal_node_num_keys(node);
+    uint32_t index = internal_node_child_index(node, child_page_num, key);
+    if(*internal_node_child(node, index) != child_page_num){
+      printf("corrupt parent pointer on page %d\n", child_page_num);
+      exit(EXIT_FAILURE);
+    }
+
+    //和右边的兄弟配对，最右的孩子和左边的配对
+    uint32_t sibling_page_num = INVALID_PAGE_NUM;
+    uint32_t left_index = index;
+    if(index < num_keys){
+      sibling_page_num = *internal_node_child(node, index + 1);
+    }else if(num_keys > 0){
+      left_index = index - 1;
+      sibling_page_num = *internal_node_child(node, left_index);
+      pager_acquire(pager, sibling_page_num, LATCH_EXCLUSIVE);
+    }
+    void* child = pager_acquire(pager, child_page_num, LATCH_EXCLUSIVE);
+    if(index < num_keys){
+      pager_acquire(pager, sibling_page_num, LATCH_EXCLUSIVE);
+    }
+    depth++;
+    path[depth].page_num = child_page_num;
+    path[depth].sibling_page_num = sibling_page_num;
+    path[depth].left_index = left_index;
+
+    if(node_delete_safe(child)){
+      for(uint32_t l = 0; l <= depth; l++){
+        if(l < depth){
+          pager_release(pager, path[l].page_num);
+        }
+        if(path[l].sibling_page_num != INVALID_PAGE_NUM){
+          pager_release(pager, path[l].sibling_page_num);
+        }
+      }
+      path[0].page_num = child_page_num;
+      path[0].sibling_page_num = INVALID_PAGE_NUM;
+      depth = 0;
+    }
+    node = child;
+  }
+  return depth;
+}
+
+//去掉父节点里第index个key和它右边的孩子，左边的孩子接管合并后的范围
+void internal_node_remove(void* node, uint32_t index){
+  uint32_t num_keys = *internal_node_num_keys(node);
+  if(index + 1 == num_keys){
+    *internal_node_right_child(node) = *internal_node_child(node, index);
+  }else{
+    memmove(internal_node_keys(node) + index, internal_node_keys(node) + index + 1,
+            (num_keys - index - 1) * INTERNAL_NODE_KEY_SIZE);
+    memmove(internal_node_children(node) + index + 1, internal_node_children(node) + index + 2,
+            (num_keys - index - 2) * INTERNAL_NODE_CHILD_SIZE);
+  }
+  memmove(internal_node_counts(node) + index + 1, internal_node_counts(node) + index + 2,
+          (num_keys - index - 1) * INTERNAL_NODE_COUNT_SIZE);
+  *internal_node_num_keys(node) = num_keys - 1;
+}
+
+//两个相邻叶子：合起来放得下一页就都并进左边，返回true
+//否则按字节对半重新分配，新的分隔key写到*separator，返回false
+bool leaf_node_rebalance(void* left, void* right, uint32_t* separator){
+  uint8_t left_snapshot[PAGE_SIZE];
+  uint8_t right_snapshot[PAGE_SIZE];
+  memcpy(left_snapshot, left, PAGE_SIZE);
+  memcpy(right_snapshot, right, PAGE_SIZE);
+  uint32_t num_left = *leaf_node_num_cells(left_snapshot);
+  uint32_t total = num_left + *leaf_node_num_cells(right_snapshot);
+  uint32_t keys[2 * LEAF_NODE_MAX_CELLS];
+  void* records[2 * LEAF_NODE_MAX_CELLS];
+  uint32_t sizes[2 * LEAF_NODE_MAX_CELLS];
+  uint32_t total_bytes = 0;
+  for(uint32_t i = 0; i < total; i++){
+    void* snapshot = i < num_left ? left_snapshot : right_snapshot;
+    uint32_t j = i < num_left ? i : i - num_left;
+    keys[i] = *leaf_node_key(snapshot, j);
+    records[i] = leaf_node_record(snapshot, j);
+    sizes[i] = record_size(records[i]);
+    total_bytes += sizes[i] + LEAF_NODE_SLOT_SIZE;
+  }
+
+  uint32_t left_count = total;
+  if(total_bytes > LEAF_NODE_SPACE_FOR_CELLS){
+    uint32_t left_bytes = 0;
+    left_count = 0;
+    while(left_count < total - 1 && left_bytes < total_bytes / 2){
+      left_bytes += sizes[left_count] + LEAF_NODE_SLOT_SIZE;
+      left_count++;
+    }
+  }
+  leaf_node_reset(left);
+  leaf_node_reset(right);
+  for(uint32_t i = 0; i < total; i++){
+    void* destination_node = i < left_count ? left : right;
+    uint32_t index_within_node = i < left_count ? i : i - left_count;
+    leaf_node_insert_cell(destination_node, index_within_node, keys[i], records[i], sizes[i]);
+  }
+  if(left_count == total){
+    *leaf_node_next_leaf(left) = *leaf_node_next_leaf(right_snapshot);
+    return true;
+  }
+  *separator = keys[left_count - 1];
+  return false;
+}
+
+//两个相邻中间节点：连同父节点里的分隔key一起合并或者重新分配，返回值和leaf_node_rebalance一样
+//换了节点的孩子要改父指针
+bool internal_node_rebalance(Pager* pager, uint32_t left_page_num, void* left,
+                             uint32_t right_page_num, void* right, uint32_t* separator){
+  uint32_t keys[2 * INTERNAL_NODE_MAX_CELLS + 1];
+  uint32_t children[2 * INTERNAL_NODE_MAX_CELLS + 2];
+  uint32_t counts[2 * INTERNAL_NODE_MAX_CELLS + 2];
+  uint32_t count = 0;
+  uint32_t num_left = *internal_node_num_keys(left);
+  uint32_t num_right = *internal_node_num_keys(right);
+  memcpy(keys, internal_node_keys(left), num_left * INTERNAL_NODE_KEY_SIZE);
+  memcpy(children, internal_node_children(left), num_left * INTERNAL_NODE_CHILD_SIZE);
+  memcpy(counts, internal_node_counts(left), (num_left + 1) * INTERNAL_NODE_COUNT_SIZE);
+  count = num_left;
+  keys[count] = *separator;
+  children[count] = *internal_node_right_child(left);
+  count++;
+  memcpy(keys + count, internal_node_keys(right), num_right * INTERNAL_NODE_KEY_SIZE);
+  memcpy(children + count, internal_node_children(right), num_right * INTERNAL_NODE_CHILD_SIZE);
+  memcpy(counts + count, internal_node_counts(right), (num_right + 1) * INTERNAL_NODE_COUNT_SIZE);
+  count += num_right;
+  children[count] = *internal_node_right_child(right);
+
+  if(count <= INTERNAL_NODE_MAX_CELLS){
+    internal_node_fill(left, keys, children, counts, count);
+    for(uint32_t i = num_left + 1; i <= count; i++){
+      set_node_parent(pager, children[i], left_page_num);
+    }
+    return true;
+  }
+
+  uint32_t left_count = count / 2;
+  internal_node_fill(left, keys, children, counts, left_count);
+  internal_node_fill(right, keys + left_count + 1, children + left_count + 1, counts + left_count + 1,
+                     count - left_count - 1);
+  *separator = keys[left_count];
+  for(uint32_t i = 0; i <= count; i++){
+    set_node_parent(pager, children[i], i <= left_count ? left_page_num : right_page_num);
+  }
+  return false;
+}
+
+//parent里第left_index和left_index+1个孩子（调用方都已经锁着）有一个欠满：
+//合并时右边的页放回free list，父节点少一个key，返回true；重新分配时只改分隔key，返回false
+bool node_rebalance(Table* table, uint32_t parent_page_num, uint32_t left_index){
+  Pager* pager = table->pager;
+  void* parent = get_page(pager, parent_page_num);
+  uint32_t left_page_num = *internal_node_child(parent, left_index);
+  uint32_t right_page_num = *internal_node_child(parent, left_index + 1);
+  void* left = get_page(pager, left_page_num);
+  void* right = get_page(pager, right_page_num);
+  pager_mark_dirty(pager, parent_page_num);
+  pager_mark_dirty(pager, left_page_num);
+  pager_mark_dirty(pager, right_page_num);
+
+  uint32_t* separator = internal_node_key(parent, left_index);
+  bool merged;
+  if(get_node_type(left) == NODE_LEAF){
+    merged = leaf_node_rebalance(left, right, separator);
+  }else{
+    merged = internal_node_rebalance(pager, left_page_num, left, right_page_num, right, separator);
+  }
+  //两边的行数按重新分配后的内容重算，合并时右边那格随着internal_node_remove去掉
+  *internal_node_count(parent, left_index) = node_row_count(left);
+  *internal_node_count(parent, left_index + 1) = node_row_count(right);
+  if(merged){
+    stats_add(STAT_MERGES, 1);
+    internal_node_remove(parent, left_index);
+    pager_free_page(pager, right_page_num);
+    table->rightmost_leaf_page_num = INVALID_PAGE_NUM;
+  }
+  pager_unpin(pager, right_page_num);
+  pager_unpin(pager, left_page_num);
+  pager_unpin(pager, parent_page_num);
+  return merged;
+}
+
+//根只剩一个孩子时把孩子拷到根页上，树矮一层，孩子原来的页放回free list
+void root_collapse(Table* table){
+  Pager* pager = table->pager;
+  void* root = get_page(pager, table->root_page_num);
+  if(get_node_type(root) != NODE_INTERNAL || *internal_node_num_keys(root) > 0){
+    pager_unpin(pager, table->root_page_num);
+    return;
+  }
+  uint32_t child_page_num = *internal_node_right_child(root);
+  void* child = get_page(pager, child_page_num);
+  pager_mark_dirty(pager, table->root_page_num);
+
+  memcpy(root, child, PAGE_SIZE);
+  set_node_root(root, true);
+  *node_parent(root) = 0;
+  if(get_node_type(root) == NODE_INTERNAL){
+    uint32_t num_keys = *internal_node_num_keys(root);
+    for(uint32_t i = 0; i <= num_keys; i++){
+      set_node_parent(pager, *internal_node_child(root, i), table->root_page_num);
+    }
+  }
+  pager_unpin(pager, child_page_num);
+  pager_free_page(pager, child_page_num);
+  table->rightmost_leaf_page_num = INVALID_PAGE_NUM;
+  pager_unpin(pager, table->root_page_num);
+  table_add_height(table, -1);
+}
+
+//悲观删除：锁住路径删掉cell，再自底向上处理欠满的节点，直到某一层不再欠满
+void table_delete_rebalance(Table* table, uint32_t leaf_page_num, uint32_t key, const uint32_t* index_id){
+  Pager* pager = table->pager;
+  DeletePathLevel path[BTREE_MAX_DEPTH];
+  uint32_t depth = table_find_delete(table, leaf_page_num, key, path);
+
+  void* leaf = get_page(pager, leaf_page_num);
+  uint32_t cell_num = leaf_node_find_cell(leaf, key, index_id);
+  bool deleted = cell_num < *leaf_node_num_cells(leaf);
+  if(deleted){
+    pager_mark_dirty(pager, leaf_page_num);
+    leaf_node_delete_cell(leaf, cell_num);
+  }
+  pager_unpin(pager, leaf_page_num);
+
+  //合并或者重新分配过的一层，父节点里两边的行数已经重算；stale是第一个在父节点里还多算一行的节点
+  uint32_t stale_page_num = leaf_page_num;
+  for(uint32_t level = depth; level > 0; level--){
+    void* node = get_page(pager, path[level].page_num);
+    bool underfull = node_underfull(node);
+    pager_unpin(pager, path[level].page_num);
+    if(!underfull || path[level].sibling_page_num == INVALID_PAGE_NUM){
+      break;
+    }
+    bool merged = node_rebalance(table, path[level - 1].page_num, path[level].left_index);
+    stale_page_num = path[level - 1].page_num;
+    if(!merged){
+      break;
+    }
+  }
+  if(path[0].page_num == table->root_page_num){
+    root_collapse(table);
+  }
+
+  for(uint32_t level = 0; level <= depth; level++){
+    pager_release(pager, path[level].page_num);
+    if(path[level].sibling_page_num != INVALID_PAGE_NUM){
+      pager_release(pager, path[level].sibling_page_num);
+    }
+  }
+  if(deleted){
+    tree_add_count(table, stale_page_num, key, -1);
+  }
+}
+
+//删一个cell：先乐观地只锁叶子，删完不会欠满就原地删掉；否则走悲观路径
+//索引树里key相同的项可能在后面的叶子里，沿着叶子链往右找，直到碰到更大的key
+//删除后分隔key可能比左边叶子实际的最大key大，所以不能只看叶子最后一个key是否相等
+//返回是否找到
+bool table_delete(Table* table, uint32_t key, const uint32_t* index_id){
+  uint32_t upper_bound;
+  Cursor* cursor = table_find_bounded(table, key, LATCH_EXCLUSIVE, &upper_bound);
+  uint32_t cell_num;
+  while(true){
+    void* node = cursor->node;
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    cell_num = leaf_node_find_cell(node, key, index_id);
+    if(cell_num < num_cells){
+      break;
+    }
+    if(index_id == NULL || (num_cells > 0 && *leaf_node_key(node, num_cells - 1) > key)){
+      cursor_close(cursor);
+      return false;
+    }
+    cursor_next_leaf(cursor);
+    if(cursor->end_of_table){
+      cursor_close(cursor);
+      return false;
+    }
+  }
+
+  void* node = cursor->node;
+  uint32_t size = record_size(leaf_node_record(node, cell_num)) + LEAF_NODE_SLOT_SIZE;
+  if(is_node_root(node) ||
+     leaf_node_used_space(node) - size >= LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_MIN_FILL_DIVISOR){
+    uint32_t leaf_page_num = cursor->page_num;
+    pager_mark_dirty(table->pager, leaf_page_num);
+    leaf_node_delete_cell(node, cell_num);
+    cursor_close(cursor);
+    tree_add_count(table, leaf_page_num, key, -1);
+    return true;
+  }
+  uint32_t leaf_page_num = cursor->page_num;
+  cursor_close(cursor);
+  table_delete_rebalance(table, leaf_page_num, key, index_id);
+  return true;
+}
+
+//删掉主表里的一行，连同它在各个索引里的项
+bool table_delete_row(Table* table, uint32_t id){
+  Row row;
+  if(!table_get(table, id, &row)){
+    return false;
+  }
+  table_delete(table, id, NULL);
+  table->pager->row_count--;
+  for(uint32_t c = 0; c < INDEX_COLUMNS; c++){
+    if(table->indexes[c] != NULL){
+      const char* value = row_column(&row, c);
+      table_delete(table->indexes[c], string_hash(value, strlen(value)), &id);
+    }
+  }
+  return true;
+}
+
+ExecuteResult execute_insert(Statement* statement, Table* table){
+  Row* row_to_insert = &(statement->row_to_insert);
+  uint32_t key_to_insert = row_to_insert->id;
+  uint32_t upper_bound;
+  Cursor* cursor = table_find_insert(table, key_to_insert, &upper_bound);
+
+  void * node = cursor->node;
+  uint32_t num_cells = *leaf_node_num_cells(node);
+
+  //插入的key已经存在
+  if(cursor->cell_num < num_cells){
+    uint32_t key_at_index = *leaf_node_key(node, cursor->cell_num);
+    if(key_at_index == key_to_insert){
+      cursor_close(cursor);
+      return EXECUTE_DUPLICATE_KEY;
+    }
+  }
+
+  uint8_t record[LEAF_NODE_MAX_RECORD_SIZE];
+  uint32_t size = serialize_row(row_to_insert, record);
+  uint32_t leaf_page_num = cursor->page_num;
+  bool inserted = leaf_node_insert(cursor, key_to_insert, record, size);
+  cursor_close(cursor);
+  if(inserted){
+    tree_add_count(table, leaf_page_num, key_to_insert, 1);
+  }else{
+    table_insert_split(table, key_to_insert, record, size);
+  }
+  table->pager->row_count++;
+  table_index_row(table, row_to_insert);
+  return EXECUTE_SUCCESS;
+}
+
+int compare_row_id(const void* a, const void* b){
+  uint32_t x = ((const Row*)a)->id;
+  uint32_t y = ((const Row*)b)->id;
+  return (x > y) - (x < y);
+}
+
+//批量插入：rows会被就地按id排序，已存在的id跳过并计入num_duplicates，返回插入的行数
+//每个目标叶子只往下找一次，落在它上界以内的行依次插进去
+//叶子放不下时这一行走悲观路径分裂，再从下一行重新定位
+//修改的页太多时中途提交，所以很大的批次不是一个原子的事务
+uint32_t table_insert_batch(Table* table, Row* rows, uint32_t num_rows, uint32_t* num_duplicates){
+  Pager* pager = table->pager;
+  qsort(rows, num_rows, sizeof(Row), compare_row_id);
+
+  uint32_t num_inserted = 0;
+  *num_duplicates = 0;
+  uint32_t i = 0;
+  uint8_t record[LEAF_NODE_MAX_RECORD_SIZE];
+  while(i < num_rows){
+    uint32_t upper_bound;
+    Cursor* cursor = table_find_insert(table, rows[i].id, &upper_bound);
+    void* node = cursor->node;
+    uint32_t leaf_page_num = cursor->page_num;
+    uint32_t leaf_key = rows[i].id;
+    uint32_t leaf_inserted = 0;
+    bool dirty = false;
+    bool full = false;
+    uint32_t size = 0;
+
+    while(i < num_rows && rows[i].id <= upper_bound){
+      uint32_t key = rows[i].id;
+      uint32_t num_cells = *leaf_node_num_cells(node);
+      uint32_t index = key_search(leaf_node_keys(node), num_cells, key);
+      if(index < num_cells && *leaf_node_key(node, index) == key){
+        (*num_duplicates)++;
+        i++;
+        continue;
+      }
+
+      size = serialize_row(&rows[i], record);
+      uint32_t needed = size + LEAF_NODE_SLOT_SIZE;
+      uint32_t free_space = leaf_node_free_space(node);
+      if(free_space < needed && free_space + *leaf_node_fragmented(node) < needed){
+        full = true;
+        break;
+      }
+
+      if(!dirty){
+        pager_mark_dirty(pager, cursor->page_num);
+        dirty = true;
       }
+      if(free_space < needed){
+        leaf_node_compact(node);
+      }
+      leaf_node_insert_cell(node, index, key, record, size);
+      table_index_row(table, &rows[i]);
+      pager->row_count++;
+      num_inserted++;
+      leaf_inserted++;
+      i++;
+    }
+
+    cursor_close(cursor);
+    //这个叶子插了几行，祖先的行数一次加上
+    if(leaf_inserted > 0){
+      tree_add_count(table, leaf_page_num, leaf_key, leaf_inserted);
+    }
+    if(full){
+      table_insert_split(table, rows[i].id, record, size);
+      table_index_row(table, &rows[i]);
+      pager->row_count++;
+      num_inserted++;
+      i++;
+    }
+
+    if(pager_txn_full(pager)){
+      pager_commit(pager);
+    }
+  }
+  return num_inserted;
+}
+
+ExecuteResult execute_insert_batch(Statement* statement, Table* table){
+  uint32_t num_duplicates;
+  table_insert_batch(table, statement->rows, statement->num_rows, &num_duplicates);
+  if(num_duplicates > 0){
+    fprintf(table_diagnostics(table), "skipped %d duplicate keys\n", num_duplicates);
+  }
+  return EXECUTE_SUCCESS;
+}
+
+//两位一组查表的十进制格式化，返回写了几个字节
+const char DECIMAL_PAIRS[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+uint32_t format_uint64(char* out, uint64_t value){
+  char digits[20];
+  uint32_t n = sizeof(digits);
+  while(value >= 100){
+    uint32_t pair = value % 100;
+    value /= 100;
+    n -= 2;
+    memcpy(digits + n, DECIMAL_PAIRS + 2 * pair, 2);
+  }
+  if(value >= 10){
+    n -= 2;
+    memcpy(digits + n, DECIMAL_PAIRS + 2 * value, 2);
+  }else{
+    digits[--n] = '0' + value;
+  }
+  uint32_t length = sizeof(digits) - n;
+  memcpy(out, digits + n, length);
+  return length;
+}
+
+//select的行先攒在一块缓冲区里，满了才一次fwrite，缓冲区从语句的arena里拿，同一个线程反复用
+//行直接从叶子上的记录格式化，不解码成Row
+#define RESULT_SINK_BUFFER_SIZE (1U << 16)
+//一行最长的输出：CSV里两个字符串全是引号时长度翻倍，再加上id、分隔符和换行
+#define RESULT_SINK_MAX_ROW (2 * LEAF_NODE_MAX_RECORD_SIZE + 32)
+
+typedef struct {
+  OutputFormat format;
+  char* buffer;
+  uint32_t length;
+} ResultSink;
+
+void result_sink_open(ResultSink* sink, OutputFormat format){
+  sink->format = format;
+  sink->buffer = arena_alloc(&thread_arena, RESULT_SINK_BUFFER_SIZE);
+  sink->length = 0;
+}
+
+//和printf共用stdout，提示符和executed.不会和结果交错
+void result_sink_flush(ResultSink* sink){
+  if(sink->length > 0 && fwrite(sink->buffer, 1, sink->length, stdout) != sink->length){
+    printf("write error\n");
+    exit(EXIT_FAILURE);
+  }
+  sink->length = 0;
+}
+
+//长度不超过255时gcc会把memcpy内联成rep movs，短字符串上比libc的memcpy慢得多
+__attribute__((noinline))
+uint32_t format_bytes(char* out, const uint8_t* value, uint32_t length){
+  memcpy(out, value, length);
+  return length;
+}
+
+//CSV字段里有逗号、引号或者换行时整个字段加引号，里面的引号写两遍
+uint32_t format_csv_field(char* out, const uint8_t* value, uint32_t length){
+  bool quote = false;
+  for(uint32_t i = 0; i < length && !quote; i++){
+    quote = value[i] == ',' || value[i] == '"' || value[i] == '\n' || value[i] == '\r' || value[i] == '\t';
+  }
+  if(!quote){
+    return format_bytes(out, value, length);
+  }
+  char* p = out;
+  *p++ = '"';
+  for(uint32_t i = 0; i < length; i++){
+    if(value[i] == '"'){
+      *p++ = '"';
+    }
+    *p++ = value[i];
+  }
+  *p++ = '"';
+  return p - out;
+}
+
+//record是叶子上的记录：两个长度字节后面跟username和email
+//二进制格式每行是4字节的长度，后面跟4字节id和原样的记录，字节序和数据文件一样
+void result_sink_row(ResultSink* sink, uint32_t id, const uint8_t* record){
+  if(sink->length + RESULT_SINK_MAX_ROW > RESULT_SINK_BUFFER_SIZE){
+    result_sink_flush(sink);
+  }
+  uint32_t username_length = record[0];
+  uint32_t email_length = record[1];
+  const uint8_t* username = record + LEAF_NODE_RECORD_HEADER_SIZE;
+  const uint8_t* email = username + username_length;
+  char* out = sink->buffer + sink->length;
+  char* p = out;
+  switch(sink->format){
+    case(OUTPUT_TEXT):
+      *p++ = '(';
+      p += format_uint64(p, id);
+      memcpy(p, ", ", 2);
+      p += 2 + format_bytes(p + 2, username, username_length);
+      memcpy(p, ", ", 2);
+      p += 2 + format_bytes(p + 2, email, email_length);
+      memcpy(p, ")\n", 2);
+      p += 2;
       break;
-    case(NODE_INTERNAL):
-      num_keys = *internal_node_num_keys(node);
-      indent(indentation_level);
-      printf("- internal (size %d)\n", num_keys);
-      for(uint32_t i = 0; i < num_keys ; i++){
-        child = *internal_node_child(node, i);
-        print_tree(pager, child, indentation_level+1);
+    case(OUTPUT_CSV):
+      p += format_uint64(p, id);
+      *p++ = ',';
+      p += format_csv_field(p, username, username_length);
+      *p++ = ',';
+      p += format_csv_field(p, email, email_length);
+      *p++ = '\n';
+      break;
+    case(OUTPUT_BINARY): {
+      uint32_t size = sizeof(uint32_t) + LEAF_NODE_RECORD_HEADER_SIZE + username_length + email_length;
+      memcpy(p, &size, sizeof(uint32_t));
+      memcpy(p + sizeof(uint32_t), &id, sizeof(uint32_t));
+      format_bytes(p + 2 * sizeof(uint32_t), record, size - sizeof(uint32_t));
+      p += sizeof(uint32_t) + size;
+      break;
+    }
+  }
+  sink->length += p - out;
+}
 
-        indent(indentation_level+1);
-        printf(" - key %d\n", *internal_node_key(node, i));
+//扫描线程各自的部分聚合结果，最后合并
+//列值：id取key，字符串长度直接读记录头，不用解码整行
+typedef struct {
+  uint64_t count;
+  uint64_t sum[AGGREGATE_COLUMNS];
+  uint32_t min[AGGREGATE_COLUMNS];
+  uint32_t max[AGGREGATE_COLUMNS];
+} AggregateState;
+
+void aggregate_init(AggregateState* state){
+  state->count = 0;
+  for(uint32_t c = 0; c < AGGREGATE_COLUMNS; c++){
+    state->sum[c] = 0;
+    state->min[c] = UINT32_MAX;
+    state->max[c] = 0;
+  }
+}
+
+void aggregate_add(AggregateState* state, uint32_t values[AGGREGATE_COLUMNS]){
+  state->count++;
+  for(uint32_t c = 0; c < AGGREGATE_COLUMNS; c++){
+    state->sum[c] += values[c];
+    if(values[c] < state->min[c]){
+      state->min[c] = values[c];
+    }
+    if(values[c] > state->max[c]){
+      state->max[c] = values[c];
+    }
+  }
+}
+
+void aggregate_merge(AggregateState* state, AggregateState* other){
+  state->count += other->count;
+  for(uint32_t c = 0; c < AGGREGATE_COLUMNS; c++){
+    state->sum[c] += other->sum[c];
+    if(other->min[c] < state->min[c]){
+      state->min[c] = other->min[c];
+    }
+    if(other->max[c] > state->max[c]){
+      state->max[c] = other->max[c];
+    }
+  }
+}
+
+//并行扫描的一段，闭区间
+typedef struct {
+  uint32_t key_min;
+  uint32_t key_max;
+} ScanSlice;
+
+//filter为NULL时不过滤，所有线程读同一个快照
+typedef struct {
+  Table* table;
+  Snapshot* snapshot;
+  ColumnFilter* filter;
+  ScanSlice* slices;
+  uint32_t num_slices;
+  uint32_t next_slice;
+} ScanJob;
+
+typedef struct {
+  ScanJob* job;
+  AggregateState state;
+} ScanWorker;
+
+//从slice的起点seek下去，直接在叶子的key数组和记录头上累加，扫到key_max为止
+//列值过滤也直接比对记录里的字节
+void scan_slice_aggregate(Table* table, Snapshot* snapshot, ScanSlice* slice, ColumnFilter* filter,
+                          AggregateState* state){
+  Cursor* cursor = table_seek_at(table, snapshot, slice->key_min);
+  bool done = false;
+  while(!done && !cursor->end_of_table){
+    void* node = cursor->node;
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    uint32_t* keys = leaf_node_keys(node);
+    for(uint32_t i = cursor->cell_num; i < num_cells; i++){
+      if(keys[i] > slice->key_max){
+        done = true;
+        break;
       }
-      child = *internal_node_right_child(node);
-      print_tree(pager, child, indentation_level+1);
+      uint8_t* record = leaf_node_record(node, i);
+      if(filter != NULL && !record_field_equals(record, filter->column, filter->value)){
+        continue;
+      }
+      uint32_t values[AGGREGATE_COLUMNS] = {keys[i], record[0], record[1]};
+      aggregate_add(state, values);
+    }
+    if(!done){
+      cursor_next_leaf(cursor);
+    }
+  }
+  cursor_close(cursor);
+}
+
+//每个线程从共享的计数器领下一段，直到领完
+void scan_worker(ScanWorker* worker){
+  ScanJob* job = worker->job;
+  while(true){
+    uint32_t i = __atomic_fetch_add(&job->next_slice, 1, __ATOMIC_RELAXED);
+    if(i >= job->num_slices){
+      return;
+    }
+    scan_slice_aggregate(job->table, job->snapshot, &job->slices[i], job->filter, &worker->state);
+  }
+}
+
+//新开的扫描线程退出前放掉自己的arena；调用线程的arena留给之后的语句接着用
+void* scan_thread(void* arg){
+  scan_worker(arg);
+  arena_free(&thread_arena);
+  return NULL;
+}
+
+//从根开始一层层收集落在[id_min, id_max)里的分隔key，够切max_slices段或者到了叶子就停
+//分隔key只用来切段，各段拼起来总是完整的区间；和扫描用同一个快照，切出来的段和要扫的树对得上
+//返回切出的段数
+uint32_t scan_split(Table* table, Snapshot* snapshot, uint32_t id_min, uint32_t id_max,
+                    ScanSlice* slices, uint32_t max_slices){
+  Pager* pager = table->pager;
+  uint32_t* points = malloc(sizeof(uint32_t) * SCAN_MAX_SPLIT_POINTS);
+  uint32_t* next_points = malloc(sizeof(uint32_t) * SCAN_MAX_SPLIT_POINTS);
+  uint32_t* level = malloc(sizeof(uint32_t) * (SCAN_MAX_SPLIT_POINTS + 1));
+  uint32_t* next_level = malloc(sizeof(uint32_t) * (SCAN_MAX_SPLIT_POINTS + 1));
+  uint32_t num_points = 0;
+  uint32_t level_size = 1;
+  level[0] = snapshot->roots[table->tree];
+
+  while(num_points + 1 < max_slices){
+    uint32_t num_next_points = 0;
+    uint32_t num_next = 0;
+    bool stop = false;
+    for(uint32_t l = 0; l < level_size && !stop; l++){
+      void* node = pager_acquire_snapshot(pager, level[l], snapshot);
+      if(get_node_type(node) == NODE_LEAF){
+        pager_release(pager, level[l]);
+        stop = true;
+        break;
+      }
+      //孩子k管(keys[k-1], keys[k]]，只往下看和范围有交集的孩子
+      uint32_t num_keys = *internal_node_num_keys(node);
+      uint32_t* keys = internal_node_keys(node);
+      for(uint32_t k = 0; k <= num_keys; k++){
+        if((k < num_keys && keys[k] < id_min) || (k > 0 && keys[k - 1] >= id_max)){
+          continue;
+        }
+        if(num_next > SCAN_MAX_SPLIT_POINTS || num_next_points == SCAN_MAX_SPLIT_POINTS){
+          stop = true;
+          break;
+        }
+        next_level[num_next++] = *internal_node_child(node, k);
+        if(k < num_keys && keys[k] < id_max){
+          next_points[num_next_points++] = keys[k];
+        }
+      }
+      pager_release(pager, level[l]);
+    }
+    if(stop){
       break;
+    }
+
+    uint32_t* swap = points;
+    points = next_points;
+    next_points = swap;
+    num_points = num_next_points;
+    swap = level;
+    level = next_level;
+    next_level = swap;
+    level_size = num_next;
+  }
+
+  //从切分点里均匀挑出max_slices-1个
+  uint32_t num_slices = num_points + 1 < max_slices ? num_points + 1 : max_slices;
+  uint32_t key_min = id_min;
+  for(uint32_t j = 1; j < num_slices; j++){
+    uint32_t point = points[(uint64_t)j * (num_points + 1) / num_slices - 1];
+    slices[j - 1].key_min = key_min;
+    slices[j - 1].key_max = point;
+    key_min = point + 1;
   }
+  slices[num_slices - 1].key_min = key_min;
+  slices[num_slices - 1].key_max = id_max;
+
+  free(points);
+  free(next_points);
+  free(level);
+  free(next_level);
+  return num_slices;
 }
 
-void print_constants(){
-  printf("ROW_SIZE: %d\n", ROW_SIZE);
-  printf("COMMON_NODE_HEAGER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
-  printf("LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
-  printf("LEAF_NODE_CELL_SIZE: %d\n", LEAF_NODE_CELL_SIZE);
-  printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
-  printf("LEAF_NODE_MAX_CELLS: %d\n", LEAF_NODE_MAX_CELLS);
+//并行聚合[id_min, id_max]里满足filter的行：切段后开scan_threads-1个线程，调用线程自己也干活，最后合并
+//整个聚合读同一个快照，和写线程并发时结果也是某一时刻的
+void table_aggregate(Table* table, uint32_t id_min, uint32_t id_max, ColumnFilter* filter,
+                     AggregateState* result){
+  aggregate_init(result);
+  if(id_min > id_max){
+    return;
+  }
+  uint32_t max_slices = table->scan_threads * SCAN_SLICES_PER_THREAD;
+  ScanJob job;
+  job.table = table;
+  job.snapshot = snapshot_begin(table);
+  job.filter = filter;
+  job.slices = malloc(sizeof(ScanSlice) * max_slices);
+  job.num_slices = scan_split(table, job.snapshot, id_min, id_max, job.slices, max_slices);
+  job.next_slice = 0;
+
+  uint32_t num_threads = table->scan_threads < job.num_slices ? table->scan_threads : job.num_slices;
+  ScanWorker workers[SCAN_MAX_THREADS];
+  pthread_t threads[SCAN_MAX_THREADS];
+  for(uint32_t i = 0; i < num_threads; i++){
+    workers[i].job = &job;
+    aggregate_init(&workers[i].state);
+  }
+  for(uint32_t i = 1; i < num_threads; i++){
+    if(pthread_create(&threads[i], NULL, scan_thread, &workers[i]) != 0){
+      printf("pthread_create error\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  scan_worker(&workers[0]);
+  for(uint32_t i = 0; i < num_threads; i++){
+    if(i > 0){
+      pthread_join(threads[i], NULL);
+    }
+    aggregate_merge(result, &workers[i].state);
+  }
+  snapshot_end(table, job.snapshot);
+  free(job.slices);
 }
 
-MetaCommandResult do_meta_command(InputBuffer * input_buffer, Table * table){
-  if(strcmp(input_buffer->buffer, ".exit") == 0){
-    close_input_buffer(input_buffer);
-    db_close(table);
-    exit(EXIT_SUCCESS);
-  }else if(strcmp(input_buffer->buffer, ".btree") == 0){
-    printf("tree:\n");
-    print_tree(table->pager, 0, 0);
-    return META_COMMAND_SUCCESS;
-  }else if(strcmp(input_buffer->buffer, ".constants") == 0){
-    printf("Constants:\n");
-    print_constants();
-    return META_COMMAND_SUCCESS;
-  }else {
-    return META_COMMAND_UNRECOGNIZED_COMMAND;
+bool aggregates_count_only(Statement* statement){
+  for(uint32_t i = 0; i < statement->num_aggregates; i++){
+    if(statement->aggregates[i].function != AGGREGATE_COUNT){
+      return false;
+    }
+  }
+  return true;
+}
+
+//二进制格式的聚合行：4字节长度后面每个聚合8字节，count/sum/min/max是uint64，avg是double
+//空集合上min/max记成UINT64_MAX，avg记成NaN
+void print_aggregates_binary(Statement* statement, AggregateState* state){
+  uint8_t frame[sizeof(uint32_t) + STATEMENT_MAX_AGGREGATES * sizeof(uint64_t)];
+  uint32_t size = statement->num_aggregates * sizeof(uint64_t);
+  memcpy(frame, &size, sizeof(uint32_t));
+  for(uint32_t i = 0; i < statement->num_aggregates; i++){
+    AggregateColumn c = statement->aggregates[i].column;
+    uint64_t value = UINT64_MAX;
+    switch(statement->aggregates[i].function){
+      case(AGGREGATE_COUNT):
+        value = state->count;
+        break;
+      case(AGGREGATE_SUM):
+        value = state->sum[c];
+        break;
+      case(AGGREGATE_MIN):
+        if(state->count > 0){
+          value = state->min[c];
+        }
+        break;
+      case(AGGREGATE_MAX):
+        if(state->count > 0){
+          value = state->max[c];
+        }
+        break;
+      case(AGGREGATE_AVG): {
+        double avg = state->count > 0 ? (double)state->sum[c] / state->count : NAN;
+        memcpy(&value, &avg, sizeof(double));
+        break;
+      }
+    }
+    memcpy(frame + sizeof(uint32_t) + i * sizeof(uint64_t), &value, sizeof(uint64_t));
+  }
+  fwrite(frame, 1, sizeof(uint32_t) + size, stdout);
+}
+
+//空集合上的min/max/avg输出null
+//聚合只有一行，CSV时去掉括号用逗号分隔
+void print_aggregates(Statement* statement, AggregateState* state, OutputFormat format){
+  if(format == OUTPUT_BINARY){
+    print_aggregates_binary(statement, state);
+    return;
+  }
+  bool csv = format == OUTPUT_CSV;
+  if(!csv){
+    printf("(");
+  }
+  for(uint32_t i = 0; i < statement->num_aggregates; i++){
+    AggregateColumn c = statement->aggregates[i].column;
+    if(i > 0){
+      printf(csv ? "," : ", ");
+    }
+    switch(statement->aggregates[i].function){
+      case(AGGREGATE_COUNT):
+        printf("%lu", (unsigned long)state->count);
+        break;
+      case(AGGREGATE_SUM):
+        printf("%lu", (unsigned long)state->sum[c]);
+        break;
+      case(AGGREGATE_MIN):
+      case(AGGREGATE_MAX):
+      case(AGGREGATE_AVG):
+        if(state->count == 0){
+          printf("null");
+        }else if(statement->aggregates[i].function == AGGREGATE_MIN){
+          printf("%u", state->min[c]);
+        }else if(statement->aggregates[i].function == AGGREGATE_MAX){
+          printf("%u", state->max[c]);
+        }else{
+          printf("%.2f", (double)state->sum[c] / state->count);
+        }
+        break;
+    }
+  }
+  printf(csv ? "\n" : ")\n");
+}
+
+//按列值过滤的select：有索引时从索引查出主键id再回表取行，O(log n)加上匹配的行数
+//没有索引时全表扫描比对记录，聚合仍然走并行扫描
+ExecuteResult execute_select_filtered(Statement* statement, Table* table){
+  ColumnFilter* filter = &statement->filter;
+  Table* index = __atomic_load_n(&table->indexes[filter->column], __ATOMIC_ACQUIRE);
+  bool aggregate = statement->num_aggregates > 0;
+  AggregateState state;
+  //聚合结果只有一行，offset跳过它就什么都不输出
+  if(statement->limit == 0 || (aggregate && statement->offset > 0)){
+    return EXECUTE_SUCCESS;
+  }
+  uint32_t skip = statement->offset;
+
+  if(index == NULL && aggregate){
+    table_aggregate(table, 0, UINT32_MAX, filter, &state);
+    print_aggregates(statement, &state, table->output_format);
+    return EXECUTE_SUCCESS;
+  }
+  ResultSink sink;
+  result_sink_open(&sink, table->output_format);
+  uint32_t num_rows = 0;
+  if(index == NULL){
+    Snapshot* snapshot = snapshot_begin(table);
+    Cursor* cursor = table_seek_at(table, snapshot, 0);
+    while(!cursor->end_of_table && num_rows < statement->limit){
+      uint8_t* record = leaf_node_record(cursor->node, cursor->cell_num);
+      if(record_field_equals(record, filter->column, filter->value)){
+        if(skip > 0){
+          skip--;
+        }else{
+          result_sink_row(&sink, *leaf_node_key(cursor->node, cursor->cell_num), record);
+          num_rows++;
+        }
+      }
+      cursor_advance(cursor);
+    }
+    cursor_close(cursor);
+    snapshot_end(table, snapshot);
+    result_sink_flush(&sink);
+    return EXECUTE_SUCCESS;
+  }
+
+  //索引查出来的id逐个回表，在叶子还锁着的时候直接从记录输出
+  uint32_t* ids;
+  uint32_t count = index_lookup(index, filter->value, &ids);
+  aggregate_init(&state);
+  for(uint32_t i = 0; i < count && num_rows < statement->limit; i++){
+    Cursor* cursor = table_find(table, ids[i]);
+    if(cursor->cell_num < *leaf_node_num_cells(cursor->node) &&
+       *leaf_node_key(cursor->node, cursor->cell_num) == ids[i]){
+      uint8_t* record = leaf_node_record(cursor->node, cursor->cell_num);
+      if(aggregate){
+        uint32_t values[AGGREGATE_COLUMNS] = {ids[i], record[0], record[1]};
+        aggregate_add(&state, values);
+      }else if(skip > 0){
+        skip--;
+      }else{
+        result_sink_row(&sink, ids[i], record);
+        num_rows++;
+      }
+    }
+    cursor_close(cursor);
+  }
+  result_sink_flush(&sink);
+  if(aggregate){
+    print_aggregates(statement, &state, table->output_format);
+  }
+  return EXECUTE_SUCCESS;
+}
+
+//从id_min seek下去，沿着next_leaf扫到id_max或者limit为止
+//有offset时先数出id_min前面有几行，再按行数直接定位，跳过的行不用读
+//带聚合时走并行扫描，只输出一行
+//扫描读的是开始时的快照，写线程同时插入删除也看不到扫到一半的树
+ExecuteResult execute_select(Statement* statement, Table* table) {
+  if(statement->filter.active){
+    return execute_select_filtered(statement, table);
+  }
+  if(statement->num_aggregates > 0){
+    if(statement->limit > 0 && statement->offset == 0){
+      AggregateState state;
+      if(aggregates_count_only(statement) && statement->id_min == 0 && statement->id_max == UINT32_MAX){
+        //整表的count(*)直接用文件头里维护的行数
+        aggregate_init(&state);
+        state.count = table->pager->row_count;
+      }else if(aggregates_count_only(statement)){
+        //id范围上的count(*)用中间节点上的行数，两次下降就够了，两次读同一个快照
+        aggregate_init(&state);
+        if(statement->id_min <= statement->id_max){
+          Snapshot* snapshot = snapshot_begin(table);
+          state.count = table_count_le(table, snapshot, statement->id_max) -
+                        (statement->id_min > 0 ? table_count_le(table, snapshot, statement->id_min - 1) : 0);
+          snapshot_end(table, snapshot);
+        }
+      }else{
+        table_aggregate(table, statement->id_min, statement->id_max, NULL, &state);
+      }
+      print_aggregates(statement, &state, table->output_format);
+    }
+    return EXECUTE_SUCCESS;
+  }
+  if(statement->id_min > statement->id_max || statement->limit == 0){
+    return EXECUTE_SUCCESS;
+  }
+  Snapshot* snapshot = snapshot_begin(table);
+  Cursor* cursor;
+  if(statement->offset == 0){
+    cursor = table_seek_at(table, snapshot, statement->id_min);
+  }else{
+    uint64_t rank = statement->id_min > 0 ? table_count_le(table, snapshot, statement->id_min - 1) : 0;
+    cursor = table_seek_rank(table, snapshot, rank + statement->offset);
+  }
+
+  ResultSink sink;
+  result_sink_open(&sink, table->output_format);
+  uint32_t num_rows = 0;
+  while (!(cursor->end_of_table) && num_rows < statement->limit) {
+    uint32_t id = *leaf_node_key(cursor->node, cursor->cell_num);
+    if(id > statement->id_max){
+      break;
+    }
+    result_sink_row(&sink, id, leaf_node_record(cursor->node, cursor->cell_num));
+    num_rows++;
+    cursor_advance(cursor);
+  }
+
+  cursor_close(cursor);
+  snapshot_end(table, snapshot);
+  result_sink_flush(&sink);
+
+  return EXECUTE_SUCCESS;
+}
+
+//先在共享latch下收集要删的id，再一行一行地删，删的时候不会再有cursor停在树上
+//删很多行时和batch insert一样攒满一个事务就提交
+ExecuteResult execute_delete(Statement* statement, Table* table){
+  ColumnFilter* filter = &statement->filter;
+  Table* index = filter->active ? __atomic_load_n(&table->indexes[filter->column], __ATOMIC_ACQUIRE) : NULL;
+  uint32_t* ids;
+  uint32_t count = 0;
+  if(index != NULL){
+    count = index_lookup(index, filter->value, &ids);
+  }else{
+    uint32_t capacity = 16;
+    ids = arena_alloc(&thread_arena, sizeof(uint32_t) * capacity);
+    if(statement->id_min <= statement->id_max){
+      Cursor* cursor = table_seek(table, statement->id_min);
+      while(!cursor->end_of_table){
+        uint32_t id = *leaf_node_key(cursor->node, cursor->cell_num);
+        if(id > statement->id_max){
+          break;
+        }
+        uint8_t* record = leaf_node_record(cursor->node, cursor->cell_num);
+        if(!filter->active || record_field_equals(record, filter->column, filter->value)){
+          if(count == capacity){
+            ids = arena_grow(&thread_arena, ids, sizeof(uint32_t) * capacity, sizeof(uint32_t) * capacity * 2);
+            capacity *= 2;
+          }
+          ids[count++] = id;
+        }
+        cursor_advance(cursor);
+      }
+      cursor_close(cursor);
+    }
+  }
+
+  for(uint32_t i = 0; i < count; i++){
+    table_delete_row(table, ids[i]);
+    if(pager_txn_full(table->pager)){
+      pager_commit(table->pager);
+    }
+  }
+  return EXECUTE_SUCCESS;
+}
+
+//按语句类型分发，执行时间记进延迟直方图；拿锁和提交都由调用方负责
+ExecuteResult execute_statement_dispatch(Statement* statement , Table* table){
+  ExecuteResult result = EXECUTE_SUCCESS;
+  uint64_t start_ns = stats_now_ns();
+  switch(statement->type) {
+    case(STATEMENT_INSERT):
+      result = execute_insert(statement, table);
+      break;
+    case(STATEMENT_INSERT_BATCH):
+      result = execute_insert_batch(statement, table);
+      break;
+    case(STATEMENT_SELECT):
+      result = execute_select(statement, table);
+      break;
+    case(STATEMENT_CREATE_INDEX):
+      result = execute_create_index(statement, table);
+      break;
+    case(STATEMENT_DELETE):
+      result = execute_delete(statement, table);
+      break;
   }
+  stats_record_latency((LatencyKind)statement->type, start_ns);
+  return result;
 }
 
-//主要是初始化statement
-PrepareResult prepare_insert(InputBuffer * input_buffer, Statement* statement){
-  statement->type = STATEMENT_INSERT;
+//只执行不提交，调用方负责pager_commit；执行时间按语句类型记进延迟直方图，提交另算
+//写语句执行时拿着write_lock，快照只会开在两条写语句之间
+ExecuteResult execute_statement_uncommitted(Statement* statement , Table* table){
+  bool write = statement->type != STATEMENT_SELECT;
+  if(write){
+    pthread_mutex_lock(&table->pager->write_lock);
+  }
+  ExecuteResult result = execute_statement_dispatch(statement, table);
+  if(write){
+    pthread_mutex_unlock(&table->pager->write_lock);
+  }
+  return result;
+}
+
+//每条语句结束写一条提交记录，然后回收这条语句在arena里分配的东西
+//提交记录在write_lock里写进WAL，放开锁之后再等落盘：多个写线程的提交合成一次fdatasync
+ExecuteResult execute_statement(Statement* statement , Table* table){
+  Pager* pager = table->pager;
+  if(statement->type == STATEMENT_SELECT){
+    ExecuteResult result = execute_statement_dispatch(statement, table);
+    arena_reset(&thread_arena);
+    return result;
+  }
+  pthread_mutex_lock(&pager->write_lock);
+  ExecuteResult result = execute_statement_dispatch(statement, table);
+  uint64_t start_ns = stats_now_ns();
+  uint64_t generation;
+  uint64_t lsn = pager_commit_append(pager, &generation);
+  pthread_mutex_unlock(&pager->write_lock);
+  pager_commit_wait(pager, lsn, generation);
+  stats_record_latency(LATENCY_COMMIT, start_ns);
+  arena_reset(&thread_arena);
+  return result;
+}
 
-  char * keyword = strtok(input_buffer->buffer, " ");
-  char * id_string = strtok(NULL, " ");
-  char * username = strtok(NULL, " ");
-  char * email = strtok(NULL, " ");
+//.load：先按id排序（放不下内存就外排序），再自底向上一层层建树
+typedef struct {
+  //当前正在填的节点，INVALID_PAGE_NUM表示没有
+  uint32_t page_num;
+  void * node;
+  uint32_t count;
+  uint32_t max_key;
+  //当前节点下面的行数，交给上一层时记进父节点
+  uint32_t rows;
+  //填满的节点先挂着，等本层开下一个节点或者导入结束时再交给上一层
+  //这样最后一层只有一个节点时它就是根，不会多出只有一个孩子的中间节点
+  uint32_t pending_page_num;
+  uint32_t pending_max_key;
+  uint32_t pending_rows;
+  uint32_t nodes_created;
+} LoadLevel;
 
-  if(id_string == NULL || username == NULL || email == NULL){
-    return PREPARE_SYNTAX_ERROR;
+typedef struct {
+  Table * table;
+  //叶子按字节填，中间节点按key个数填
+  uint32_t leaf_fill;
+  uint32_t internal_fill;
+  uint32_t prev_leaf_page_num;
+  uint32_t pages_since_flush;
+  LoadLevel levels[LOAD_MAX_LEVELS];
+} BulkLoader;
+
+//已排好序的行：只有一块时直接读内存，否则对各个run做多路归并
+typedef struct {
+  Row * chunk;
+  uint32_t chunk_count;
+  uint32_t chunk_index;
+  FILE ** runs;
+  uint32_t num_runs;
+  Row * heads;
+  uint32_t * heap;
+  uint32_t heap_size;
+} LoadSource;
+
+FILE* load_write_run(Row* rows, uint32_t count){
+  qsort(rows, count, sizeof(Row), compare_row_id);
+  FILE* run = tmpfile();
+  if(run == NULL || fwrite(rows, sizeof(Row), count, run) != count){
+    printf("unable to write sort run\n");
+    exit(EXIT_FAILURE);
+  }
+  rewind(run);
+  return run;
+}
+
+void load_heap_sift_down(LoadSource* source, uint32_t i){
+  while(true){
+    uint32_t smallest = i;
+    uint32_t left = 2 * i + 1;
+    uint32_t right = left + 1;
+    if(left < source->heap_size &&
+       source->heads[source->heap[left]].id < source->heads[source->heap[smallest]].id){
+      smallest = left;
+    }
+    if(right < source->heap_size &&
+       source->heads[source->heap[right]].id < source->heads[source->heap[smallest]].id){
+      smallest = right;
+    }
+    if(smallest == i){
+      return;
+    }
+    uint32_t temp = source->heap[i];
+    source->heap[i] = source->heap[smallest];
+    source->heap[smallest] = temp;
+    i = smallest;
   }
+}
 
-  //可以替换为一个强转
-  int id = atoi(id_string);
-  if(id < 0){
-    return  PREPARE_NEGATIVE_ID;
+void load_source_start(LoadSource* source){
+  source->chunk_index = 0;
+  if(source->num_runs == 0){
+    qsort(source->chunk, source->chunk_count, sizeof(Row), compare_row_id);
+    return;
   }
 
-  if(strlen(username) > COLUMN_USERNAME_SIZE){
-    return PREPARE_STRING_TOO_LONG;
+  source->heads = malloc(sizeof(Row) * source->num_runs);
+  source->heap = malloc(sizeof(uint32_t) * source->num_runs);
+  source->heap_size = 0;
+  for(uint32_t i = 0; i < source->num_runs; i++){
+    if(fread(&source->heads[i], sizeof(Row), 1, source->runs[i]) == 1){
+      source->heap[source->heap_size++] = i;
+    }
   }
-  if(strlen(email) > COLUMN_EMAIL_SIZE){
-    return PREPARE_STRING_TOO_LONG;
+  for(int32_t i = (int32_t)source->heap_size / 2 - 1; i >= 0; i--){
+    load_heap_sift_down(source, i);
   }
+}
 
-  statement->row_to_insert.id = id;
-  strcpy(statement->row_to_insert.username, username);
-  strcpy(statement->row_to_insert.email, email);
+bool load_source_next(LoadSource* source, Row* row){
+  if(source->num_runs == 0){
+    if(source->chunk_index == source->chunk_count){
+      return false;
+    }
+    *row = source->chunk[source->chunk_index++];
+    return true;
+  }
 
-  return PREPARE_SUCCESS;
+  if(source->heap_size == 0){
+    return false;
+  }
+  uint32_t run = source->heap[0];
+  *row = source->heads[run];
+  if(fread(&source->heads[run], sizeof(Row), 1, source->runs[run]) != 1){
+    source->heap[0] = source->heap[--source->heap_size];
+  }
+  load_heap_sift_down(source, 0);
+  return true;
 }
 
-PrepareResult prepare_statement(InputBuffer * input_buffer, Statement* statement){
-  if(strncmp(input_buffer->buffer, "insert", 6) == 0){
-    return prepare_insert(input_buffer, statement);
+void load_source_close(LoadSource* source){
+  for(uint32_t i = 0; i < source->num_runs; i++){
+    fclose(source->runs[i]);
   }
-  if(strcmp(input_buffer->buffer, "select") == 0){
-    statement->type = STATEMENT_SELECT;
-    return PREPARE_SUCCESS;
+  if(source->num_runs > 0){
+    free(source->heads);
+    free(source->heap);
   }
+  free(source->runs);
+  free(source->chunk);
+}
 
-  return PREPARE_UNRECOGNIZE_STATEMENT;
-} 
-
-//找到叶子节点后,节点信息必然在叶子结点上
-//用二分法查找cell
-Cursor* leaf_node_find(Table* table, uint32_t page_num, uint32_t key){
-  void* node = get_page(table->pager, page_num);
-  uint32_t num_cells = *leaf_node_num_cells(node);
-
-  Cursor* cursor = malloc(sizeof(Cursor));
-  cursor->table = table;
-  cursor->page_num = page_num;
-  cursor->end_of_table = false;
+//读CSV/TSV，每行id,username,email；每攒满一块就排序写成一个run
+bool load_read_file(const char* filename, LoadSource* source, FILE* diagnostics){
+  FILE* input = fopen(filename, "r");
+  if(input == NULL){
+    fprintf(diagnostics, "unable to open '%s'\n", filename);
+    return false;
+  }
 
-  uint32_t min_index = 0;
-  uint32_t one_past_max_index = num_cells;
-  while(one_past_max_index != min_index){
-    uint32_t index = (min_index + one_past_max_index)/2;
-    uint32_t key_at_index = *leaf_node_key(node, index);
-    if(key == key_at_index){
-      cursor->cell_num = index;
-      return cursor;
+  source->chunk = malloc(sizeof(Row) * LOAD_SORT_CHUNK_ROWS);
+  source->chunk_count = 0;
+  source->runs = NULL;
+  source->num_runs = 0;
+
+  char* line = NULL;
+  size_t line_capacity = 0;
+  uint32_t line_num = 0;
+  bool ok = true;
+  while(getline(&line, &line_capacity, input) != -1){
+    line_num++;
+    char* id_string = strtok(line, ",\t\r\n");
+    if(id_string == NULL){
+      continue;
+    }
+    char* username = strtok(NULL, ",\t\r\n");
+    char* email = strtok(NULL, ",\t\r\n");
+    if(prepare_row(id_string, username, email, &source->chunk[source->chunk_count]) != PREPARE_SUCCESS){
+      fprintf(diagnostics, "bad row at line %d of '%s'\n", line_num, filename);
+      ok = false;
+      break;
     }
-    if(key < key_at_index){
-      one_past_max_index = index;
-    }else {
-      min_index = index+1;
+
+    source->chunk_count++;
+    if(source->chunk_count == LOAD_SORT_CHUNK_ROWS){
+      source->runs = realloc(source->runs, sizeof(FILE*) * (source->num_runs + 1));
+      source->runs[source->num_runs++] = load_write_run(source->chunk, source->chunk_count);
+      source->chunk_count = 0;
     }
   }
+  free(line);
+  fclose(input);
 
-  cursor->cell_num = min_index;
-  return cursor;
+  if(ok && source->num_runs > 0 && source->chunk_count > 0){
+    source->runs = realloc(source->runs, sizeof(FILE*) * (source->num_runs + 1));
+    source->runs[source->num_runs++] = load_write_run(source->chunk, source->chunk_count);
+    source->chunk_count = 0;
+  }
+  if(!ok){
+    load_source_close(source);
+  }
+  return ok;
 }
 
-//返回子节点索引位置
-uint32_t internal_node_find_child(void* node, uint32_t key){
-  uint32_t num_keys = *internal_node_num_keys(node);
+void bulk_loader_push(BulkLoader* loader, uint32_t level, uint32_t child_page_num,
+                      uint32_t child_max_key, uint32_t child_rows);
 
-  uint32_t min_index = 0;
-  uint32_t max_index = num_keys;
-  
-  while(min_index != max_index){
-    uint32_t index = (min_index + max_index )/2;
-    uint32_t key_to_right = *internal_node_key(node, index);
-    if(key_to_right >= key){
-      max_index = index;
-    }else{
-      min_index = index + 1;
-    }
-  }
+//level层当前节点写完，挂到pending上
+//中间节点的最后一个孩子放到右孩子的位置
+void bulk_loader_close_node(BulkLoader* loader, uint32_t level){
+  Pager* pager = loader->table->pager;
+  LoadLevel* l = &loader->levels[level];
 
-  return min_index;
+  if(level > 0){
+    pager_mark_dirty(pager, l->page_num);
+    *internal_node_right_child(l->node) = internal_node_children(l->node)[l->count - 1];
+    *internal_node_num_keys(l->node) = l->count - 1;
+  }
+  pager_unpin(pager, l->page_num);
+
+  l->pending_page_num = l->page_num;
+  l->pending_max_key = l->max_key;
+  l->pending_rows = l->rows;
+  l->page_num = INVALID_PAGE_NUM;
+  l->node = NULL;
+  l->count = 0;
 }
 
-//node上child的信息是pager的堆地址索引
-Cursor* internal_node_find(Table* table, uint32_t page_num, uint32_t key){
-  void* node = get_page(table->pager, page_num);
+//在level层开一个新节点，先把上一个写完的节点交给上一层
+void bulk_loader_open_node(BulkLoader* loader, uint32_t level){
+  Pager* pager = loader->table->pager;
+  LoadLevel* l = &loader->levels[level];
 
-  uint32_t child_index = internal_node_find_child(node, key);
-  uint32_t child_num = *internal_node_child(node, child_index);
-  void* child = get_page(table->pager, child_num);
-  switch(get_node_type(child)){
-    case NODE_LEAF:
-      return leaf_node_find(table, child_num, key);
-    case NODE_INTERNAL:
-      return internal_node_find(table, child_num, key);
+  if(l->pending_page_num != INVALID_PAGE_NUM){
+    bulk_loader_push(loader, level + 1, l->pending_page_num, l->pending_max_key, l->pending_rows);
+    l->pending_page_num = INVALID_PAGE_NUM;
   }
-}
 
-Cursor* table_find(Table* table, uint32_t key){
-  uint32_t root_page_num = table->root_page_num;
-  void* root_node = get_page(table->pager, root_page_num);
+  if(++loader->pages_since_flush >= LOAD_FLUSH_PAGES){
+    pager_flush_dirty(pager);
+    loader->pages_since_flush = 0;
+  }
 
-  if(get_node_type(root_node) == NODE_LEAF){
-    return leaf_node_find(table, root_page_num, key);
+  //导入的页不进WAL，只用文件末尾的新页，不从free list拿
+  uint32_t page_num = pager->num_pages;
+  void* node = get_page(pager, page_num);
+  pager_mark_dirty(pager, page_num);
+  if(level == 0){
+    initialize_leaf_node(node);
+    if(loader->prev_leaf_page_num != INVALID_PAGE_NUM){
+      void* prev = get_page(pager, loader->prev_leaf_page_num);
+      pager_mark_dirty(pager, loader->prev_leaf_page_num);
+      *leaf_node_next_leaf(prev) = page_num;
+      pager_unpin(pager, loader->prev_leaf_page_num);
+    }
+    loader->prev_leaf_page_num = page_num;
   }else{
-    return internal_node_find(table, root_page_num, key);
+    initialize_internal_node(node);
   }
-}
 
-//返回最后面的key为最大的key
-uint32_t get_node_max_key(void* node){
-  switch(get_node_type(node)){
-    case NODE_INTERNAL:
-      return *internal_node_key(node, *internal_node_num_keys(node)-1);
-    case NODE_LEAF:
-      return *leaf_node_key(node, *leaf_node_num_cells(node)-1);
-  }
+  l->page_num = page_num;
+  l->node = node;
+  l->count = 0;
+  l->rows = 0;
+  l->nodes_created++;
 }
 
-uint32_t get_unused_page_num(Pager* pager){
-  return pager->num_pages;
-}
+//把写完的孩子挂到level层当前的中间节点上
+void bulk_loader_push(BulkLoader* loader, uint32_t level, uint32_t child_page_num,
+                      uint32_t child_max_key, uint32_t child_rows){
+  if(level >= LOAD_MAX_LEVELS){
+    printf("bulk load tree too deep\n");
+    exit(EXIT_FAILURE);
+  }
+  Pager* pager = loader->table->pager;
+  LoadLevel* l = &loader->levels[level];
+  if(l->page_num == INVALID_PAGE_NUM){
+    bulk_loader_open_node(loader, level);
+  }
 
-uint32_t* node_parent(void* node){
-  return node + PARENT_POINTER_OFFSET;
+  pager_mark_dirty(pager, l->page_num);
+  *internal_node_num_keys(l->node) = l->count + 1;
+  *internal_node_child(l->node, l->count) = child_page_num;
+  *internal_node_key(l->node, l->count) = child_max_key;
+  *internal_node_count(l->node, l->count) = child_rows;
+  l->count++;
+  l->max_key = child_max_key;
+  l->rows += child_rows;
+  set_node_parent(pager, child_page_num, l->page_num);
+
+  if(l->count == loader->internal_fill){
+    bulk_loader_close_node(loader, level);
+  }
 }
 
-void* leaf_node_value(void* node, uint32_t cell_num){
-  return leaf_node_cell(node, cell_num)+ LEAF_NODE_KEY_SIZE;
-}
+void bulk_loader_add_row(BulkLoader* loader, Row* row){
+  Pager* pager = loader->table->pager;
+  LoadLevel* l = &loader->levels[0];
+  uint8_t record[LEAF_NODE_MAX_RECORD_SIZE];
+  uint32_t size = serialize_row(row, record);
+  uint32_t needed = size + LEAF_NODE_SLOT_SIZE;
+  if(l->page_num != INVALID_PAGE_NUM &&
+     LEAF_NODE_SPACE_FOR_CELLS - leaf_node_free_space(l->node) + needed > loader->leaf_fill){
+    bulk_loader_close_node(loader, 0);
+  }
+  if(l->page_num == INVALID_PAGE_NUM){
+    bulk_loader_open_node(loader, 0);
+  }
 
-//将Row中的信息拷贝到缓冲区pager中
-void serialize_row(Row* resource, void* destination){
-  memcpy(destination+ ID_OFFSET, &resource->id, ID_SIZE);
-  memcpy(destination + USERNAME_OFFSET, &resource->username, USERNAME_SIZE);
-  memcpy(destination + EMAIL_OFFSET, &resource->email, EMAIL_SIZE);
+  pager_mark_dirty(pager, l->page_num);
+  leaf_node_insert_cell(l->node, l->count, row->id, record, size);
+  l->count++;
+  l->max_key = row->id;
+  l->rows++;
 }
 
-void initialize_internal_node(void * node){
-  set_node_type(node, NODE_INTERNAL);
-  set_node_root(node, false);
-  *internal_node_num_keys(node) = 0;
+//自底向上收尾，返回最顶上那个节点的页号，没有数据返回INVALID_PAGE_NUM
+uint32_t bulk_loader_finish(BulkLoader* loader){
+  for(uint32_t level = 0; level < LOAD_MAX_LEVELS; level++){
+    LoadLevel* l = &loader->levels[level];
+    if(l->nodes_created == 0){
+      return INVALID_PAGE_NUM;
+    }
+    if(l->page_num != INVALID_PAGE_NUM){
+      bulk_loader_close_node(loader, level);
+    }
+    if(l->nodes_created == 1){
+      return l->pending_page_num;
+    }
+    bulk_loader_push(loader, level + 1, l->pending_page_num, l->pending_max_key, l->pending_rows);
+    l->pending_page_num = INVALID_PAGE_NUM;
+  }
+  printf("bulk load tree too deep\n");
+  exit(EXIT_FAILURE);
 }
 
-void create_new_root(Table* table, uint32_t right_child_page_num){
-  void* root = get_page(table->pager , table->root_page_num);
-  void* right_child = get_page(table->pager, right_child_page_num);
-  uint32_t left_child_page_num = get_unused_page_num(table->pager);
-  void* left_child = get_page(table->pager, left_child_page_num);
-
-  memcpy(left_child, root, PAGE_SIZE);
-  set_node_root(left_child, false);
-
-  initialize_internal_node(root);
-  set_node_root(root, true);
-  *internal_node_num_keys(root) = 1;
-  *internal_node_child(root, 0) = left_child_page_num;
-  uint32_t left_child_max_key = get_node_max_key(left_child);
-  *internal_node_key(root, 0) = left_child_max_key;
-  *internal_node_right_child(root) = right_child_page_num;
-  *node_parent(left_child) = table->root_page_num;
-  *node_parent(right_child) = table->root_page_num;
+void bulk_loader_init(BulkLoader* loader, Table* table, uint32_t fill_percent){
+  loader->table = table;
+  loader->leaf_fill = LEAF_NODE_SPACE_FOR_CELLS * fill_percent / 100;
+  loader->internal_fill = INTERNAL_NODE_MAX_CELLS * fill_percent / 100;
+  if(loader->internal_fill < 2){
+    loader->internal_fill = 2;
+  }
+  loader->prev_leaf_page_num = INVALID_PAGE_NUM;
+  loader->pages_since_flush = 0;
+  for(uint32_t i = 0; i < LOAD_MAX_LEVELS; i++){
+    loader->levels[i].page_num = INVALID_PAGE_NUM;
+    loader->levels[i].node = NULL;
+    loader->levels[i].count = 0;
+    loader->levels[i].pending_page_num = INVALID_PAGE_NUM;
+    loader->levels[i].nodes_created = 0;
+  }
 }
 
-//替换old_key为new_key
-void update_internal_node_key(void* node, uint32_t old_key, uint32_t new_key){
-  uint32_t old_child_index = internal_node_find_child(node, old_key);
-  *internal_node_key(node, old_child_index) = new_key;
+//文件头里的根换成建好的顶层节点，原来空的根叶子放回free list
+void bulk_loader_install_root(Table* table, uint32_t top_page_num){
+  Pager* pager = table->pager;
+  uint32_t old_root_page_num = table->root_page_num;
+  void* top = get_page(pager, top_page_num);
+  pager_mark_dirty(pager, top_page_num);
+  set_node_root(top, true);
+  *node_parent(top) = 0;
+  pager_unpin(pager, top_page_num);
+
+  void* header = get_page(pager, HEADER_PAGE_NUM);
+  pager_mark_dirty(pager, HEADER_PAGE_NUM);
+  *header_tree_root(header, table->tree) = top_page_num;
+  *header_tree_height(header, table->tree) = tree_height(pager, top_page_num);
+  pager_unpin(pager, HEADER_PAGE_NUM);
+
+  table->root_page_num = top_page_num;
+  pager_free_page(pager, old_root_page_num);
+  table->rightmost_leaf_page_num = INVALID_PAGE_NUM;
 }
 
-void internal_node_insert(Table* table, uint32_t parent_page_num , uint32_t child_page_num){
-  void* parent = get_page(table->pager, parent_page_num);
-  void* child = get_page(table->pager, child_page_num);
-  uint32_t child_max_key = get_node_max_key(child);
-  uint32_t index = internal_node_find_child(parent, child_max_key);
-
-  // 之前Parent节点key数量
-  uint32_t original_num_keys = *internal_node_num_keys(parent);
-  *internal_node_num_keys(parent) = original_num_keys + 1;
-
-  if (original_num_keys >= INTERNAL_NODE_MAX_CELLS) {
-    printf("Need to implement splitting internal node\n");
-    exit(EXIT_FAILURE);
+//版本1的一棵树：记下所有旧的中间节点，再沿着叶子链把现有的叶子当作第0层交给bulk loader，
+//在文件末尾建一套带行数的中间层。叶子只改父指针，返回新的顶层节点，行数加到*row_count上
+uint32_t tree_build_counted(Table* table, uint32_t** old_pages, uint32_t* num_old_pages,
+                            uint32_t* old_capacity, uint64_t* row_count){
+  Pager* pager = table->pager;
+  uint32_t page_num = table->root_page_num;
+  void* node = get_page(pager, page_num);
+  if(get_node_type(node) == NODE_LEAF){
+    *row_count += *leaf_node_num_cells(node);
+    pager_unpin(pager, page_num);
+    return page_num;
+  }
+  pager_unpin(pager, page_num);
+
+  //旧的中间节点一层层展开，顺便找到最左边的叶子
+  uint32_t first = *num_old_pages;
+  uint32_t leftmost_leaf = INVALID_PAGE_NUM;
+  if(*num_old_pages == *old_capacity){
+    *old_capacity *= 2;
+    *old_pages = realloc(*old_pages, *old_capacity * sizeof(uint32_t));
+  }
+  (*old_pages)[(*num_old_pages)++] = page_num;
+  for(uint32_t i = first; i < *num_old_pages; i++){
+    node = get_page(pager, (*old_pages)[i]);
+    uint32_t num_keys = *internal_node_num_keys(node);
+    for(uint32_t c = 0; c <= num_keys; c++){
+      uint32_t child_page_num = uncounted_internal_node_child(node, c);
+      void* child = get_page(pager, child_page_num);
+      bool leaf = get_node_type(child) == NODE_LEAF;
+      pager_unpin(pager, child_page_num);
+      if(leaf){
+        if(leftmost_leaf == INVALID_PAGE_NUM){
+          leftmost_leaf = child_page_num;
+        }
+        continue;
+      }
+      if(*num_old_pages == *old_capacity){
+        *old_capacity *= 2;
+        *old_pages = realloc(*old_pages, *old_capacity * sizeof(uint32_t));
+      }
+      (*old_pages)[(*num_old_pages)++] = child_page_num;
+    }
+    pager_unpin(pager, (*old_pages)[i]);
   }
 
-  uint32_t right_child_page_num = *internal_node_right_child(parent);
-  void* right_child = get_page(table->pager, right_child_page_num);
-
-  if (child_max_key > get_node_max_key(right_child)) {
-    /* Replace right child */
-    *internal_node_child(parent, original_num_keys) = right_child_page_num;
-    *internal_node_key(parent, original_num_keys) =
-        get_node_max_key(right_child);
-    *internal_node_right_child(parent) = child_page_num;
-  } else {
-    /* Make room for the new cell */
-    for (uint32_t i = original_num_keys; i > index; i--) {
-      void* destination = internal_node_cell(parent, i);
-      void* source = internal_node_cell(parent, i - 1);
-      memcpy(destination, source, INTERNAL_NODE_CELL_SIZE);
+  BulkLoader loader;
+  bulk_loader_init(&loader, table, LOAD_DEFAULT_FILL_PERCENT);
+  LoadLevel* leaves = &loader.levels[0];
+  uint32_t max_key = 0;
+  page_num = leftmost_leaf;
+  while(page_num != 0){
+    node = get_page(pager, page_num);
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    uint32_t next_page_num = *leaf_node_next_leaf(node);
+    if(num_cells > 0){
+      max_key = *leaf_node_key(node, num_cells - 1);
+    }
+    pager_unpin(pager, page_num);
+    if(leaves->pending_page_num != INVALID_PAGE_NUM){
+      bulk_loader_push(&loader, 1, leaves->pending_page_num, leaves->pending_max_key, leaves->pending_rows);
     }
-    *internal_node_child(parent, index) = child_page_num;
-    *internal_node_key(parent, index) = child_max_key;
+    leaves->pending_page_num = page_num;
+    leaves->pending_max_key = max_key;
+    leaves->pending_rows = num_cells;
+    leaves->nodes_created++;
+    *row_count += num_cells;
+    page_num = next_page_num;
   }
+  return bulk_loader_finish(&loader);
 }
 
-//b数节点分裂
-void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, Row* value){
-  void* old_node = get_page(cursor->table->pager, cursor->page_num);
-  uint32_t old_max = get_node_max_key(old_node);
-  uint32_t new_page_num = get_unused_page_num(cursor->table->pager);
-  void* new_node = get_page(cursor->table->pager, new_page_num);
-  initialize_leaf_node(new_node);
-  *node_parent(new_node) = *node_parent(old_node);
-  *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
-  *leaf_node_next_leaf(old_node) = new_page_num;
-
-  for(int32_t i = LEAF_NODE_MAX_CELLS; i>=0; i--){
-    void * destination_node;
-    if(i>=LEAF_NODE_LEFT_SPLIT_COUNT){
-      destination_node = new_node;
-    }else{
-      destination_node = old_node;
+//版本1的文件第一次打开：先不进WAL地给每棵树建好新的中间层，写回并fsync，
+//再在一个事务里换根、把旧的中间节点放回free list、文件头改成当前版本
+//提交前崩溃时文件头还是版本1，下次打开重来一遍，多建的页在记的页数之外
+void header_rebuild_counts(Pager* pager){
+  Table trees[HEADER_TREES];
+  uint32_t tops[HEADER_TREES];
+  uint32_t old_capacity = 64;
+  uint32_t num_old_pages = 0;
+  uint32_t* old_pages = malloc(old_capacity * sizeof(uint32_t));
+  uint64_t row_count = 0;
+
+  void* header = get_page(pager, HEADER_PAGE_NUM);
+  //新的中间层接在记的页数后面，文件尾部多出来的页和header_load一样当作没用过
+  uint32_t page_count = *header_page_count(header);
+  if(page_count >= 2 && page_count <= pager->num_pages){
+    pager->num_pages = page_count;
+  }
+  pager->logging = false;
+  for(uint32_t tree = 0; tree < HEADER_TREES; tree++){
+    memset(&trees[tree], 0, sizeof(Table));
+    trees[tree].pager = pager;
+    trees[tree].tree = tree;
+    trees[tree].root_page_num = *header_tree_root(header, tree);
+    trees[tree].rightmost_leaf_page_num = INVALID_PAGE_NUM;
+    if(trees[tree].root_page_num != 0){
+      uint64_t rows = 0;
+      tops[tree] = tree_build_counted(&trees[tree], &old_pages, &num_old_pages, &old_capacity, &rows);
+      if(tree == HEADER_TREE_PRIMARY){
+        row_count = rows;
+      }
     }
-    //把old_node均分为两个，大的放在new_nonde
-    uint32_t index_within_node = i % LEAF_NODE_LEFT_SPLIT_COUNT;
-    void* destination = leaf_node_cell(destination_node, index_within_node);
+  }
+  pager_flush_dirty(pager);
+  if(fsync(pager->file_descriptor) == -1 ||
+     (pager->checksum_file_descriptor != -1 && fsync(pager->checksum_file_descriptor) == -1)){
+    printf("fsync error\n");
+    exit(EXIT_FAILURE);
+  }
+  pager->logging = true;
 
-    //使cell顺序排列，如果cell_num正好找到则赋值
-    //否则移动除该位置，类似于顺序排序的数组插入
-    if(i == cursor->cell_num){
-      serialize_row(value, leaf_node_value(destination_node, index_within_node));
-      *leaf_node_key(destination_node, index_within_node) = key;
-    }else if(i > cursor->cell_num){
-      memcpy(destination, leaf_node_cell(old_node, i - 1), LEAF_NODE_CELL_SIZE);
+  pager_mark_dirty(pager, HEADER_PAGE_NUM);
+  for(uint32_t tree = 0; tree < HEADER_TREES; tree++){
+    if(trees[tree].root_page_num == 0){
+      continue;
+    }
+    if(tops[tree] == trees[tree].root_page_num){
+      *header_tree_height(header, tree) = 1;
     }else{
-      memcpy(destination, leaf_node_cell(old_node, i), LEAF_NODE_CELL_SIZE);
+      bulk_loader_install_root(&trees[tree], tops[tree]);
     }
-
-    *(leaf_node_num_cells(old_node)) = LEAF_NODE_LEFT_SPLIT_COUNT;
-    *(leaf_node_num_cells(new_node)) = LEAF_NODE_RIGHT_SPLIT_COUNT;
-
-    if(is_node_root(old_node)){
-      return create_new_root(cursor->table, new_page_num);
-    }else {
-      uint32_t parent_page_num = *node_parent(old_node);
-      uint32_t new_max = get_node_max_key(old_node);
-      void * parent = get_page(cursor->table->pager, parent_page_num);
-
-      update_internal_node_key(parent, old_max, new_max); 
-      internal_node_insert(cursor->table, parent_page_num, new_page_num);
-      return;
+  }
+  //旧的根已经由bulk_loader_install_root放回去了
+  for(uint32_t i = 0; i < num_old_pages; i++){
+    void* node = get_page(pager, old_pages[i]);
+    bool free = get_node_type(node) == NODE_FREE;
+    pager_unpin(pager, old_pages[i]);
+    if(!free){
+      pager_free_page(pager, old_pages[i]);
     }
   }
+  *header_version(header) = HEADER_FORMAT_VERSION;
+  pager->row_count = row_count;
+  pager_unpin(pager, HEADER_PAGE_NUM);
+  pager_commit(pager);
+  free(old_pages);
 }
 
-void leaf_node_insert(Cursor* cursor, uint32_t key, Row* value){
-  void * node = get_page(cursor->table->pager, cursor->page_num);
-
-  uint32_t num_cells = *leaf_node_num_cells(node);
-  //分裂
-  if(num_cells >= LEAF_NODE_MAX_CELLS){
-    leaf_node_split_and_insert(cursor, key, value);
-  }
-  if (cursor->cell_num < num_cells) {
-    // Make room for new cell
-    for (uint32_t i = num_cells; i > cursor->cell_num; i--) {
-      memcpy(leaf_node_cell(node, i), leaf_node_cell(node, i - 1),
-             LEAF_NODE_CELL_SIZE);
-    }
+//空表时自底向上建树：新页不进WAL，建完先写回并fsync，再通过WAL提交根页的切换
+//崩溃时根还是原来的空叶子，建了一半的页只是没人引用
+//表不空就退化成逐行插入
+void bulk_load(Table* table, const char* filename, uint32_t fill_percent){
+  Pager* pager = table->pager;
+  LoadSource source;
+  if(!load_read_file(filename, &source, table_diagnostics(table))){
+    return;
   }
+  load_source_start(&source);
 
-  *(leaf_node_num_cells(node)) += 1;
-  *(leaf_node_key(node, cursor->cell_num)) = key;
-  serialize_row(value, leaf_node_value(node, cursor->cell_num));
-}
+  void* root = get_page(pager, table->root_page_num);
+  bool empty = get_node_type(root) == NODE_LEAF && *leaf_node_num_cells(root) == 0;
+  pager_unpin(pager, table->root_page_num);
 
-ExecuteResult execute_insert(Statement* statement, Table* table){
-  Row* row_to_insert = &(statement->row_to_insert);
-  uint32_t key_to_insert = row_to_insert->id;
-  Cursor* cursor = table_find(table, key_to_insert);
+  uint32_t num_loaded = 0;
+  uint32_t num_duplicates = 0;
+  Row row;
+  if(!empty){
+    //表不空时按批交给table_insert_batch，每批提交一次
+    Row* batch = malloc(sizeof(Row) * LOAD_INSERT_BATCH_ROWS);
+    uint32_t count = 0;
+    bool more = true;
+    while(more){
+      more = load_source_next(&source, &batch[count]);
+      if(more){
+        count++;
+      }
+      if(count == LOAD_INSERT_BATCH_ROWS || (!more && count > 0)){
+        uint32_t batch_duplicates;
+        num_loaded += table_insert_batch(table, batch, count, &batch_duplicates);
+        num_duplicates += batch_duplicates;
+        pager_commit(pager);
+        count = 0;
+      }
+    }
+    free(batch);
+  }else{
+    BulkLoader loader;
+    bulk_loader_init(&loader, table, fill_percent);
+
+    pager->logging = false;
+    bool have_previous = false;
+    uint32_t previous_id = 0;
+    while(load_source_next(&source, &row)){
+      if(have_previous && row.id == previous_id){
+        num_duplicates++;
+        continue;
+      }
+      have_previous = true;
+      previous_id = row.id;
+      bulk_loader_add_row(&loader, &row);
+      num_loaded++;
+    }
+    uint32_t top_page_num = bulk_loader_finish(&loader);
 
-  void * node = get_page(table->pager, cursor->page_num);
-  uint32_t num_cells = *leaf_node_num_cells(node);
+    pager_flush_dirty(pager);
+    if(fsync(pager->file_descriptor) == -1 ||
+       (pager->checksum_file_descriptor != -1 && fsync(pager->checksum_file_descriptor) == -1)){
+      printf("fsync error\n");
+      exit(EXIT_FAILURE);
+    }
+    pager->logging = true;
 
-  //插入的key已经存在
-  if(cursor->cell_num < num_cells){
-    uint32_t key_at_index = *leaf_node_key(node, cursor->cell_num);
-    if(key_at_index == key_to_insert){
-      return EXECUTE_DUPLICATE_KEY;
+    if(top_page_num != INVALID_PAGE_NUM){
+      bulk_loader_install_root(table, top_page_num);
+      pager->row_count += num_loaded;
+      pager_commit(pager);
+    }
+    //导入前表是空的，索引也是空的，导入的行从主表补进去
+    for(uint32_t c = 0; c < INDEX_COLUMNS; c++){
+      if(table->indexes[c] != NULL){
+        index_build(table, table->indexes[c], c);
+        pager_commit(pager);
+      }
     }
   }
+  load_source_close(&source);
 
-  leaf_node_insert(cursor, row_to_insert->id, row_to_insert);
+  FILE* diagnostics = table_diagnostics(table);
+  fprintf(diagnostics, "loaded %d rows", num_loaded);
+  if(num_duplicates > 0){
+    fprintf(diagnostics, ", skipped %d duplicate keys", num_duplicates);
+  }
+  fprintf(diagnostics, "\n");
 }
 
-void deserialize_row(void* source, Row* destination) {
-  memcpy(&(destination->id), source + ID_OFFSET, ID_SIZE);
-  memcpy(&(destination->username), source + USERNAME_OFFSET, USERNAME_SIZE);
-  memcpy(&(destination->email), source + EMAIL_OFFSET, EMAIL_SIZE);
+//在线备份：按快照把每一页拷到新文件，写线程照常插入删除
+//文件头按快照里的根、页数和行数重新写，备份不带WAL和校验和文件，打开时和新导入的库一样
+void db_backup(Table* table, const char* filename){
+  Pager* pager = table->pager;
+  int fd = open(filename, O_WRONLY|O_CREAT|O_EXCL, S_IWUSR|S_IRUSR);
+  if(fd == -1){
+    fprintf(table_diagnostics(table), "unable to create backup file %s\n", filename);
+    return;
+  }
+  Snapshot* snapshot = snapshot_begin(table);
+  uint8_t* buffer = malloc((size_t)PAGE_SIZE * BACKUP_CHUNK_PAGES);
+  header_init(buffer, false);
+  for(uint32_t tree = 0; tree < HEADER_TREES; tree++){
+    *header_tree_root(buffer, tree) = snapshot->roots[tree];
+    *header_tree_height(buffer, tree) = snapshot->heights[tree];
+  }
+  *header_free_head(buffer) = snapshot->free_head;
+  *header_page_count(buffer) = snapshot->num_pages;
+  *header_row_count(buffer) = snapshot->row_count;
+  header_seal(buffer);
+
+  uint32_t first_page = HEADER_PAGE_NUM;
+  uint32_t num_buffered = 1;
+  for(uint32_t page_num = HEADER_PAGE_NUM + 1; page_num <= snapshot->num_pages; page_num++){
+    if(num_buffered == BACKUP_CHUNK_PAGES || page_num == snapshot->num_pages){
+      ssize_t length = (ssize_t)num_buffered * PAGE_SIZE;
+      if(pwrite(fd, buffer, length, (off_t)first_page * PAGE_SIZE) != length){
+        printf("error writing backup\n");
+        exit(EXIT_FAILURE);
+      }
+      first_page = page_num;
+      num_buffered = 0;
+    }
+    if(page_num == snapshot->num_pages){
+      break;
+    }
+    void* page = pager_acquire_snapshot(pager, page_num, snapshot);
+    memcpy(buffer + (size_t)num_buffered * PAGE_SIZE, page, PAGE_SIZE);
+    pager_release(pager, page_num);
+    num_buffered++;
+  }
+  uint32_t num_pages = snapshot->num_pages;
+  uint64_t row_count = snapshot->row_count;
+  snapshot_end(table, snapshot);
+  free(buffer);
+  if(fsync(fd) == -1){
+    printf("fsync error\n");
+    exit(EXIT_FAILURE);
+  }
+  close(fd);
+  fprintf(table_diagnostics(table), "backed up %d pages, %lu rows\n", num_pages, (unsigned long)row_count);
 }
 
-ExecuteResult execute_select(Statement* statement, Table* table) {
-  Cursor* cursor = table_start(table);
-
-  Row row;
-  while (!(cursor->end_of_table)) {
-    deserialize_row(cursor_value(cursor), &row);
-    print_row(&row);
-    cursor_advance(cursor);
+//--batch模式里执行一行：不打印提示符和executed.，只输出查询结果和带行号的错误
+//语句不单独提交，由run_batch每读完一块提交一次；返回false表示遇到了.exit
+bool batch_execute_line(Table* table, const char * line, uint32_t length,
+                        uint32_t line_num, uint32_t * num_errors){
+  FILE * diagnostics = table_diagnostics(table);
+  if(line[0] == '.'){
+    Token command;
+    tokenize(line, line + length, ' ', &command, 1);
+    if(token_equals(command, ".exit")){
+      return false;
+    }
+    //元命令很少，先提交前面的语句，再拷一份交给do_meta_command
+    pager_commit(table->pager);
+    InputBuffer * input_buffer = new_input_buffer();
+    input_buffer->buffer = malloc(length + 1);
+    memcpy(input_buffer->buffer, line, length);
+    input_buffer->buffer[length] = '\0';
+    input_buffer->input_length = length;
+    if(do_meta_command(input_buffer, table) == META_COMMAND_UNRECOGNIZED_COMMAND){
+      fprintf(diagnostics, "line %d: unrecognized command\n", line_num);
+      (*num_errors)++;
+    }
+    close_input_buffer(input_buffer);
+    return true;
   }
 
-  free(cursor);
-
-  return EXECUTE_SUCCESS;
+  Statement statement;
+  const char * error = NULL;
+  switch(parse_statement(line, length, &statement)){
+    case(PREPARE_SUCCESS):
+      break;
+    case(PREPARE_NEGATIVE_ID):
+      error = "negative id";
+      break;
+    case(PREPARE_STRING_TOO_LONG):
+      error = "string is too long";
+      break;
+    case(PREPARE_SYNTAX_ERROR):
+      error = "syntax error";
+      break;
+    case(PREPARE_UNRECOGNIZE_STATEMENT):
+      error = "unrecognized statement";
+      break;
+  }
+  if(error == NULL){
+    switch(execute_statement_uncommitted(&statement, table)){
+      case(EXECUTE_SUCCESS):
+        break;
+      case(EXECUTE_DUPLICATE_KEY):
+        error = "duplicate key";
+        break;
+      case(EXECUTE_INDEX_EXISTS):
+        error = "index already exists";
+        break;
+    }
+  }
+  if(pager_txn_full(table->pager)){
+    pager_commit(table->pager);
+  }
+  arena_reset(&thread_arena);
+  if(error != NULL){
+    fprintf(diagnostics, "line %d: %s\n", line_num, error);
+    (*num_errors)++;
+  }
+  return true;
 }
 
-ExecuteResult execute_statement(Statement* statement , Table* table){
-  switch(statement->type) {
-    case(STATEMENT_INSERT):
-      return execute_insert(statement, table);
-    case(STATEMENT_SELECT):
-      return execute_select(statement, table);
+//--batch：按BATCH_READ_SIZE大块读输入，在缓冲区里找换行，逐行零拷贝解析后连续执行
+//每块执行完成组提交一次；一行比缓冲区还长时把缓冲区翻倍，读完后输出一行汇总
+void run_batch(Table* table, int fd){
+  setvbuf(stdout, NULL, _IOFBF, BATCH_READ_SIZE);
+  size_t capacity = BATCH_READ_SIZE;
+  char * buffer = malloc(capacity);
+  size_t length = 0;
+  uint32_t line_num = 0;
+  uint32_t num_statements = 0;
+  uint32_t num_errors = 0;
+  bool done = false;
+
+  while(!done){
+    if(length == capacity){
+      capacity *= 2;
+      buffer = realloc(buffer, capacity);
+    }
+    ssize_t bytes_read = read(fd, buffer + length, capacity - length);
+    if(bytes_read == -1){
+      if(errno == EINTR){
+        continue;
+      }
+      printf("read error\n");
+      exit(EXIT_FAILURE);
+    }
+    bool eof = bytes_read == 0;
+    length += bytes_read;
+
+    char * p = buffer;
+    char * end = buffer + length;
+    while(!done && p < end){
+      char * newline = memchr(p, '\n', end - p);
+      if(newline == NULL && !eof){
+        break;
+      }
+      char * line_end = newline == NULL ? end : newline;
+      line_num++;
+      uint32_t line_length = line_end - p;
+      if(line_length > 0 && p[line_length - 1] == '\r'){
+        line_length--;
+      }
+      if(line_length > 0){
+        num_statements++;
+        done = !batch_execute_line(table, p, line_length, line_num, &num_errors);
+      }
+      p = newline == NULL ? end : newline + 1;
+    }
+    pager_commit(table->pager);
+    length = end - p;
+    memmove(buffer, p, length);
+    done = done || eof;
   }
+
+  free(buffer);
+  if(fd != STDIN_FILENO){
+    close(fd);
+  }
+  fprintf(table_diagnostics(table), "%d statements, %d errors\n", num_statements, num_errors);
 }
 
+#ifndef DB_NO_MAIN
 int main(int argc, char * argv[]){
   if(argc < 2){
     printf("Must supply a db filename\n");
@@ -792,12 +6695,84 @@ int main(int argc, char * argv[]){
   }
 
   char * filename = argv[1];
-  Table* table = db_open(filename);
+  DbConfig config;
+  db_config_init(&config);
+  bool batch = false;
+  char * batch_filename = NULL;
+
+  for(int i = 2; i < argc; i++){
+    if(strcmp(argv[i], "--cache-pages") == 0 && i + 1 < argc){
+      config.cache_pages = atoi(argv[++i]);
+    }else if(strcmp(argv[i], "--mmap") == 0){
+      config.mode = PAGER_MMAP;
+    }else if(strcmp(argv[i], "--scan-threads") == 0 && i + 1 < argc){
+      config.scan_threads = atoi(argv[++i]);
+      if(config.scan_threads < 1 || config.scan_threads > SCAN_MAX_THREADS){
+        printf("--scan-threads must be between 1 and %d\n", SCAN_MAX_THREADS);
+        exit(EXIT_FAILURE);
+      }
+    }else if(strcmp(argv[i], "--wal-window-ms") == 0 && i + 1 < argc){
+      config.wal_sync_window_ms = atoi(argv[++i]);
+    }else if(strcmp(argv[i], "--checkpoint-mb") == 0 && i + 1 < argc){
+      config.wal_checkpoint_bytes = (uint64_t)atoi(argv[++i]) << 20;
+    }else if(strcmp(argv[i], "--checksums") == 0){
+      config.checksums = true;
+    }else if(strcmp(argv[i], "--huge-pages") == 0){
+      config.huge_pages = true;
+    }else if(strcmp(argv[i], "--readahead") == 0 && i + 1 < argc){
+      config.readahead_pages = atoi(argv[++i]);
+      if(config.readahead_pages > PAGER_READAHEAD_MAX_INFLIGHT){
+        printf("--readahead must be at most %d\n", PAGER_READAHEAD_MAX_INFLIGHT);
+        exit(EXIT_FAILURE);
+      }
+    }else if(strcmp(argv[i], "--output") == 0 && i + 1 < argc){
+      i++;
+      if(strcmp(argv[i], "text") == 0){
+        config.output_format = OUTPUT_TEXT;
+      }else if(strcmp(argv[i], "csv") == 0){
+        config.output_format = OUTPUT_CSV;
+      }else if(strcmp(argv[i], "binary") == 0){
+        config.output_format = OUTPUT_BINARY;
+      }else{
+        printf("--output must be text, csv or binary\n");
+        exit(EXIT_FAILURE);
+      }
+    }else if(strcmp(argv[i], "--batch") == 0){
+      batch = true;
+      if(i + 1 < argc && strncmp(argv[i + 1], "--", 2) != 0){
+        batch_filename = argv[++i];
+      }
+    }else{
+      printf("unknown option '%s'\n", argv[i]);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  Table* table = db_open(filename, &config);
+
+  if(batch){
+    int fd = STDIN_FILENO;
+    if(batch_filename != NULL){
+      fd = open(batch_filename, O_RDONLY);
+      if(fd == -1){
+        printf("unable to open '%s'\n", batch_filename);
+        exit(EXIT_FAILURE);
+      }
+    }
+    run_batch(table, fd);
+    db_close(table);
+    return 0;
+  }
 
   InputBuffer * input_buffer = new_input_buffer();
   while(true){
     print_prompt();
-    read_input(input_buffer);
+    //管道里的输入读完了和.exit一样正常关闭
+    if(!read_input(input_buffer)){
+      close_input_buffer(input_buffer);
+      db_close(table);
+      exit(EXIT_SUCCESS);
+    }
 
     if(input_buffer->buffer[0] == '.'){
       switch(do_meta_command(input_buffer, table)) {
@@ -815,13 +6790,13 @@ int main(int argc, char * argv[]){
         break;
       case(PREPARE_NEGATIVE_ID):
         printf("ID MUST BE POSITIVE\n");
-        break;
+        continue;
       case(PREPARE_STRING_TOO_LONG):
         printf("string is too long\n");
-        break;
+        continue;
       case(PREPARE_SYNTAX_ERROR):
         printf("syntax error\n");
-        break;
+        continue;
       case(PREPARE_UNRECOGNIZE_STATEMENT):
         printf("unrecognized command at start of %s .\n", input_buffer->buffer);
         continue;
@@ -834,6 +6809,10 @@ int main(int argc, char * argv[]){
       case(EXECUTE_DUPLICATE_KEY):
         printf("error: duplicate key.\n");
         break;
+      case(EXECUTE_INDEX_EXISTS):
+        printf("error: index already exists.\n");
+        break;
     }
   }
-}
\ No newline at end of file
+}
+#endif